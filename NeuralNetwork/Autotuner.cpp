@@ -0,0 +1,241 @@
+#include "Autotuner.h"
+#include "Topology.h"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <stdexcept>
+
+namespace nn
+{
+
+namespace
+{
+	// A matrix shape and the tile shapes forwardBatch() splits it into
+	void addShapes(int nrows, int ncolumns, std::vector<std::pair<int, int>> &shapes)
+	{
+		const int tileRows = NeuralNetwork::batchTileRows(nrows, ncolumns);
+		
+		shapes.push_back(std::make_pair(nrows, ncolumns));
+		shapes.push_back(std::make_pair(tileRows, ncolumns));
+		if (nrows % tileRows != 0)
+			shapes.push_back(std::make_pair(nrows % tileRows, ncolumns));
+	}
+	
+	// Shapes of the products of the dense layers, V of the factorized ones included
+	std::vector<std::pair<int, int>> denseShapes(const NeuralNetwork &network)
+	{
+		std::vector<std::pair<int, int>> shapes;
+		for (const NeuralNetwork::Layer &layer : network.layers())
+		{
+			if (layer._type != LayerType::DENSE)
+				continue;
+			
+			addShapes(layer._weights.numRows(), layer._weights.numColumns(), shapes);
+			if (layer.factorized())
+				addShapes(layer._factor.numRows(), layer._factor.numColumns(), shapes);
+		}
+		
+		std::sort(shapes.begin(), shapes.end());
+		shapes.erase(std::unique(shapes.begin(), shapes.end()), shapes.end());
+		return shapes;
+	}
+};
+
+Autotuner::Autotuner(const std::string &path) : 
+	_path(path), 
+	_cpuModel(Topology::instance().cpuModel())
+{
+	load();
+}
+
+std::vector<GemvConfig> Autotuner::candidates()
+{
+	std::vector<GemvConfig> configs;
+	configs.push_back({ 0, 1 });
+	
+	for (int rows : { 1, 2, 4 })
+	{
+		for (int accumulators : { 1, 2, 4 })
+		{
+			GemvConfig config = { rows, accumulators };
+			if (config.valid())
+				configs.push_back(config);
+		}
+	}
+	
+	return configs;
+}
+
+GemvConfig Autotuner::config(int nrows, int ncolumns) const
+{
+	std::map<std::string, std::map<std::pair<int, int>, GemvConfig>>::const_iterator model = _entries.find(_cpuModel);
+	if (model == _entries.end())
+		return GemvConfig();
+	
+	std::map<std::pair<int, int>, GemvConfig>::const_iterator it = model->second.find(std::make_pair(nrows, ncolumns));
+	return (it != model->second.end()) ? it->second : GemvConfig();
+}
+
+int Autotuner::tune(const NeuralNetwork &network)
+{
+	Jit &jit = Jit::instance();
+	
+	// Nothing to choose from
+	if (! jit.isEnabled())
+		return 0;
+	
+	std::map<std::pair<int, int>, GemvConfig> &entries = _entries[_cpuModel];
+	
+	int ntuned = 0;
+	for (const std::pair<int, int> &shape : denseShapes(network))
+	{
+		if (entries.find(shape) == entries.end())
+		{
+			GemvConfig best;
+			double bestSeconds = 0.0;
+			
+			for (const GemvConfig &config : candidates())
+			{
+				double seconds = benchmark(shape.first, shape.second, config);
+				if (config.generic() || seconds < bestSeconds)
+				{
+					best = config;
+					bestSeconds = seconds;
+				}
+			}
+			
+			entries[shape] = best;
+			++ntuned;
+		}
+		
+		jit.setConfig(shape.first, shape.second, entries[shape]);
+	}
+	
+	if (ntuned > 0)
+		save();
+	
+	return ntuned;
+}
+
+double Autotuner::benchmark(int nrows, int ncolumns, const GemvConfig &config)
+{
+	nn::BlockMatrix weights(nrows, ncolumns);
+	nn::Matrix x(ncolumns, 1, MatrixInit::UNINITIALIZED);
+	nn::Matrix biases(nrows, 1, MatrixInit::UNINITIALIZED);
+	nn::Matrix y(nrows, 1, MatrixInit::UNINITIALIZED);
+	
+	nn::map(weights, [] (float v) { return 0.5f; });
+	nn::map(x, [] (float v) { return 0.25f; });
+	nn::map(biases, [] (float v) { return 1.0f; });
+	
+	std::vector<const float *> rows(nrows);
+	for (int r = 0; r < nrows; ++r)
+	{
+		rows[r] = weights.row(r);
+	}
+	
+	GemvKernel kernel = config.generic() ? nullptr : Jit::instance().gemv(nrows, ncolumns, true, config);
+	if (! config.generic() && kernel == nullptr)
+		return 1e30;
+	
+	// What NeuralNetwork::forward does with either path, before the activation
+	auto product = [&] ()
+	{
+		if (kernel != nullptr)
+			kernel(rows.data(), x.ptr(), biases.ptr(), y.ptr());
+		else
+		{
+			nn::dot(weights, x, y);
+			nn::imap(y, [&] (int ir, int, float v) { return v + biases(ir, 0); });
+		}
+	};
+	
+	// Enough repetitions for about 1 ms per trial, so that the clock resolution does not matter, best of 5 trials
+	typedef std::chrono::steady_clock clock;
+	
+	product();
+	clock::time_point start = clock::now();
+	product();
+	const double once = std::max(1e-7, std::chrono::duration<double>(clock::now() - start).count());
+	const int repetitions = std::max(1, (int)(1e-3 / once));
+	
+	double best = 1e30;
+	for (int trial = 0; trial < 5; ++trial)
+	{
+		start = clock::now();
+		for (int i = 0; i < repetitions; ++i)
+		{
+			product();
+		}
+		best = std::min(best, std::chrono::duration<double>(clock::now() - start).count() / repetitions);
+	}
+	
+	return best;
+}
+
+void Autotuner::load()
+{
+	FILE *file = fopen(_path.c_str(), "r");
+	if (file == nullptr)
+		return;
+	
+	// model \t rows \t columns \t kernel rows \t accumulators
+	char line[512];
+	while (fgets(line, sizeof(line), file) != nullptr)
+	{
+		if (line[0] == '#')
+			continue;
+		
+		char *tab = strchr(line, '\t');
+		if (tab == nullptr)
+			continue;
+		*tab = '\0';
+		
+		int nrows, ncolumns;
+		GemvConfig config;
+		if (sscanf(tab + 1, "%d\t%d\t%d\t%d", &nrows, &ncolumns, &config._rows, &config._accumulators) != 4)
+			continue;
+		
+		if (nrows > 0 && ncolumns > 0 && config.valid())
+			_entries[line][std::make_pair(nrows, ncolumns)] = config;
+	}
+	
+	fclose(file);
+}
+
+void Autotuner::save() const
+{
+	// Replaced in one step, other processes sharing the file never read a partial one
+	const std::string temporary = _path + ".tmp";
+	
+	FILE *file = fopen(temporary.c_str(), "w");
+	if (file == nullptr)
+		throw std::runtime_error("nn::Autotuner - unable to write '" + temporary + "'");
+	
+	fprintf(file, "# CPU model\trows\tcolumns\tkernel rows (0 for the generic kernel)\taccumulators\n");
+	for (const auto &model : _entries)
+	{
+		for (const auto &entry : model.second)
+		{
+			fprintf(file, "%s\t%d\t%d\t%d\t%d\n", model.first.c_str(), entry.first.first, entry.first.second, entry.second._rows, entry.second._accumulators);
+		}
+	}
+	
+	bool ok = fclose(file) == 0;
+	
+#ifdef _WIN32
+	// rename() does not replace an existing file on Windows
+	if (ok)
+		remove(_path.c_str());
+#endif
+	
+	if (! ok || rename(temporary.c_str(), _path.c_str()) != 0)
+	{
+		remove(temporary.c_str());
+		throw std::runtime_error("nn::Autotuner - unable to write '" + _path + "'");
+	}
+}
+
+}; // namespace nn
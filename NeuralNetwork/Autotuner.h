@@ -0,0 +1,54 @@
+#ifndef __NN_AUTOTUNER_H__
+#define __NN_AUTOTUNER_H__
+
+#include "NeuralNetwork.h"
+#include "Jit.h"
+#include <map>
+#include <string>
+#include <vector>
+
+namespace nn
+{
+
+// Picks the fastest kernel layout for every dense layer shape of a network, and for the tiles forwardBatch() splits them
+// into, by timing the candidates on this machine, see GemvConfig. Winners are kept in a text database keyed by CPU model and shape, loaded when the tuner is created:
+// a shape is only timed the first time it is met, and machines of different models sharing the file keep their own entries.
+//
+// Usage:
+//   Autotuner tuner("gemm.tune");
+//   tuner.tune(network);    // the networks built afterwards use the tuned kernels
+class Autotuner
+{
+public:
+	// Loads the database, a missing file is an empty one and malformed lines are ignored
+	Autotuner(const std::string &path);
+	
+	// Times the candidates of the shapes that have no entry for this CPU and saves the database when any was added,
+	// then hands the entries of every shape of the network to Jit. Returns the number of shapes timed.
+	int tune(const NeuralNetwork &network);
+	
+	// Generic first, it wins ties
+	static std::vector<GemvConfig> candidates();
+	
+	const std::string &cpuModel() const { return _cpuModel; }
+	
+	// Entry of this CPU for a shape, the default layout when there is none
+	GemvConfig config(int nrows, int ncolumns) const;
+	
+protected:
+	void load();
+	void save() const;
+	
+	// Best time of a product of that shape, in seconds
+	static double benchmark(int nrows, int ncolumns, const GemvConfig &config);
+	
+	std::string _path;
+	std::string _cpuModel;
+	
+	// CPU model -> (rows, columns) -> layout, the entries of other models are written back untouched
+	std::map<std::string, std::map<std::pair<int, int>, GemvConfig>> _entries;
+};
+
+}; // namespace nn
+
+#endif // __NN_AUTOTUNER_H__
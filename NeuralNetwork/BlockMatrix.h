@@ -0,0 +1,170 @@
+#ifndef __NN_BLOCK_MATRIX_H__
+#define __NN_BLOCK_MATRIX_H__
+
+#include "Matrix.h"
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+namespace nn
+{
+
+// Copy-on-write matrix stored as blocks of whole rows of about BlockSize bytes (a single row when rows are larger).
+// Copies share every block, a block is duplicated the first time it is written through a matrix sharing it,
+// so a copy costs one reference per block and a sparse change only the blocks it touches.
+//
+// Blocks come from the MatrixMemoryAllocator arena of the thread creating them, so they get its huge pages and NUMA
+// node, and go back to the free list of that arena with their last reference.
+// Sharing is thread safe: matrices sharing a block can be copied, read and written from different threads.
+template <class T> class BlockMatrixT
+{
+public:
+	using value_type = T;
+	
+	static const int BlockSize = 4096;
+	
+	BlockMatrixT()
+	{
+		_numRows = 0;
+		_numColumns = 0;
+		_blockRows = 1;
+	}
+	
+	BlockMatrixT(int nrows, int ncolumns)
+	{
+		_numRows = nrows;
+		_numColumns = ncolumns;
+		_blockRows = std::max(1, BlockSize / std::max(1, (int)sizeof(T) * ncolumns));
+		
+		_blocks.resize((nrows + _blockRows - 1) / _blockRows);
+		for (int i = 0; i < numBlocks(); ++i)
+		{
+			_blocks[i] = std::make_shared<Block>((size_t)blockNumRows(i) * _numColumns);
+			std::fill(_blocks[i]->data(), _blocks[i]->data() + _blocks[i]->size(), (T)0);
+		}
+	}
+	
+	inline int numRows() const { return _numRows; }
+	inline int numColumns() const { return _numColumns; }
+	
+	inline int numBlocks() const { return (int)_blocks.size(); }
+	inline int blockRows() const { return _blockRows; }
+	inline int blockFirstRow(int i) const { return i * _blockRows; }
+	inline int blockNumRows(int i) const { return std::min(_blockRows, _numRows - blockFirstRow(i)); }
+	
+	MatrixView<const T> block(int i) const
+	{
+		return MatrixView<const T>(_blocks[i]->data(), blockNumRows(i), _numColumns);
+	}
+	
+	// Write access to a block, duplicated first when another matrix shares it
+	MatrixView<T> mutableBlock(int i)
+	{
+		if (_blocks[i].use_count() > 1)
+			_blocks[i] = std::make_shared<Block>(*_blocks[i]);
+		
+		return MatrixView<T>(_blocks[i]->data(), blockNumRows(i), _numColumns);
+	}
+	
+	bool isShared(int i) const { return _blocks[i].use_count() > 1; }
+	
+	// Copies the blocks that are not in the arena of the calling thread there, the others stay shared
+	void relocate()
+	{
+		const int node = MatrixMemoryAllocator::instance()->arenaNode();
+		for (std::shared_ptr<Block> &block : _blocks)
+		{
+			if (block->node() != node)
+				block = std::make_shared<Block>(*block);
+		}
+	}
+	
+	// True when both matrices hold the same storage for block i
+	bool sharesBlock(const BlockMatrixT<T> &m, int i) const { return _blocks[i] == m._blocks[i]; }
+	
+	// Identifies the storage of block i, equal for every matrix sharing it
+	const void *blockId(int i) const { return _blocks[i].get(); }
+	
+	const T *row(int r) const
+	{
+		return _blocks[r / _blockRows]->data() + (size_t)(r % _blockRows) * _numColumns;
+	}
+	
+	inline T operator () (int r, int c) const { return row(r)[c]; }
+	
+protected:
+	// Elements of one block, in allocator storage
+	class Block
+	{
+	public:
+		explicit Block(size_t size) : _size(size)
+		{
+			_data = (T *)MatrixMemoryAllocator::instance()->allocateBlock((uint32_t)(size * sizeof(T)), _node);
+		}
+		
+		Block(const Block &b) : Block(b._size)
+		{
+			std::copy(b._data, b._data + _size, _data);
+		}
+		
+		~Block()
+		{
+			MatrixMemoryAllocator::instance()->releaseBlock((uint8_t *)_data, (uint32_t)(_size * sizeof(T)), _node);
+		}
+		
+		Block &operator = (const Block &) = delete;
+		
+		T *data() { return _data; }
+		const T *data() const { return _data; }
+		size_t size() const { return _size; }
+		int node() const { return _node; }
+	
+	protected:
+		T *_data;
+		size_t _size;
+		int _node;
+	};
+	
+	int _numRows;
+	int _numColumns;
+	int _blockRows;
+	
+	std::vector<std::shared_ptr<Block>> _blocks;
+};
+
+using BlockMatrix = BlockMatrixT<float>;
+
+// Rows of c are computed block by block, each block is a contiguous row range of a
+template <class T> void dot(const BlockMatrixT<T> &a, typename ConstViewOf<T>::type b, MatrixView<T> c)
+{
+#ifdef NN_MATRIX_RUNTIME_CHECKS
+	if (a.numColumns() != b.numRows())
+		throw std::runtime_error("nn::dot - a/b shape mismatch");
+	
+	if (a.numRows() != c.numRows() || b.numColumns() != c.numColumns())
+		throw std::runtime_error("nn::dot - c shape mismatch");
+#endif
+
+	for (int i = 0; i < a.numBlocks(); ++i)
+	{
+		dot<T>(a.block(i), b, c.rows(a.blockFirstRow(i), a.blockNumRows(i)));
+	}
+}
+
+template <class T> void dot(const BlockMatrixT<T> &a, const MatrixT<T> &b, MatrixT<T> &c)
+{
+	dot<T>(a, b.view(), c.view());
+}
+
+// Every element in row-major order, every block is written and so unshared
+template <class T, class F> void map(BlockMatrixT<T> &a, F f)
+{
+	for (int i = 0; i < a.numBlocks(); ++i)
+	{
+		map(a.mutableBlock(i), f);
+	}
+}
+
+}; // namespace nn
+
+#endif // __NN_BLOCK_MATRIX_H__
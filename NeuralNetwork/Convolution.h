@@ -0,0 +1,205 @@
+#ifndef __NN_CONVOLUTION_H__
+#define __NN_CONVOLUTION_H__
+
+#include "Matrix.h"
+#include "BlockMatrix.h"
+#include <algorithm>
+
+namespace nn
+{
+
+// Geometry of a convolution or pooling window over an image stored channel by channel, row by row (CHW).
+// Windows are not padded, the output is ((height - kernel) / stride + 1) x ((width - kernel) / stride + 1).
+struct ConvolutionShape
+{
+	int _channels;
+	int _height;
+	int _width;
+	int _kernel;
+	int _stride;
+	
+	int outputHeight() const { return (_height - _kernel) / _stride + 1; }
+	int outputWidth() const { return (_width - _kernel) / _stride + 1; }
+	int outputSize() const { return outputHeight() * outputWidth(); }
+	
+	// Weights per filter, a row of the weight matrix: channel, kernel row, kernel column
+	int windowSize() const { return _channels * _kernel * _kernel; }
+	
+	// im2col pays off once the window is large enough for the product to amortize the unfolding, and the unfolded input fits in L2
+	bool preferIm2col() const { return windowSize() >= 64 && (size_t)windowSize() * outputSize() * sizeof(float) <= 512 * 1024; }
+	
+	// Elements of the unfolded input, 0 on the direct path
+	int columnsSize() const { return preferIm2col() ? windowSize() * outputSize() : 0; }
+};
+
+// Unfolds the windows of input into the columns of a windowSize() x outputSize() matrix
+template <class T> void im2col(const ConvolutionShape &shape, const T *input, MatrixView<T> columns)
+{
+#ifdef NN_MATRIX_RUNTIME_CHECKS
+	if (columns.numRows() != shape.windowSize() || columns.numColumns() != shape.outputSize())
+		throw std::runtime_error("nn::im2col - columns shape mismatch");
+#endif
+
+	const int oh = shape.outputHeight();
+	const int ow = shape.outputWidth();
+	
+	int row = 0;
+	for (int c = 0; c < shape._channels; ++c)
+	{
+		for (int ky = 0; ky < shape._kernel; ++ky)
+		{
+			for (int kx = 0; kx < shape._kernel; ++kx, ++row)
+			{
+				T *out = &columns(row, 0);
+				for (int oy = 0; oy < oh; ++oy)
+				{
+					const T *in = input + ((size_t)c * shape._height + oy * shape._stride + ky) * shape._width + kx;
+					for (int ox = 0; ox < ow; ++ox)
+					{
+						*out++ = in[ox * shape._stride];
+					}
+				}
+			}
+		}
+	}
+}
+
+// output (filters x outputSize()) = weights (filters x windowSize()) * columns, one output row at a time so every access is sequential
+template <class T> void convolveIm2col(typename ConstViewOf<T>::type weights, typename ConstViewOf<T>::type columns, MatrixView<T> output)
+{
+	for (int f = 0; f < output.numRows(); ++f)
+	{
+		T *out = &output(f, 0);
+		std::fill(out, out + output.numColumns(), (T)0);
+		
+		for (int i = 0; i < weights.numColumns(); ++i)
+		{
+			const T w = weights(f, i);
+			const T *in = &columns(i, 0);
+			for (int p = 0; p < output.numColumns(); ++p)
+			{
+				out[p] += w * in[p];
+			}
+		}
+	}
+}
+
+// Direct convolution, tiled over output rows so the input rows of a tile stay in L1 while every filter passes over them
+template <class T> void convolveDirect(const ConvolutionShape &shape, typename ConstViewOf<T>::type weights, const T *input, MatrixView<T> output)
+{
+	const int oh = shape.outputHeight();
+	const int ow = shape.outputWidth();
+	
+	const int tileInputBytes = 16 * 1024;
+	const int rowBytes = std::max(1, shape._channels * shape._stride * shape._width * (int)sizeof(T));
+	const int tileRows = std::max(1, tileInputBytes / rowBytes);
+	
+	for (int f = 0; f < output.numRows(); ++f)
+	{
+		std::fill(&output(f, 0), &output(f, 0) + output.numColumns(), (T)0);
+	}
+	
+	for (int oy0 = 0; oy0 < oh; oy0 += tileRows)
+	{
+		const int oy1 = std::min(oh, oy0 + tileRows);
+		
+		for (int f = 0; f < output.numRows(); ++f)
+		{
+			for (int c = 0; c < shape._channels; ++c)
+			{
+				for (int ky = 0; ky < shape._kernel; ++ky)
+				{
+					for (int kx = 0; kx < shape._kernel; ++kx)
+					{
+						const T w = weights(f, (c * shape._kernel + ky) * shape._kernel + kx);
+						
+						for (int oy = oy0; oy < oy1; ++oy)
+						{
+							T *out = &output(f, oy * ow);
+							const T *in = input + ((size_t)c * shape._height + oy * shape._stride + ky) * shape._width + kx;
+							for (int ox = 0; ox < ow; ++ox)
+							{
+								out[ox] += w * in[ox * shape._stride];
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+// Convolution without bias of the image input by every filter (row) of weights, the path is chosen by shape.
+// columns is scratch for the im2col path, at least shape.columnsSize() elements.
+template <class T> void convolve(const ConvolutionShape &shape, typename ConstViewOf<T>::type weights, const T *input, T *columns, MatrixView<T> output)
+{
+#ifdef NN_MATRIX_RUNTIME_CHECKS
+	if (weights.numColumns() != shape.windowSize())
+		throw std::runtime_error("nn::convolve - weights shape mismatch");
+	
+	if (output.numRows() != weights.numRows() || output.numColumns() != shape.outputSize())
+		throw std::runtime_error("nn::convolve - output shape mismatch");
+#endif
+
+	if (shape.preferIm2col())
+	{
+		MatrixView<T> unfolded(columns, shape.windowSize(), shape.outputSize());
+		im2col<T>(shape, input, unfolded);
+		convolveIm2col<T>(weights, unfolded, output);
+	}
+	else
+		convolveDirect<T>(shape, weights, input, output);
+}
+
+// Block by block, each block is a range of filters. The input is unfolded once for all of them.
+template <class T> void convolve(const ConvolutionShape &shape, const BlockMatrixT<T> &weights, const T *input, T *columns, MatrixView<T> output)
+{
+	if (shape.preferIm2col())
+	{
+		MatrixView<T> unfolded(columns, shape.windowSize(), shape.outputSize());
+		im2col<T>(shape, input, unfolded);
+		for (int i = 0; i < weights.numBlocks(); ++i)
+		{
+			convolveIm2col<T>(weights.block(i), unfolded, output.rows(weights.blockFirstRow(i), weights.blockNumRows(i)));
+		}
+	}
+	else
+	{
+		for (int i = 0; i < weights.numBlocks(); ++i)
+		{
+			convolveDirect<T>(shape, weights.block(i), input, output.rows(weights.blockFirstRow(i), weights.blockNumRows(i)));
+		}
+	}
+}
+
+// Maximum of every window of every channel, output is channels x outputSize()
+template <class T> void maxPool(const ConvolutionShape &shape, const T *input, MatrixView<T> output)
+{
+	const int oh = shape.outputHeight();
+	const int ow = shape.outputWidth();
+	
+	for (int c = 0; c < shape._channels; ++c)
+	{
+		for (int oy = 0; oy < oh; ++oy)
+		{
+			for (int ox = 0; ox < ow; ++ox)
+			{
+				const T *in = input + ((size_t)c * shape._height + oy * shape._stride) * shape._width + ox * shape._stride;
+				
+				T v = in[0];
+				for (int ky = 0; ky < shape._kernel; ++ky)
+				{
+					for (int kx = 0; kx < shape._kernel; ++kx)
+					{
+						v = std::max(v, in[ky * shape._width + kx]);
+					}
+				}
+				output(c, oy * ow + ox) = v;
+			}
+		}
+	}
+}
+
+}; // namespace nn
+
+#endif // __NN_CONVOLUTION_H__
@@ -0,0 +1,111 @@
+#include "DataPipeline.h"
+#include <algorithm>
+#include <stdexcept>
+
+namespace nn
+{
+
+DataPipeline::DataPipeline(SampleSource *source, int batchSize, int depth, unsigned int seed) : _sampler(seed)
+{
+	if (source->size() == 0)
+	{
+		throw std::runtime_error("nn::DataPipeline - empty sample source");
+	}
+	
+	_source = source;
+	_batchSize = std::max(batchSize, 1);
+	
+	// Buffers are allocated once, samples are decoded in place afterwards
+	_batches.resize(std::max(depth, 1));
+	for (Batch &batch : _batches)
+	{
+		batch._storage.resize(_batchSize);
+		batch._samples.resize(_batchSize);
+		for (int i = 0; i < _batchSize; ++i)
+		{
+			batch._samples[i] = &batch._storage[i];
+		}
+		batch._index = 0;
+	}
+	
+	_thread = std::thread(&DataPipeline::run, this);
+}
+
+DataPipeline::~DataPipeline()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stop = true;
+	}
+	
+	_freeCondition.notify_all();
+	_thread.join();
+}
+
+void DataPipeline::run()
+{
+	while (true)
+	{
+		Batch *batch;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_freeCondition.wait(lock, [&] { return _stop || _produced - _consumed < _batches.size(); });
+			
+			if (_stop)
+				break;
+			
+			batch = &_batches[_produced % _batches.size()];
+		}
+		
+		try
+		{
+			fill(*batch);
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_error = std::current_exception();
+			_readyCondition.notify_all();
+			break;
+		}
+		
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			batch->_index = _produced;
+			++_produced;
+		}
+		
+		_readyCondition.notify_all();
+	}
+}
+
+void DataPipeline::fill(Batch &batch)
+{
+	for (NeuralNetwork::Sample &sample : batch._storage)
+	{
+		_source->read(_sampler.next(_source->size()), sample);
+	}
+}
+
+const DataPipeline::Batch &DataPipeline::acquire()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	_readyCondition.wait(lock, [&] { return _error || _produced > _consumed; });
+	
+	if (_produced == _consumed)
+		std::rethrow_exception(_error);
+	
+	return _batches[_consumed % _batches.size()];
+}
+
+void DataPipeline::release()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		++_consumed;
+	}
+	
+	_freeCondition.notify_all();
+}
+
+}; // namespace nn
@@ -0,0 +1,85 @@
+#ifndef __NN_DATA_PIPELINE_H__
+#define __NN_DATA_PIPELINE_H__
+
+#include "NeuralNetwork.h"
+#include "IndexSampler.h"
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+namespace nn
+{
+
+// Random access sample storage, samples are decoded on demand so the dataset does not have to fit in memory
+class SampleSource
+{
+public:
+	virtual ~SampleSource() {}
+	
+	virtual size_t size() const = 0;
+	
+	// Decodes and normalizes a sample, reusing the matrices of the sample when their size matches
+	virtual void read(size_t index, NeuralNetwork::Sample &sample) = 0;
+};
+
+// Producer/consumer minibatch pipeline. A background thread decodes the next batches into
+// depth - 1 spare buffers while the current one is in use.
+//
+// Usage:
+//   DataPipeline pipeline(&source, batchSize, depth);
+//   const DataPipeline::Batch &batch = pipeline.acquire();
+//   population.feed_forward(batch._samples);
+//   pipeline.release();
+//
+// Samples are drawn without replacement from a permutation of the source, reshuffled every epoch.
+class DataPipeline
+{
+public:
+	DataPipeline(SampleSource *source, int batchSize, int depth = 2, unsigned int seed = 0);
+	~DataPipeline();
+	
+	struct Batch
+	{
+		std::vector<NeuralNetwork::Sample> _storage;
+		std::vector<const NeuralNetwork::Sample *> _samples;
+		uint64_t _index;
+	};
+	
+	// Blocks until the next batch is ready, rethrows errors of the producer
+	const Batch &acquire();
+	
+	// Hands the acquired batch back to the producer
+	void release();
+	
+	int batchSize() const { return _batchSize; }
+	int depth() const { return (int)_batches.size(); }
+	
+protected:
+	void run();
+	void fill(Batch &batch);
+	
+	SampleSource *_source;
+	int _batchSize;
+	std::vector<Batch> _batches;
+	
+	// Batches [_consumed, _produced) are ready or in use, the producer waits while all of them are
+	uint64_t _produced = 0;
+	uint64_t _consumed = 0;
+	bool _stop = false;
+	std::exception_ptr _error;
+	
+	std::mutex _mutex;
+	std::condition_variable _readyCondition;
+	std::condition_variable _freeCondition;
+	
+	// Only touched by the producer thread
+	IndexSampler _sampler;
+	
+	std::thread _thread;
+};
+
+}; // namespace nn
+
+#endif // __NN_DATA_PIPELINE_H__
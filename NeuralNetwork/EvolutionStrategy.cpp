@@ -0,0 +1,283 @@
+#include "EvolutionStrategy.h"
+#include <algorithm>
+#include <numeric>
+#include <atomic>
+#include <thread>
+#include <stdexcept>
+#include <cmath>
+
+namespace nn
+{
+
+NoiseTable::NoiseTable(size_t size, unsigned int seed) : _noise(size)
+{
+	std::mt19937 random(seed);
+	std::normal_distribution<float> distribution(0.0f, 1.0f);
+	for (float &v : _noise)
+	{
+		v = distribution(random);
+	}
+}
+
+size_t NoiseTable::sampleOffset(std::mt19937 &random, size_t n) const
+{
+	std::uniform_int_distribution<size_t> distribution(0, _noise.size() - n);
+	return distribution(random);
+}
+
+EvolutionStrategy::EvolutionStrategy(int nInputs, const std::vector<LayerInfo> &layers, LossFunction lf, const Config &config) :
+	_config(config),
+	_center(nInputs, layers, lf, config._seed),
+	_noise(config._noiseSize, config._seed + 1),
+	_random(config._seed + 2)
+{
+	_numParameters = 0;
+	for (const NeuralNetwork::Layer &layer : _center.layers())
+	{
+		_layerOffsets.push_back(_numParameters);
+		_numParameters += (size_t)layer._weights.numRows() * layer._weights.numColumns() + layer._biases.numRows();
+		_numParameters += (size_t)layer._factor.numRows() * layer._factor.numColumns();
+	}
+	
+	if (config._pairs < 1)
+		throw std::runtime_error("nn::EvolutionStrategy - at least one pair is needed");
+	
+	if (_noise.size() < _numParameters)
+		throw std::runtime_error("nn::EvolutionStrategy - noise table smaller than the parameter vector");
+	
+	_cpus = Topology::instance().selectCpus(config._scheduler);
+	if (_cpus.empty())
+		throw std::runtime_error("nn::EvolutionStrategy - no CPU matches the scheduler config");
+	
+	_nWorkers = (config._scheduler._threads > 0) ? config._scheduler._threads : (int)_cpus.size();
+	_workspaces.resize(_nWorkers);
+	
+	_statistics._meanLoss = 0.0;
+	_statistics._bestLoss = 0.0;
+	_statistics._updateNorm = 0.0;
+}
+
+template <class F> void EvolutionStrategy::parallel(int n, F f)
+{
+	std::atomic<int> next(0);
+	std::vector<std::thread> threads;
+	
+	for (int i = 0; i < std::min(_nWorkers, n); ++i)
+	{
+		threads.push_back(std::thread([&, i] {
+			for (int task = next++; task < n; task = next++)
+			{
+				f(i, task);
+			}
+		}));
+		
+		if (_config._scheduler._pin)
+			Topology::pinThread(threads.back(), _cpus[i % _cpus.size()]);
+		else
+			Topology::restrictThread(threads.back(), _cpus);
+	}
+	
+	for (std::thread &thread : threads)
+	{
+		thread.join();
+	}
+}
+
+double EvolutionStrategy::evaluate(const std::vector<const Sample *> &samples, size_t offset, float sign, Workspace &workspace) const
+{
+	const NeuralNetwork::LayerList &layers = _center.layers();
+	
+	if (workspace._outputs.size() != layers.size())
+	{
+		workspace._outputs.resize(layers.size());
+		workspace._noise.resize(layers.size());
+		workspace._projections.resize(layers.size());
+		workspace._projectionNoise.resize(layers.size());
+		for (size_t i = 0; i < layers.size(); ++i)
+		{
+			workspace._outputs[i].resize(layers[i].numOutputs(), 1, MatrixInit::UNINITIALIZED);
+			workspace._noise[i].resize(layers[i].numOutputs(), 1, MatrixInit::UNINITIALIZED);
+			
+			if (layers[i].factorized())
+			{
+				workspace._projections[i].resize(layers[i].rank(), 1, MatrixInit::UNINITIALIZED);
+				workspace._projectionNoise[i].resize(layers[i].rank(), 1, MatrixInit::UNINITIALIZED);
+			}
+		}
+		
+		workspace._columns.resize(_center.columnsSize(), 1, MatrixInit::UNINITIALIZED);
+	}
+	
+	const float scale = sign * _config._sigma;
+	
+	double loss = 0.0;
+	for (const Sample *sample : samples)
+	{
+		const nn::Matrix *payload = &sample->_input;
+		
+		for (size_t i = 0; i < layers.size(); ++i)
+		{
+			const NeuralNetwork::Layer &layer = layers[i];
+			nn::Matrix &output = workspace._outputs[i];
+			nn::Matrix &noise = workspace._noise[i];
+			
+			if (layer._type == LayerType::MAXPOOL)
+			{
+				nn::maxPool<float>(layer._shape, payload->ptr(), MatrixView<float>(output.ptr(), layer.numChannels(), layer._shape.outputSize()));
+				payload = &output;
+				continue;
+			}
+			
+			// (W + s e_W) x + b + s e_b, the noise slices are read in place from the table
+			const int nrows = layer._weights.numRows();
+			const int ncolumns = layer._weights.numColumns();
+			const float *weightNoise = _noise.at(offset + _layerOffsets[i]);
+			const float *biasNoise = weightNoise + (size_t)nrows * ncolumns;
+			
+			// A factorized layer perturbs U and V, its input is the perturbed projection (V + s e_V) x
+			if (layer.factorized())
+			{
+				nn::Matrix &projection = workspace._projections[i];
+				nn::Matrix &projectionNoise = workspace._projectionNoise[i];
+				const float *factorNoise = biasNoise + nrows;
+				
+				nn::dot(layer._factor, *payload, projection);
+				nn::dot<float>(MatrixView<const float>(factorNoise, layer.rank(), layer.numInputs()), payload->view(), projectionNoise.view());
+				imap(projection, [&] (int ir, int, float v) { return v + scale * projectionNoise(ir, 0); });
+				
+				payload = &projection;
+			}
+			
+			if (layer._type == LayerType::CONV2D)
+			{
+				// Convolution is linear in the filters, the noise filters are convolved separately
+				MatrixView<float> maps(output.ptr(), nrows, layer._shape.outputSize());
+				MatrixView<float> noiseMaps(noise.ptr(), nrows, layer._shape.outputSize());
+				
+				nn::convolve<float>(layer._shape, layer._weights, payload->ptr(), workspace._columns.ptr(), maps);
+				nn::convolve<float>(layer._shape, MatrixView<const float>(weightNoise, nrows, ncolumns), payload->ptr(), workspace._columns.ptr(), noiseMaps);
+				
+				imap(maps, [&] (int ir, int ic, float v) {
+					return v + layer._biases(ir, 0) + scale * (noiseMaps(ir, ic) + biasNoise[ir]);
+				});
+			}
+			else
+			{
+				nn::dot(layer._weights, *payload, output);
+				nn::dot<float>(MatrixView<const float>(weightNoise, nrows, ncolumns), payload->view(), noise.view());
+				
+				imap(output, [&] (int ir, int, float v) {
+					return v + layer._biases(ir, 0) + scale * (noise(ir, 0) + biasNoise[ir]);
+				});
+			}
+			layer.activate(output);
+			
+			payload = &output;
+		}
+		
+		loss += _center.compute_loss(*payload, sample->_target);
+	}
+	
+	return loss / samples.size();
+}
+
+double EvolutionStrategy::update(MatrixView<float> parameters, size_t first, const std::vector<float> &weights)
+{
+	const size_t n = (size_t)parameters.numRows() * parameters.numColumns();
+	std::vector<float> gradient(n, 0.0f);
+	
+	// Pair by pair, each one is a contiguous run of the noise table
+	for (size_t k = 0; k < _offsets.size(); ++k)
+	{
+		if (weights[k] == 0.0f)
+			continue;
+		
+		const float *e = _noise.at(_offsets[k] + first);
+		for (size_t j = 0; j < n; ++j)
+		{
+			gradient[j] += weights[k] * e[j];
+		}
+	}
+	
+	const float step = _config._learningRate / (_offsets.size() * _config._sigma);
+	
+	double norm = 0.0;
+	size_t j = 0;
+	map(parameters, [&] (float v) {
+		float delta = step * gradient[j++] - _config._learningRate * _config._weightDecay * v;
+		norm += (double)delta * delta;
+		return v + delta;
+	});
+	
+	return norm;
+}
+
+void EvolutionStrategy::step(const std::vector<const Sample *> &samples)
+{
+	if (samples.empty())
+		return;
+	
+	const int nPairs = _config._pairs;
+	
+	_offsets.resize(nPairs);
+	for (size_t &offset : _offsets)
+	{
+		offset = _noise.sampleOffset(_random, _numParameters);
+	}
+	
+	// Task 2k is the + perturbation of pair k, 2k + 1 the - one
+	_losses.assign(2 * nPairs, 0.0);
+	parallel(2 * nPairs, [&] (int worker, int task) {
+		_losses[task] = evaluate(samples, _offsets[task / 2], (task % 2 == 0) ? 1.0f : -1.0f, _workspaces[worker]);
+	});
+	
+	// Centered ranks in [-0.5, 0.5], the lowest loss ranks highest. Ties are ordered by task for reproducibility.
+	std::vector<int> order(_losses.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&] (int a, int b) { return _losses[a] < _losses[b]; });
+	
+	std::vector<float> utilities(_losses.size());
+	for (size_t r = 0; r < order.size(); ++r)
+	{
+		utilities[order[r]] = 0.5f - (float)r / (float)(order.size() - 1);
+	}
+	
+	std::vector<float> weights(nPairs);
+	for (int k = 0; k < nPairs; ++k)
+	{
+		weights[k] = utilities[2 * k] - utilities[2 * k + 1];
+	}
+	
+	// Every weight block and bias vector is updated by a single task, along with its position in the perturbations
+	std::vector<std::pair<MatrixView<float>, size_t>> units;
+	for (size_t i = 0; i < _center._layers.size(); ++i)
+	{
+		NeuralNetwork::Layer &layer = _center._layers[i];
+		
+		size_t first = _layerOffsets[i];
+		for (int block = 0; block < layer._weights.numBlocks(); ++block)
+		{
+			units.push_back(std::make_pair(layer._weights.mutableBlock(block), first + (size_t)layer._weights.blockFirstRow(block) * layer._weights.numColumns()));
+		}
+		
+		first += (size_t)layer._weights.numRows() * layer._weights.numColumns();
+		units.push_back(std::make_pair(layer._biases.view(), first));
+		
+		first += layer._biases.numRows();
+		for (int block = 0; block < layer._factor.numBlocks(); ++block)
+		{
+			units.push_back(std::make_pair(layer._factor.mutableBlock(block), first + (size_t)layer._factor.blockFirstRow(block) * layer._factor.numColumns()));
+		}
+	}
+	
+	std::vector<double> norms(units.size(), 0.0);
+	parallel((int)units.size(), [&] (int, int task) {
+		norms[task] = update(units[task].first, units[task].second, weights);
+	});
+	
+	_statistics._meanLoss = std::accumulate(_losses.begin(), _losses.end(), 0.0) / _losses.size();
+	_statistics._bestLoss = _losses[order.front()];
+	_statistics._updateNorm = std::sqrt(std::accumulate(norms.begin(), norms.end(), 0.0));
+}
+
+}; // namespace nn
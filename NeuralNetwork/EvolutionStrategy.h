@@ -0,0 +1,127 @@
+#ifndef __NN_EVOLUTION_STRATEGY_H__
+#define __NN_EVOLUTION_STRATEGY_H__
+
+#include "NeuralNetwork.h"
+#include "Topology.h"
+#include <vector>
+#include <random>
+
+namespace nn
+{
+
+// Gaussian noise shared by every perturbation, a perturbation is an offset into the table.
+// The slice of a layer is used in place as a matrix, so perturbed weights never exist in memory.
+class NoiseTable
+{
+public:
+	NoiseTable(size_t size, unsigned int seed);
+	
+	size_t size() const { return _noise.size(); }
+	const float *at(size_t offset) const { return _noise.data() + offset; }
+	
+	// Offset of a perturbation of dimension n
+	size_t sampleOffset(std::mt19937 &random, size_t n) const;
+	
+protected:
+	std::vector<float> _noise;
+};
+
+// OpenAI style evolution strategy: one parameter vector (the center network) evaluated under antithetic
+// pairs of perturbations +sigma * e and -sigma * e, e taken from the noise table. The center moves along the
+// gradient estimate weighted by the centered ranks of the losses, lower losses ranking higher.
+//
+// Usage:
+//   EvolutionStrategy es(nInputs, { ... }, lf, config);
+//   es.step(samples);
+//   es.center().forward(input, workspace);
+class EvolutionStrategy
+{
+public:
+	using Sample = NeuralNetwork::Sample;
+	using LayerInfo = NeuralNetwork::LayerInfo;
+	
+	struct Config
+	{
+		int _pairs = 64;
+		float _sigma = 0.02f;
+		float _learningRate = 0.01f;
+		
+		// L2 penalty on the parameters, applied with the update
+		float _weightDecay = 0.0f;
+		
+		// Floats in the noise table, 128 MiB by default, at least the number of parameters
+		size_t _noiseSize = (size_t)1 << 25;
+		unsigned int _seed = 0;
+		
+		SchedulerConfig _scheduler;
+	};
+	
+	// Throws when the noise table is smaller than the parameter vector
+	EvolutionStrategy(int nInputs, const std::vector<LayerInfo> &layers, LossFunction lf, const Config &config);
+	
+	// One generation: every pair is evaluated on every sample, then the center is updated
+	void step(const std::vector<const Sample *> &samples);
+	
+	const NeuralNetwork &center() const { return _center; }
+	size_t numParameters() const { return _numParameters; }
+	
+	struct Statistics
+	{
+		// Mean losses of the perturbations of the last step
+		double _meanLoss;
+		double _bestLoss;
+		
+		// Norm of the update applied to the center
+		double _updateNorm;
+	};
+	
+	const Statistics &statistics() const { return _statistics; }
+	
+protected:
+	// Activations of a perturbed evaluation, and the products of the noise slices with the layer inputs
+	struct Workspace
+	{
+		std::vector<nn::Matrix> _outputs;
+		std::vector<nn::Matrix> _noise;
+		
+		// Perturbed V x of the factorized layers and its noise part
+		std::vector<nn::Matrix> _projections;
+		std::vector<nn::Matrix> _projectionNoise;
+		
+		// Unfolded input of the convolutions taking the im2col path, sized for the largest of them
+		nn::Matrix _columns;
+	};
+	
+	// Loss of the center perturbed by sign * sigma * e over the samples, e at the given offset of the table
+	double evaluate(const std::vector<const Sample *> &samples, size_t offset, float sign, Workspace &workspace) const;
+	
+	// Applies the gradient estimate to parameters found at first in the perturbations, returns the squared norm of the change
+	double update(MatrixView<float> parameters, size_t first, const std::vector<float> &weights);
+	
+	// Runs f(worker, i) for i in [0, n) on the worker threads
+	template <class F> void parallel(int n, F f);
+	
+	Config _config;
+	NeuralNetwork _center;
+	size_t _numParameters;
+	
+	// Offset of the weights of every layer in the parameter vector, followed by its biases and the V factor of a factorized layer
+	std::vector<size_t> _layerOffsets;
+	
+	std::vector<int> _cpus;
+	int _nWorkers;
+	std::vector<Workspace> _workspaces;
+	
+	NoiseTable _noise;
+	std::mt19937 _random;
+	
+	// Offsets of the pairs of the last step and the losses of their + and - perturbations
+	std::vector<size_t> _offsets;
+	std::vector<double> _losses;
+	
+	Statistics _statistics;
+};
+
+}; // namespace nn
+
+#endif // __NN_EVOLUTION_STRATEGY_H__
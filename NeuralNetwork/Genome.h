@@ -0,0 +1,59 @@
+#ifndef __NN_GENOME_H__
+#define __NN_GENOME_H__
+
+#include "NeuralNetwork.h"
+#include <vector>
+#include <cstdint>
+
+namespace nn
+{
+
+// A network as the chain of seeds it derives from: randomize(_seed), then mutate(rate, seed) for every mutation.
+// A few bytes per generation instead of every weight, the weights are rebuilt on demand.
+struct Genome
+{
+	struct Mutation
+	{
+		uint32_t _seed;
+		double _rate;
+		
+		bool operator == (const Mutation &m) const { return _seed == m._seed && _rate == m._rate; }
+	};
+	
+	uint32_t _seed = 0;
+	std::vector<Mutation> _mutations;
+	
+	void materialize(NeuralNetwork &network) const
+	{
+		network.randomize(_seed);
+		advance(network, 0);
+	}
+	
+	// Applies the mutations from the given one on, to a network holding the ones before
+	void advance(NeuralNetwork &network, size_t first) const
+	{
+		for (size_t i = first; i < _mutations.size(); ++i)
+		{
+			network.mutate(_mutations[i]._rate, _mutations[i]._seed);
+		}
+	}
+	
+	// True when the chain of prefix leads to this one
+	bool extends(const Genome &prefix) const
+	{
+		if (_seed != prefix._seed || _mutations.size() < prefix._mutations.size())
+			return false;
+		
+		for (size_t i = 0; i < prefix._mutations.size(); ++i)
+		{
+			if (! (_mutations[i] == prefix._mutations[i]))
+				return false;
+		}
+		
+		return true;
+	}
+};
+
+}; // namespace nn
+
+#endif // __NN_GENOME_H__
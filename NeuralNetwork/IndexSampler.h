@@ -0,0 +1,68 @@
+#ifndef __NN_INDEX_SAMPLER_H__
+#define __NN_INDEX_SAMPLER_H__
+
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cstdint>
+
+namespace nn
+{
+
+// Draws indices in [0, size) without replacement from a permutation, reshuffled once exhausted (an epoch).
+// The sequence only depends on the seed, and drawing does not allocate once the permutation exists.
+class IndexSampler
+{
+public:
+	IndexSampler(unsigned int seed = 0) : _random(seed)
+	{
+	}
+	
+	void seed(unsigned int seed)
+	{
+		_random.seed(seed);
+		_permutation.clear();
+		_cursor = 0;
+	}
+	
+	uint32_t next(size_t size)
+	{
+		// A different sample count restarts the epoch
+		if (_permutation.size() != size)
+		{
+			_permutation.resize(size);
+			for (size_t i = 0; i < size; ++i)
+			{
+				_permutation[i] = (uint32_t)i;
+			}
+			_cursor = size;
+		}
+		
+		if (_cursor == _permutation.size())
+		{
+			std::shuffle(_permutation.begin(), _permutation.end(), _random);
+			_cursor = 0;
+		}
+		
+		return _permutation[_cursor++];
+	}
+	
+	// Next n indices, n may exceed size in which case the draw spans several epochs
+	void draw(size_t size, size_t n, std::vector<uint32_t> &indices)
+	{
+		indices.resize(n);
+		for (size_t i = 0; i < n; ++i)
+		{
+			indices[i] = next(size);
+		}
+	}
+	
+protected:
+	std::vector<uint32_t> _permutation;
+	size_t _cursor = 0;
+	std::mt19937 _random;
+};
+
+}; // namespace nn
+
+#endif // __NN_INDEX_SAMPLER_H__
@@ -0,0 +1,439 @@
+#include "InferenceServer.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <winsock2.h>
+#include <afunix.h>
+#else
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace nn
+{
+
+namespace
+{
+#ifdef _WIN32
+	typedef SOCKET NativeSocket;
+	const intptr_t InvalidSocket = (intptr_t)INVALID_SOCKET;
+	const int SendFlags = 0;
+	
+	void closeSocket(intptr_t s) { closesocket((NativeSocket)s); }
+	void shutdownSocket(intptr_t s) { shutdown((NativeSocket)s, SD_BOTH); }
+	
+	void removeStaleSocket(const std::string &path)
+	{
+		// Socket files are reparse points, anything else is left alone and bind() fails
+		DWORD attributes = GetFileAttributesA(path.c_str());
+		if (attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
+			DeleteFileA(path.c_str());
+	}
+#else
+	typedef int NativeSocket;
+	const intptr_t InvalidSocket = -1;
+	
+	// A client gone before its response must not raise SIGPIPE
+	const int SendFlags = MSG_NOSIGNAL;
+	
+	void closeSocket(intptr_t s) { close((NativeSocket)s); }
+	void shutdownSocket(intptr_t s) { shutdown((NativeSocket)s, SHUT_RDWR); }
+	
+	void removeStaleSocket(const std::string &path)
+	{
+		struct stat st;
+		if (stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+			unlink(path.c_str());
+	}
+#endif
+
+	bool receiveAll(intptr_t s, void *data, size_t size)
+	{
+		char *p = (char *)data;
+		while (size > 0)
+		{
+			int n = recv((NativeSocket)s, p, (int)std::min(size, (size_t)1 << 20), 0);
+			if (n <= 0)
+				return false;
+			
+			p += n;
+			size -= n;
+		}
+		return true;
+	}
+	
+	bool sendAll(intptr_t s, const void *data, size_t size)
+	{
+		const char *p = (const char *)data;
+		while (size > 0)
+		{
+			int n = send((NativeSocket)s, p, (int)std::min(size, (size_t)1 << 20), SendFlags);
+			if (n <= 0)
+				return false;
+			
+			p += n;
+			size -= n;
+		}
+		return true;
+	}
+	
+	bool respond(intptr_t s, InferenceServer::Status status, int label, const std::vector<float> &outputs)
+	{
+		const int32_t header[3] = { (int32_t)status, label, (int32_t)outputs.size() };
+		return sendAll(s, header, sizeof(header)) && sendAll(s, outputs.data(), outputs.size() * sizeof(float));
+	}
+};
+
+InferenceServer::InferenceServer(const NeuralNetwork &network, const Config &config) : 
+	_network(network), 
+	_config(config), 
+	_socket(InvalidSocket), 
+	_stop(false)
+{
+	if (_config._maxBatch < 1 || _config._maxDelay < 0 || _config._queueCapacity < 1)
+		throw std::runtime_error("nn::InferenceServer - invalid configuration");
+	
+	_cpus = Topology::instance().selectCpus(_config._scheduler);
+	if (_cpus.empty())
+		throw std::runtime_error("nn::InferenceServer - no CPU matches the scheduler configuration");
+	
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (_config._path.empty() || _config._path.size() >= sizeof(address.sun_path))
+		throw std::runtime_error("nn::InferenceServer - invalid socket path '" + _config._path + "'");
+	memcpy(address.sun_path, _config._path.c_str(), _config._path.size());
+	
+#ifdef _WIN32
+	WSADATA data;
+	if (WSAStartup(MAKEWORD(2, 2), &data) != 0)
+		throw std::runtime_error("nn::InferenceServer - unable to initialize Winsock");
+#endif
+	
+	removeStaleSocket(_config._path);
+	
+	_socket = (intptr_t)socket(AF_UNIX, SOCK_STREAM, 0);
+	if (_socket == InvalidSocket || 
+		bind((NativeSocket)_socket, (const sockaddr *)&address, sizeof(address)) != 0 || 
+		listen((NativeSocket)_socket, 64) != 0)
+	{
+		if (_socket != InvalidSocket)
+			closeSocket(_socket);
+#ifdef _WIN32
+		WSACleanup();
+#endif
+		throw std::runtime_error("nn::InferenceServer - unable to listen on '" + _config._path + "'");
+	}
+	
+	_statisticsTime = Clock::now();
+	
+	const int nWorkers = (_config._scheduler._threads > 0) ? _config._scheduler._threads : (int)_cpus.size();
+	for (int i = 0; i < nWorkers; ++i)
+	{
+		_workers.push_back(std::thread(&InferenceServer::work, this));
+		
+		if (_config._scheduler._pin)
+			Topology::pinThread(_workers.back(), _cpus[i % _cpus.size()]);
+		else
+			Topology::restrictThread(_workers.back(), _cpus);
+	}
+	
+	_batcher = std::thread(&InferenceServer::formBatches, this);
+	_acceptor = std::thread(&InferenceServer::acceptConnections, this);
+}
+
+InferenceServer::~InferenceServer()
+{
+	stop();
+	
+#ifdef _WIN32
+	WSACleanup();
+#endif
+}
+
+void InferenceServer::stop()
+{
+	if (_stop.exchange(true))
+		return;
+	
+	// Wakes the batcher, it drains the queue before leaving
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+	}
+	_requestCondition.notify_all();
+	
+	// accept() and recv() return once their sockets are shut down
+	shutdownSocket(_socket);
+	closeSocket(_socket);
+	_acceptor.join();
+	
+	{
+		std::lock_guard<std::mutex> lock(_connectionsMutex);
+		for (Connection &connection : _connections)
+		{
+			shutdownSocket(connection._socket);
+		}
+	}
+	
+	// Connections waiting for a result get it before they leave, the batcher and the workers are still running
+	for (Connection &connection : _connections)
+	{
+		connection._thread.join();
+		closeSocket(connection._socket);
+	}
+	_connections.clear();
+	
+	_batcher.join();
+	for (std::thread &worker : _workers)
+	{
+		worker.join();
+	}
+	
+	removeStaleSocket(_config._path);
+}
+
+InferenceServer::Statistics InferenceServer::statistics()
+{
+	Statistics s;
+	
+	{
+		std::lock_guard<std::mutex> lock(_statisticsMutex);
+		
+		const Clock::time_point now = Clock::now();
+		const double seconds = std::chrono::duration<double>(now - _statisticsTime).count();
+		
+		s._requests = _requestCount;
+		s._rejected = _rejectedCount;
+		s._batches = _batchCount;
+		s._meanBatchSize = (_batchCount > 0) ? (double)_batchedRequests / _batchCount : 0.0;
+		s._requestsPerSecond = (seconds > 0.0) ? _intervalRequests / seconds : 0.0;
+		
+		if (! _latencies.empty())
+		{
+			std::sort(_latencies.begin(), _latencies.end());
+			s._p50Latency = _latencies[(size_t)(0.50 * (_latencies.size() - 1))];
+			s._p99Latency = _latencies[(size_t)(0.99 * (_latencies.size() - 1))];
+		}
+		
+		_statisticsTime = now;
+		_intervalRequests = 0;
+		_latencies.clear();
+	}
+	
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		s._queued = (int)_requests.size();
+	}
+	
+	{
+		std::lock_guard<std::mutex> lock(_connectionsMutex);
+		for (const Connection &connection : _connections)
+		{
+			s._connections += connection._finished ? 0 : 1;
+		}
+	}
+	
+	return s;
+}
+
+void InferenceServer::acceptConnections()
+{
+	while (! _stop)
+	{
+		intptr_t s = (intptr_t)::accept((NativeSocket)_socket, nullptr, nullptr);
+		if (s == InvalidSocket)
+		{
+			// Out of descriptors or an aborted connection, nothing to do but wait a little
+			if (! _stop)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			continue;
+		}
+		
+		std::lock_guard<std::mutex> lock(_connectionsMutex);
+		
+		// Threads of the connections closed since the last one
+		for (std::list<Connection>::iterator it = _connections.begin(); it != _connections.end(); )
+		{
+			if (it->_finished)
+			{
+				it->_thread.join();
+				closeSocket(it->_socket);
+				it = _connections.erase(it);
+			}
+			else
+				++it;
+		}
+		
+		_connections.emplace_back();
+		Connection &connection = _connections.back();
+		connection._socket = s;
+		connection._finished = false;
+		connection._thread = std::thread(&InferenceServer::serve, this, std::ref(connection));
+	}
+}
+
+void InferenceServer::serve(Connection &connection)
+{
+	const intptr_t s = connection._socket;
+	const uint32_t nInputs = (uint32_t)_network.numInputs();
+	const std::vector<float> none;
+	
+	for (;;)
+	{
+		uint32_t count;
+		if (! receiveAll(s, &count, sizeof(count)))
+			break;
+		
+		// The rest of the stream cannot be trusted
+		if (count != nInputs)
+		{
+			respond(s, Status::BAD_REQUEST, -1, none);
+			break;
+		}
+		
+		std::shared_ptr<Request> request = std::make_shared<Request>();
+		request->_input.resize(count);
+		if (! receiveAll(s, request->_input.data(), count * sizeof(float)))
+			break;
+		
+		request->_arrival = Clock::now();
+		std::future<void> done = request->_done.get_future();
+		
+		if (! submit(request))
+		{
+			if (! respond(s, Status::BUSY, -1, none))
+				break;
+			continue;
+		}
+		
+		done.wait();
+		if (! respond(s, Status::OK, request->_label, request->_output))
+			break;
+	}
+	
+	connection._finished = true;
+}
+
+bool InferenceServer::submit(const std::shared_ptr<Request> &request)
+{
+	bool queued = false;
+	
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (! _stop && (int)_requests.size() < _config._queueCapacity)
+		{
+			_requests.push_back(request);
+			queued = true;
+		}
+	}
+	
+	if (queued)
+		_requestCondition.notify_one();
+	
+	std::lock_guard<std::mutex> lock(_statisticsMutex);
+	_requestCount += 1;
+	_rejectedCount += queued ? 0 : 1;
+	
+	return queued;
+}
+
+void InferenceServer::formBatches()
+{
+	const size_t maxBatches = 2 * _workers.size();
+	
+	std::unique_lock<std::mutex> lock(_mutex);
+	
+	for (;;)
+	{
+		_requestCondition.wait(lock, [&] { return ! _requests.empty() || _stop; });
+		if (_requests.empty())
+			break;
+		
+		// Up to the deadline of the oldest request for the batch to fill, no waiting once the server stops
+		const Clock::time_point deadline = _requests.front()->_arrival + std::chrono::microseconds(_config._maxDelay);
+		_requestCondition.wait_until(lock, deadline, [&] { return (int)_requests.size() >= _config._maxBatch || _stop; });
+		
+		// Every worker busy with a batch and another one waiting: the requests pile up until the queue rejects them
+		_freeCondition.wait(lock, [&] { return _batches.size() < maxBatches; });
+		
+		const size_t n = std::min(_requests.size(), (size_t)_config._maxBatch);
+		_batches.push_back(Batch(_requests.begin(), _requests.begin() + n));
+		_requests.erase(_requests.begin(), _requests.begin() + n);
+		
+		_batchCondition.notify_one();
+	}
+	
+	_batcherDone = true;
+	_batchCondition.notify_all();
+}
+
+void InferenceServer::work()
+{
+	NeuralNetwork::Workspace workspace;
+	
+	const int nInputs = _network.numInputs();
+	const int nOutputs = _network.numOutputs();
+	
+	// Sized for the largest batch once, a smaller one takes the first rows
+	nn::Matrix inputs(_config._maxBatch, nInputs, MatrixInit::UNINITIALIZED);
+	
+	for (;;)
+	{
+		Batch batch;
+		
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_batchCondition.wait(lock, [&] { return ! _batches.empty() || _batcherDone; });
+			if (_batches.empty())
+				break;
+			
+			batch.swap(_batches.front());
+			_batches.pop_front();
+		}
+		_freeCondition.notify_one();
+		
+		const int n = (int)batch.size();
+		
+		for (int s = 0; s < n; ++s)
+		{
+			std::copy(batch[s]->_input.begin(), batch[s]->_input.end(), &inputs(s, 0));
+		}
+		
+		const nn::Matrix &outputs = _network.forwardBatch(inputs, n, workspace);
+		const Clock::time_point now = Clock::now();
+		
+		for (int s = 0; s < n; ++s)
+		{
+			Request &request = *batch[s];
+			request._output.assign(&outputs(s, 0), &outputs(s, 0) + nOutputs);
+			request._label = (int)(std::max_element(request._output.begin(), request._output.end()) - request._output.begin());
+		}
+		
+		{
+			std::lock_guard<std::mutex> lock(_statisticsMutex);
+			
+			_batchCount += 1;
+			_batchedRequests += n;
+			_intervalRequests += n;
+			
+			// Bounded when statistics() is not called for a long time
+			for (int s = 0; s < n && _latencies.size() < ((size_t)1 << 20); ++s)
+			{
+				_latencies.push_back(std::chrono::duration<double>(now - batch[s]->_arrival).count());
+			}
+		}
+		
+		for (int s = 0; s < n; ++s)
+		{
+			batch[s]->_done.set_value();
+		}
+	}
+}
+
+}; // namespace nn
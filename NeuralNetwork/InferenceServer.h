@@ -0,0 +1,158 @@
+#ifndef __NN_INFERENCE_SERVER_H__
+#define __NN_INFERENCE_SERVER_H__
+
+#include "NeuralNetwork.h"
+#include "Topology.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+
+namespace nn
+{
+
+// Serves classification requests of local processes over a Unix domain socket. Requests of all the connections go to
+// one queue, a batcher takes them as soon as a batch is full or the oldest one has waited the delay, and workers run
+// the batches through NeuralNetwork::forwardBatch(). A request arriving on a full queue is answered BUSY at once.
+//
+// Protocol, every value in the byte order of the machine. A connection sends requests one at a time, each one waiting
+// for its response:
+//   request:  uint32_t count, then count floats, count being the number of inputs of the network
+//   response: int32_t status, int32_t label, uint32_t count, then count floats, the outputs (count is 0 unless OK)
+// A malformed request is answered BAD_REQUEST and the connection is closed.
+//
+// Usage:
+//   InferenceServer::Config config;
+//   config._path = "/tmp/nnd.sock";
+//   InferenceServer server(network, config);
+//   ...
+//   InferenceServer::Statistics s = server.statistics();
+class InferenceServer
+{
+public:
+	enum class Status
+	{
+		OK, 
+		BUSY, 
+		BAD_REQUEST
+	};
+	
+	struct Config
+	{
+		std::string _path;
+		
+		// A batch goes as soon as it has _maxBatch requests or its first one has waited _maxDelay microseconds
+		int _maxBatch = 64;
+		int _maxDelay = 2000;
+		
+		// Requests waiting for a batch, beyond which new ones are rejected
+		int _queueCapacity = 1024;
+		
+		// Workers running the batches
+		SchedulerConfig _scheduler;
+	};
+	
+	// Totals since the server started, rates and latencies since the previous call
+	struct Statistics
+	{
+		uint64_t _requests = 0;
+		uint64_t _rejected = 0;
+		uint64_t _batches = 0;
+		double _meanBatchSize = 0.0;
+		double _requestsPerSecond = 0.0;
+		
+		// From the arrival of a request to its result, in seconds
+		double _p50Latency = 0.0;
+		double _p99Latency = 0.0;
+		
+		int _queued = 0;
+		int _connections = 0;
+	};
+	
+	// Listens on config._path, replacing a stale socket file, and starts the threads. Throws when the socket cannot be bound.
+	InferenceServer(const NeuralNetwork &network, const Config &config);
+	~InferenceServer();
+	
+	InferenceServer(const InferenceServer &) = delete;
+	InferenceServer &operator = (const InferenceServer &) = delete;
+	
+	// Closes the socket and the connections, requests already queued are completed first. Called by the destructor.
+	void stop();
+	
+	Statistics statistics();
+	
+protected:
+	typedef std::chrono::steady_clock Clock;
+	
+	struct Request
+	{
+		std::vector<float> _input;
+		std::vector<float> _output;
+		int _label = -1;
+		Clock::time_point _arrival;
+		std::promise<void> _done;
+	};
+	
+	// Shared with the connection waiting for the result, whichever lets go last frees the request
+	typedef std::vector<std::shared_ptr<Request>> Batch;
+	
+	struct Connection
+	{
+		intptr_t _socket;
+		std::thread _thread;
+		std::atomic<bool> _finished;
+	};
+	
+	// Threads of the server: one accepting connections, one per connection, the batcher and the workers
+	void acceptConnections();
+	void serve(Connection &connection);
+	void formBatches();
+	void work();
+	
+	// Queues a request, false when the queue is full or the server stops
+	bool submit(const std::shared_ptr<Request> &request);
+	
+	NeuralNetwork _network;
+	Config _config;
+	
+	intptr_t _socket;
+	std::atomic<bool> _stop;
+	
+	std::thread _acceptor;
+	std::mutex _connectionsMutex;
+	std::list<Connection> _connections;
+	
+	// Requests waiting for a batch, then batches waiting for a worker, at most two per worker
+	std::mutex _mutex;
+	std::condition_variable _requestCondition;
+	std::condition_variable _batchCondition;
+	std::condition_variable _freeCondition;
+	std::deque<std::shared_ptr<Request>> _requests;
+	std::deque<Batch> _batches;
+	bool _batcherDone = false;
+	
+	std::thread _batcher;
+	std::vector<std::thread> _workers;
+	std::vector<int> _cpus;
+	
+	std::mutex _statisticsMutex;
+	Clock::time_point _statisticsTime;
+	uint64_t _requestCount = 0;
+	uint64_t _rejectedCount = 0;
+	uint64_t _batchCount = 0;
+	uint64_t _batchedRequests = 0;
+	uint64_t _intervalRequests = 0;
+	std::vector<double> _latencies;
+};
+
+}; // namespace nn
+
+#endif // __NN_INFERENCE_SERVER_H__
@@ -0,0 +1,424 @@
+#include "Jit.h"
+#include "Topology.h"
+#include <cstring>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define NN_JIT_X86
+#endif
+
+namespace nn
+{
+
+namespace
+{
+	enum Register
+	{
+		RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+		R8 = 8, R9 = 9, R10 = 10, R11 = 11, R12 = 12
+	};
+	
+	// The few x86-64 instructions the kernels need, memory operands are always [base + disp32]
+	class Assembler
+	{
+	public:
+		std::vector<uint8_t> _code;
+		
+		size_t position() const { return _code.size(); }
+		
+		void byte(uint8_t b) { _code.push_back(b); }
+		
+		void dword(int32_t v)
+		{
+			for (int i = 0; i < 4; ++i)
+			{
+				byte((uint8_t)((uint32_t)v >> (8 * i)));
+			}
+		}
+		
+		void push(int r)
+		{
+			if (r >= 8)
+				byte(0x41);
+			byte(0x50 + (r & 7));
+		}
+		
+		void pop(int r)
+		{
+			if (r >= 8)
+				byte(0x41);
+			byte(0x58 + (r & 7));
+		}
+		
+		// mov dst, src
+		void mov(int dst, int src)
+		{
+			rex(src, dst);
+			byte(0x89);
+			byte(0xc0 | ((src & 7) << 3) | (dst & 7));
+		}
+		
+		// mov dst, [base + disp]
+		void load(int dst, int base, int32_t disp)
+		{
+			rex(dst, base);
+			byte(0x8b);
+			memory(dst, base, disp);
+		}
+		
+		// mov r32, imm32, zero extended to 64 bits
+		void movImmediate(int r, int32_t imm)
+		{
+			if (r >= 8)
+				byte(0x41);
+			byte(0xb8 + (r & 7));
+			dword(imm);
+		}
+		
+		// add r, imm32
+		void add(int r, int32_t imm)
+		{
+			rex(0, r);
+			byte(0x81);
+			byte(0xc0 | (r & 7));
+			dword(imm);
+		}
+		
+		// sub r, 1 then jnz target
+		void decrementAndLoop(int r, size_t target)
+		{
+			rex(0, r);
+			byte(0x83);
+			byte(0xe8 | (r & 7));
+			byte(1);
+			
+			byte(0x0f);
+			byte(0x85);
+			dword((int32_t)((int64_t)target - (int64_t)(position() + 4)));
+		}
+		
+		// vmovups ymm, [base + disp]
+		void vmovups(int ymm, int base, int32_t disp) { vexMemory(0x10, 1, 0, 1, ymm, 0, base, disp); }
+		
+		// vfmadd231ps ymm, ymmSrc, [base + disp]
+		void vfmadd231ps(int ymm, int src, int base, int32_t disp) { vexMemory(0xb8, 2, 1, 1, ymm, src, base, disp); }
+		
+		// vxorps ymm, ymm, ymm
+		void vzero(int ymm) { vexRegister(0x57, 1, 0, 1, ymm, ymm, ymm); }
+		
+		// vextractf128 xmm, ymm, 1
+		void vextractHigh(int xmm, int ymm)
+		{
+			vexRegister(0x19, 3, 1, 1, ymm, 0, xmm);
+			byte(1);
+		}
+		
+		// vaddps xmm, xmm, xmmSrc and vaddps ymm, ymm, ymmSrc
+		void vaddps(int xmm, int src) { vexRegister(0x58, 1, 0, 0, xmm, xmm, src); }
+		void vaddps256(int ymm, int src) { vexRegister(0x58, 1, 0, 1, ymm, ymm, src); }
+		
+		// vhaddps xmm, xmm, xmm
+		void vhaddps(int xmm) { vexRegister(0x7c, 1, 3, 0, xmm, xmm, xmm); }
+		
+		// vmovss xmm, [base + disp] and vmovss [base + disp], xmm
+		void vmovssLoad(int xmm, int base, int32_t disp) { vexMemory(0x10, 1, 2, 0, xmm, 0, base, disp); }
+		void vmovssStore(int xmm, int base, int32_t disp) { vexMemory(0x11, 1, 2, 0, xmm, 0, base, disp); }
+		
+		// vfmadd231ss xmm, xmmSrc, [base + disp]
+		void vfmadd231ss(int xmm, int src, int base, int32_t disp) { vexMemory(0xb9, 2, 1, 0, xmm, src, base, disp); }
+		
+		// vaddss xmm, xmm, [base + disp]
+		void vaddss(int xmm, int base, int32_t disp) { vexMemory(0x58, 1, 2, 0, xmm, xmm, base, disp); }
+		
+		void vzeroupper()
+		{
+			byte(0xc5);
+			byte(0xf8);
+			byte(0x77);
+		}
+		
+		void ret() { byte(0xc3); }
+	
+	protected:
+		// REX.W with the high bits of the ModRM reg and rm fields
+		void rex(int reg, int rm)
+		{
+			byte(0x48 | ((reg >> 3) << 2) | (rm >> 3));
+		}
+		
+		void memory(int reg, int base, int32_t disp)
+		{
+			byte(0x80 | ((reg & 7) << 3) | (base & 7));
+			
+			// rsp and r12 as a base need a SIB byte
+			if ((base & 7) == RSP)
+				byte(0x24);
+			dword(disp);
+		}
+		
+		// Three byte VEX prefix, map 1: 0F, 2: 0F38, 3: 0F3A, pp 0: none, 1: 66, 2: F3, 3: F2
+		void vex(int map, int pp, int l, int reg, int vvvv, int rm)
+		{
+			byte(0xc4);
+			byte((((~reg >> 3) & 1) << 7) | (1 << 6) | (((~rm >> 3) & 1) << 5) | map);
+			byte(((~vvvv & 15) << 3) | (l << 2) | pp);
+		}
+		
+		void vexMemory(uint8_t opcode, int map, int pp, int l, int reg, int vvvv, int base, int32_t disp)
+		{
+			vex(map, pp, l, reg, vvvv, base);
+			byte(opcode);
+			memory(reg, base, disp);
+		}
+		
+		void vexRegister(uint8_t opcode, int map, int pp, int l, int reg, int vvvv, int rm)
+		{
+			vex(map, pp, l, reg, vvvv, rm);
+			byte(opcode);
+			byte(0xc0 | ((reg & 7) << 3) | (rm & 7));
+		}
+	};
+	
+	// Registers once the arguments are moved, volatile or saved by the prologue in both the Windows and System V ABIs.
+	// Only ymm0-5 are used, xmm6-15 are callee-saved on Windows.
+	const int Table = RAX;
+	const int X = R10;
+	const int Bias = R11;
+	const int Y = R9;
+	const int Counter = RCX;
+	const int Rows[4] = { RBX, RSI, RDI, R12 };
+	
+	// nrows consecutive rows from the row table, each accumulated in the next naccumulators of ymm0-3, one per column vector
+	// in turn. x is loaded once per 8 columns into ymm4.
+	void emitRows(Assembler &a, int nrows, int naccumulators, int ncolumns, bool bias)
+	{
+		for (int i = 0; i < nrows; ++i)
+		{
+			a.load(Rows[i], Table, 8 * i);
+			for (int j = 0; j < naccumulators; ++j)
+			{
+				a.vzero(i * naccumulators + j);
+			}
+		}
+		
+		const int nvectors = ncolumns / 8;
+		for (int k = 0; k < nvectors; ++k)
+		{
+			a.vmovups(4, X, 32 * k);
+			for (int i = 0; i < nrows; ++i)
+			{
+				a.vfmadd231ps(i * naccumulators + k % naccumulators, 4, Rows[i], 32 * k);
+			}
+		}
+		
+		for (int i = 0; i < nrows; ++i)
+		{
+			const int sum = i * naccumulators;
+			for (int j = 1; j < naccumulators; ++j)
+			{
+				a.vaddps256(sum, sum + j);
+			}
+			
+			// Horizontal sum into the low lane, the scalar columns past the last vector follow
+			a.vextractHigh(5, sum);
+			a.vaddps(sum, 5);
+			a.vhaddps(sum);
+			a.vhaddps(sum);
+			
+			for (int c = nvectors * 8; c < ncolumns; ++c)
+			{
+				a.vmovssLoad(4, X, 4 * c);
+				a.vfmadd231ss(sum, 4, Rows[i], 4 * c);
+			}
+			
+			if (bias)
+				a.vaddss(sum, Bias, 4 * i);
+			a.vmovssStore(sum, Y, 4 * i);
+		}
+		
+		a.add(Table, 8 * nrows);
+		a.add(Y, 4 * nrows);
+		if (bias)
+			a.add(Bias, 4 * nrows);
+	}
+	
+	std::vector<uint8_t> generateGemv(int nrows, int ncolumns, bool bias, const GemvConfig &config)
+	{
+		Assembler a;
+		
+		for (int r : Rows)
+		{
+			a.push(r);
+		}
+		
+#ifdef _WIN32
+		// rcx, rdx, r8, r9
+		a.mov(Table, RCX);
+		a.mov(X, RDX);
+		a.mov(Bias, R8);
+#else
+		// rdi, rsi, rdx, rcx
+		a.mov(Table, RDI);
+		a.mov(X, RSI);
+		a.mov(Bias, RDX);
+		a.mov(Y, RCX);
+#endif
+		
+		// Groups of rows in a loop, every group is the same code, the remaining rows one by one
+		const int ngroups = nrows / config._rows;
+		if (ngroups > 0)
+		{
+			a.movImmediate(Counter, ngroups);
+			size_t loop = a.position();
+			emitRows(a, config._rows, config._accumulators, ncolumns, bias);
+			a.decrementAndLoop(Counter, loop);
+		}
+		
+		for (int r = ngroups * config._rows; r < nrows; ++r)
+		{
+			emitRows(a, 1, config._accumulators, ncolumns, bias);
+		}
+		
+		a.vzeroupper();
+		for (int i = 3; i >= 0; --i)
+		{
+			a.pop(Rows[i]);
+		}
+		a.ret();
+		
+		return a._code;
+	}
+};
+
+Jit &Jit::instance()
+{
+	static Jit jit;
+	return jit;
+}
+
+Jit::Jit()
+{
+	_enabled = isSupported();
+	_codeSize = 0;
+}
+
+Jit::~Jit()
+{
+	for (const std::pair<void *, size_t> &pages : _pages)
+	{
+#ifdef _WIN32
+		VirtualFree(pages.first, 0, MEM_RELEASE);
+#else
+		munmap(pages.first, pages.second);
+#endif
+	}
+}
+
+bool Jit::isSupported()
+{
+#ifdef NN_JIT_X86
+	const Topology::InstructionSets &sets = Topology::instance().instructionSets();
+	return sets._avx2 && sets._fma;
+#else
+	return false;
+#endif
+}
+
+GemvKernel Jit::gemv(int nrows, int ncolumns, bool bias)
+{
+	return gemv(nrows, ncolumns, bias, config(nrows, ncolumns));
+}
+
+GemvKernel Jit::gemv(int nrows, int ncolumns, bool bias, const GemvConfig &config)
+{
+	if (! _enabled || nrows <= 0 || ncolumns <= 0 || ncolumns > MaxColumns || config.generic() || ! config.valid())
+		return nullptr;
+	
+	std::lock_guard<std::mutex> lock(_mutex);
+	
+	std::tuple<int, int, bool, int, int> key(nrows, ncolumns, bias, config._rows, config._accumulators);
+	std::map<std::tuple<int, int, bool, int, int>, GemvKernel>::iterator it = _kernels.find(key);
+	if (it != _kernels.end())
+		return it->second;
+	
+	GemvKernel kernel = install(generateGemv(nrows, ncolumns, bias, config));
+	_kernels[key] = kernel;
+	return kernel;
+}
+
+GemvConfig Jit::config(int nrows, int ncolumns)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	
+	std::map<std::pair<int, int>, GemvConfig>::const_iterator it = _configs.find(std::make_pair(nrows, ncolumns));
+	return (it != _configs.end()) ? it->second : GemvConfig();
+}
+
+void Jit::setConfig(int nrows, int ncolumns, const GemvConfig &config)
+{
+	if (! config.valid())
+		throw std::runtime_error("nn::Jit - invalid kernel layout");
+	
+	std::lock_guard<std::mutex> lock(_mutex);
+	_configs[std::make_pair(nrows, ncolumns)] = config;
+}
+
+size_t Jit::numKernels()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _kernels.size();
+}
+
+size_t Jit::codeSize()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _codeSize;
+}
+
+GemvKernel Jit::install(const std::vector<uint8_t> &code)
+{
+	// Written while writable, then made executable and read only
+	size_t size = (code.size() + 4095) & ~(size_t)4095;
+
+#ifdef _WIN32
+	void *pages = VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (pages == nullptr)
+		return nullptr;
+	
+	memcpy(pages, code.data(), code.size());
+	
+	DWORD previous;
+	if (! VirtualProtect(pages, size, PAGE_EXECUTE_READ, &previous))
+	{
+		VirtualFree(pages, 0, MEM_RELEASE);
+		return nullptr;
+	}
+	FlushInstructionCache(GetCurrentProcess(), pages, size);
+#else
+	void *pages = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pages == MAP_FAILED)
+		return nullptr;
+	
+	memcpy(pages, code.data(), code.size());
+	
+	if (mprotect(pages, size, PROT_READ | PROT_EXEC) != 0)
+	{
+		munmap(pages, size);
+		return nullptr;
+	}
+#endif
+
+	_pages.push_back(std::make_pair(pages, size));
+	_codeSize += code.size();
+	
+	return (GemvKernel)pages;
+}
+
+}; // namespace nn
@@ -0,0 +1,83 @@
+#ifndef __NN_JIT_H__
+#define __NN_JIT_H__
+
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+#include <cstdint>
+
+namespace nn
+{
+
+// y[r] = dot(rows[r], x) + bias[r] for a fixed number of rows of a fixed length. Rows are passed as pointers,
+// so that the rows of a BlockMatrix are used in place wherever their blocks are.
+typedef void (*GemvKernel)(const float *const *rows, const float *x, const float *bias, float *y);
+
+// Layout of a generated kernel: rows computed together share the loads of x, several accumulators per row
+// split the columns so that consecutive FMAs do not wait on each other. _rows * _accumulators is at most 4.
+// _rows = 0 stands for the generic nn::dot, see Autotuner.
+struct GemvConfig
+{
+	int _rows = 4;
+	int _accumulators = 1;
+	
+	bool generic() const { return _rows == 0; }
+	bool valid() const { return generic() || (_rows > 0 && _accumulators > 0 && _rows * _accumulators <= 4); }
+};
+
+// Generates x86-64 AVX2/FMA machine code for matrix-vector products of a given shape: the loop over the columns is
+// fully unrolled with constant offsets, rows go in groups sharing the loads of x, the tail is unrolled as well.
+// Kernels are cached by shape and layout for the lifetime of the process, NeuralNetwork asks for them when it is built.
+// The layout of a shape is the default GemvConfig unless another one was set, usually by Autotuner.
+//
+// Disabled when the CPU lacks AVX2 or FMA, on other architectures, or through setEnabled(false); gemv() then
+// returns nullptr and callers use the generic nn::dot.
+class Jit
+{
+public:
+	static Jit &instance();
+	
+	// Longer rows are left to the generic kernel, the unrolled code would not fit in the instruction cache
+	static const int MaxColumns = 8192;
+	
+	static bool isSupported();
+	
+	bool isEnabled() const { return _enabled; }
+	
+	// Only affects the networks built afterwards
+	void setEnabled(bool enabled) { _enabled = enabled && isSupported(); }
+	
+	// Thread safe, nullptr when disabled, for shapes the generator does not handle, or when the layout is the generic one
+	GemvKernel gemv(int nrows, int ncolumns, bool bias);
+	GemvKernel gemv(int nrows, int ncolumns, bool bias, const GemvConfig &config);
+	
+	// Layout used for a shape by the networks built afterwards
+	GemvConfig config(int nrows, int ncolumns);
+	void setConfig(int nrows, int ncolumns, const GemvConfig &config);
+	
+	// Generated code, for reporting
+	size_t numKernels();
+	size_t codeSize();
+	
+protected:
+	Jit();
+	~Jit();
+	
+	// Copies the code into new executable pages
+	GemvKernel install(const std::vector<uint8_t> &code);
+	
+	bool _enabled;
+	
+	std::mutex _mutex;
+	std::map<std::tuple<int, int, bool, int, int>, GemvKernel> _kernels;
+	std::map<std::pair<int, int>, GemvConfig> _configs;
+	
+	// Executable pages and their sizes
+	std::vector<std::pair<void *, size_t>> _pages;
+	size_t _codeSize;
+};
+
+}; // namespace nn
+
+#endif // __NN_JIT_H__
@@ -1,8 +1,131 @@
 #include "Matrix.h"
+#include <cstdlib>
+#include <new>
+#include <algorithm>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 namespace nn
 {
 
+namespace
+{
+	thread_local int _threadNode = -1;
+	
+	// Blocks of one size are carved by slabs of about BlockSlabSize bytes
+	const uint32_t BlockAlignment = 64;
+	const uint32_t BlockSlabSize = 256 * 1024;
+	
+	inline size_t roundUp(size_t size, size_t alignment)
+	{
+		return (size + alignment - 1) / alignment * alignment;
+	}
+	
+#ifdef _WIN32
+	
+	// Zero filled pages, size is rounded up to the page size of the mapping
+	uint8_t *mapChunk(size_t &size, int node, MatrixMemoryAllocator::HugePages hugePages)
+	{
+		DWORD preferredNode = (node >= 0) ? (DWORD)node : NUMA_NO_PREFERRED_NODE;
+		
+		// Large pages need SeLockMemoryPrivilege, they are committed right away
+		if (hugePages == MatrixMemoryAllocator::HugePages::EXPLICIT)
+		{
+			size_t largePageSize = GetLargePageMinimum();
+			if (largePageSize > 0)
+			{
+				size_t largeSize = roundUp(size, largePageSize);
+				void *p = VirtualAllocExNuma(GetCurrentProcess(), nullptr, largeSize, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE, preferredNode);
+				if (p != nullptr)
+				{
+					size = largeSize;
+					return (uint8_t *)p;
+				}
+			}
+		}
+		
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		size = roundUp(size, info.dwPageSize);
+		
+		return (uint8_t *)VirtualAllocExNuma(GetCurrentProcess(), nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, preferredNode);
+	}
+	
+	void unmapChunk(uint8_t *p, size_t size)
+	{
+		VirtualFree(p, 0, MEM_RELEASE);
+	}
+	
+#else
+	
+	const size_t HugePageSize = 2 * 1024 * 1024;
+	
+	// MPOL_PREFERRED from numaif.h, mbind is called through syscall() to avoid linking libnuma
+	const int MemoryPolicyPreferred = 1;
+	
+	void bindToNode(uint8_t *p, size_t size, int node)
+	{
+		// The kernel reads maxnode - 1 bits of the mask
+		const size_t bitsPerWord = 8 * sizeof(unsigned long);
+		std::vector<unsigned long> mask((node + 1) / bitsPerWord + 1, 0);
+		mask[node / bitsPerWord] |= 1ul << (node % bitsPerWord);
+		
+		// Best effort, pages land on the first touching node otherwise
+		syscall(SYS_mbind, p, size, MemoryPolicyPreferred, mask.data(), mask.size() * bitsPerWord, 0);
+	}
+	
+	// Zero filled pages, size is rounded up to the page size of the mapping.
+	// Binding happens before the first touch, so pages are faulted in on the node.
+	uint8_t *mapChunk(size_t &size, int node, MatrixMemoryAllocator::HugePages hugePages)
+	{
+		void *p = MAP_FAILED;
+		
+#ifdef MAP_HUGETLB
+		// Needs huge pages reserved in /proc/sys/vm/nr_hugepages
+		if (hugePages == MatrixMemoryAllocator::HugePages::EXPLICIT)
+		{
+			size_t hugeSize = roundUp(size, HugePageSize);
+			p = mmap(nullptr, hugeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (p != MAP_FAILED)
+				size = hugeSize;
+		}
+#endif
+		
+		if (p == MAP_FAILED)
+		{
+			size = roundUp(size, (size_t)sysconf(_SC_PAGESIZE));
+			p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (p == MAP_FAILED)
+				return nullptr;
+			
+#ifdef MADV_HUGEPAGE
+			// Fails harmlessly when transparent huge pages are disabled
+			if (hugePages != MatrixMemoryAllocator::HugePages::NONE)
+				madvise(p, size, MADV_HUGEPAGE);
+#endif
+		}
+		
+		if (node >= 0)
+			bindToNode((uint8_t *)p, size, node);
+		
+		return (uint8_t *)p;
+	}
+	
+	void unmapChunk(uint8_t *p, size_t size)
+	{
+		munmap(p, size);
+	}
+	
+#endif
+};
+
 MatrixMemoryAllocator *MatrixMemoryAllocator::_instance = nullptr;
 
 MatrixMemoryAllocator *MatrixMemoryAllocator::instance()
@@ -11,6 +134,7 @@ MatrixMemoryAllocator *MatrixMemoryAllocator::instance()
 	{
 		_instance = new MatrixMemoryAllocator;
 		_instance->_chunkSize = 16 * 1024 * 1024;
+		_instance->_arenas.resize(1);
 	}
 	return _instance;
 }
@@ -20,43 +144,84 @@ void MatrixMemoryAllocator::configure(uint32_t chunkSize)
 	_chunkSize = chunkSize;
 }
 
+void MatrixMemoryAllocator::configure(uint32_t chunkSize, HugePages hugePages, bool numaAware)
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+	
+	_chunkSize = chunkSize;
+	_hugePages = hugePages;
+	_numaAware = numaAware;
+}
+
+void MatrixMemoryAllocator::setThreadNode(int node)
+{
+	_threadNode = node;
+}
+
+int MatrixMemoryAllocator::threadNode()
+{
+	return _threadNode;
+}
+
+MatrixMemoryAllocator::Arena &MatrixMemoryAllocator::threadArena(int &node)
+{
+	node = (_numaAware && _threadNode >= 0) ? _threadNode : -1;
+	
+	if (node + 1 >= (int)_arenas.size())
+		_arenas.resize(node + 2);
+	
+	return _arenas[node + 1];
+}
+
 void MatrixMemoryAllocator::reserve(uint32_t size)
 {
-	_chunks.push_back(new Chunk());
-	Chunk *c = _chunks.back();
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
 	
-	try
-	{
-		c->_begin = new uint8_t[size];
-	}
-	catch (...)
+	int node;
+	Arena &arena = threadArena(node);
+	
+	// Anonymous mappings, pages are lazily zeroed by the OS
+	size_t mappedSize = size;
+	uint8_t *begin = mapChunk(mappedSize, node, _hugePages);
+	if (begin == nullptr)
 	{
 		printf("Allocation failed!   requested:%s, total: %s, waisted: %s\n", 
 			HumanReadableSize(size).str(), 
 			HumanReadableSize(getAllocatedSize()).str(), 
 			HumanReadableSize(getWaistedSize()).str());
-		throw;
+		throw std::bad_alloc();
 	}
 	
+	arena._chunks.push_back(new Chunk());
+	Chunk *c = arena._chunks.back();
+	
+	c->_begin = begin;
 	c->_end = c->_begin;
-	c->_storageEnd = c->_begin + size;
+	c->_storageEnd = c->_begin + mappedSize;
+	c->_mappedSize = mappedSize;
 }
 
 void MatrixMemoryAllocator::releaseAll()
 {
-	for (Chunk *c : _fullChunks)
-	{
-		delete [] c->_begin;
-		delete c;
-	}
-	_fullChunks.clear();
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
 	
-	for (Chunk *c : _chunks)
+	for (Arena &arena : _arenas)
 	{
-		delete [] c->_begin;
-		delete c;
+		for (Chunk *c : arena._fullChunks)
+		{
+			unmapChunk(c->_begin, c->_mappedSize);
+			delete c;
+		}
+		arena._fullChunks.clear();
+		
+		for (Chunk *c : arena._chunks)
+		{
+			unmapChunk(c->_begin, c->_mappedSize);
+			delete c;
+		}
+		arena._chunks.clear();
+		arena._freeBlocks.clear();
 	}
-	_chunks.clear();
 }
 
 uint8_t *MatrixMemoryAllocator::allocate(uint32_t size)
@@ -66,7 +231,12 @@ uint8_t *MatrixMemoryAllocator::allocate(uint32_t size)
 	
 	// printf("MatrixMemoryAllocator::allocate %s\n", HumanReadableSize(size).str());
 	
-	for (std::list<Chunk *>::iterator it = _chunks.begin(); it != _chunks.end(); ++it)
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+	
+	int node;
+	Arena &arena = threadArena(node);
+	
+	for (std::list<Chunk *>::iterator it = arena._chunks.begin(); it != arena._chunks.end(); ++it)
 	{
 		Chunk *c = *it;
 		
@@ -77,34 +247,80 @@ uint8_t *MatrixMemoryAllocator::allocate(uint32_t size)
 			
 			if (c->availableSize() == 0)
 			{
-				_fullChunks.push_back(c);
-				_chunks.erase(it);
+				arena._fullChunks.push_back(c);
+				arena._chunks.erase(it);
 			}
 			
 			return v;
 		}
 	}
 	
-	reserve(_chunkSize);
+	reserve(std::max(_chunkSize, size));
 	uint8_t *v = allocate(size);
 	return v;
 }
 
+uint8_t *MatrixMemoryAllocator::allocateZeroed(uint32_t size)
+{
+	// Nothing handed out by allocate() was ever used before, see release()
+	return allocate(size);
+}
+
 void MatrixMemoryAllocator::release(uint8_t *v, uint32_t size)
 {
+	// Memory is not recycled, allocateZeroed() relies on it
 }
 
-uint32_t MatrixMemoryAllocator::getAllocatedSize() const
+uint8_t *MatrixMemoryAllocator::allocateBlock(uint32_t size, int &node)
 {
-	uint32_t s = 0;
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
 	
-	for (Chunk *c : _chunks)
+	Arena &arena = threadArena(node);
+	
+	size = (uint32_t)roundUp(size, BlockAlignment);
+	std::vector<uint8_t *> &blocks = arena._freeBlocks[size];
+	
+	if (blocks.empty())
 	{
-		s += c->totalSize();
+		uint32_t n = std::max(1u, BlockSlabSize / size);
+		uint8_t *slab = allocate(n * size + BlockAlignment);
+		slab = (uint8_t *)roundUp((size_t)slab, BlockAlignment);
+		
+		// Handed out in address order
+		for (uint32_t i = n; i-- > 0; )
+		{
+			blocks.push_back(slab + (size_t)i * size);
+		}
 	}
-	for (Chunk *c : _fullChunks)
+	
+	uint8_t *v = blocks.back();
+	blocks.pop_back();
+	return v;
+}
+
+void MatrixMemoryAllocator::releaseBlock(uint8_t *v, uint32_t size, int node)
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+	
+	_arenas[node + 1]._freeBlocks[(uint32_t)roundUp(size, BlockAlignment)].push_back(v);
+}
+
+uint32_t MatrixMemoryAllocator::getAllocatedSize() const
+{
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+	
+	uint32_t s = 0;
+	
+	for (const Arena &arena : _arenas)
 	{
-		s += c->totalSize();
+		for (Chunk *c : arena._chunks)
+		{
+			s += c->totalSize();
+		}
+		for (Chunk *c : arena._fullChunks)
+		{
+			s += c->totalSize();
+		}
 	}
 	
 	return s;
@@ -112,15 +328,20 @@ uint32_t MatrixMemoryAllocator::getAllocatedSize() const
 
 uint32_t MatrixMemoryAllocator::getWaistedSize() const
 {
+	std::lock_guard<std::recursive_mutex> lock(_mutex);
+	
 	uint32_t s = 0;
 	
-	for (Chunk *c : _chunks)
+	for (const Arena &arena : _arenas)
 	{
-		s += c->availableSize();
-	}
-	for (Chunk *c : _fullChunks)
-	{
-		s += c->availableSize();
+		for (Chunk *c : arena._chunks)
+		{
+			s += c->availableSize();
+		}
+		for (Chunk *c : arena._fullChunks)
+		{
+			s += c->availableSize();
+		}
 	}
 	
 	return s;
@@ -4,8 +4,14 @@
 #include <cstdio>
 #include <cctype>
 #include <list>
+#include <map>
 #include <string>
 #include <exception>
+#include <stdexcept>
+#include <type_traits>
+#include <cstring>
+#include <vector>
+#include <mutex>
 
 // #define NN_MATRIX_RUNTIME_CHECKS
 
@@ -89,13 +95,42 @@ class MatrixMemoryAllocator
 public:
 	static MatrixMemoryAllocator *instance();
 	
+	enum class HugePages
+	{
+		NONE, 
+		THP,		// transparent huge pages, madvise(MADV_HUGEPAGE), ignored on Windows (wingdi.h defines TRANSPARENT)
+		EXPLICIT		// MAP_HUGETLB / MEM_LARGE_PAGES, falls back to THP when no huge page is available
+	};
+	
 	void configure(uint32_t chunkSize);
+	void configure(uint32_t chunkSize, HugePages hugePages, bool numaAware);
 	void reserve(uint32_t size);
 	void releaseAll();
 	
+	HugePages hugePages() const { return _hugePages; }
+	bool numaAware() const { return _numaAware; }
+	
+	// NUMA node whose arena serves the allocations of the calling thread, -1 for the default arena.
+	// Chunks of a node arena are bound to the node, only effective when numaAware is set.
+	static void setThreadNode(int node);
+	static int threadNode();
+	
 	uint8_t *allocate(uint32_t size);
 	void release(uint8_t *v, uint32_t size);
 	
+	// Chunks are anonymous mappings and are never recycled, so fresh allocations are already zero.
+	// Pages are zero filled by the OS on first touch, they are not touched until written.
+	uint8_t *allocateZeroed(uint32_t size);
+	
+	// Cache line aligned blocks for storage that comes and goes (BlockMatrix), carved from the arena of the calling
+	// thread like allocate() and recycled through free lists of that arena per size. node is set to the arena node,
+	// a block goes back to it whichever thread releases it. Recycled blocks are not zeroed.
+	uint8_t *allocateBlock(uint32_t size, int &node);
+	void releaseBlock(uint8_t *v, uint32_t size, int node);
+	
+	// Node of the arena allocations of the calling thread come from, -1 for the default arena
+	int arenaNode() const { return (_numaAware && threadNode() >= 0) ? threadNode() : -1; }
+	
 	uint32_t getAllocatedSize() const;
 	uint32_t getWaistedSize() const;
 	
@@ -103,6 +138,8 @@ protected:
 	static MatrixMemoryAllocator *_instance;
 	
 	uint32_t _chunkSize;
+	HugePages _hugePages = HugePages::NONE;
+	bool _numaAware = false;
 	
 	struct Chunk
 	{
@@ -110,13 +147,112 @@ protected:
 		uint8_t *_end;
 		uint8_t *_storageEnd;
 		
+		// Length of the mapping, rounded up to the page size
+		size_t _mappedSize;
+		
 		inline uint32_t totalSize() const { return _storageEnd - _begin; }
 		inline uint32_t size() const { return _end - _begin; }
 		inline uint32_t availableSize() const { return _storageEnd - _end; }
 	};
 	
-	std::list<Chunk *> _fullChunks;
-	std::list<Chunk *> _chunks;
+	struct Arena
+	{
+		std::list<Chunk *> _fullChunks;
+		std::list<Chunk *> _chunks;
+		
+		// Released blocks by size, never handed out by allocate()
+		std::map<uint32_t, std::vector<uint8_t *>> _freeBlocks;
+	};
+	
+	// Arena of the calling thread and its node, -1 for the default arena
+	Arena &threadArena(int &node);
+	
+	// _arenas[0] is the default arena, _arenas[node + 1] the one of a NUMA node
+	std::vector<Arena> _arenas;
+	
+	// Worker threads allocate concurrently once subjects are placed on their nodes.
+	// Recursive since allocate() calls reserve() and the failure report reads the sizes.
+	mutable std::recursive_mutex _mutex;
+};
+
+template <class T> class MatrixT;
+template <class E> struct MatrixExpression;
+
+// Initial content of matrices on construction and resize, uninitialized when every element is written right after
+enum class MatrixInit
+{
+	ZERO, 
+	UNINITIALIZED
+};
+
+// Non-owning view over matrix elements, element (r, c) is at r * rowStride + c * columnStride.
+// Views never allocate, the viewed storage has to outlive them. MatrixView<const T> is read only.
+template <class T> class MatrixView
+{
+public:
+	using value_type = typename std::remove_const<T>::type;
+	
+	MatrixView() : MatrixView(nullptr, 0, 0)
+	{
+	}
+	
+	MatrixView(T *m, int nrows, int ncolumns) : MatrixView(m, nrows, ncolumns, ncolumns, 1)
+	{
+	}
+	
+	MatrixView(T *m, int nrows, int ncolumns, int rowStride, int columnStride)
+	{
+		_m = m;
+		_numRows = nrows;
+		_numColumns = ncolumns;
+		_rowStride = rowStride;
+		_columnStride = columnStride;
+	}
+	
+	template <class U, class = typename std::enable_if<std::is_convertible<U *, T *>::value>::type>
+	MatrixView(MatrixT<U> &m) : MatrixView(m.ptr(), m.numRows(), m.numColumns())
+	{
+	}
+	
+	template <class U, class = typename std::enable_if<std::is_convertible<const U *, T *>::value>::type>
+	MatrixView(const MatrixT<U> &m) : MatrixView(m.ptr(), m.numRows(), m.numColumns())
+	{
+	}
+	
+	template <class U, class = typename std::enable_if<std::is_convertible<U *, T *>::value>::type>
+	MatrixView(const MatrixView<U> &v) : MatrixView(v.ptr(), v.numRows(), v.numColumns(), v.rowStride(), v.columnStride())
+	{
+	}
+	
+	inline int numRows() const { return _numRows; }
+	inline int numColumns() const { return _numColumns; }
+	inline int rowStride() const { return _rowStride; }
+	inline int columnStride() const { return _columnStride; }
+	
+	inline T &operator () (int r, int c) const { return _m[r * _rowStride + c * _columnStride]; }
+	inline T *ptr() const { return _m; }
+	
+	// Rows are packed one after the other
+	bool isContiguous() const { return _columnStride == 1 && (_rowStride == _numColumns || _numRows <= 1); }
+	
+	MatrixView<T> block(int r, int c, int nrows, int ncolumns) const
+	{
+#ifdef NN_MATRIX_RUNTIME_CHECKS
+		if (r < 0 || c < 0 || nrows < 0 || ncolumns < 0 || r + nrows > _numRows || c + ncolumns > _numColumns)
+			throw std::runtime_error("nn::MatrixView::block - out of range");
+#endif
+		
+		return MatrixView<T>(_m + r * _rowStride + c * _columnStride, nrows, ncolumns, _rowStride, _columnStride);
+	}
+	
+	MatrixView<T> rows(int r, int nrows) const { return block(r, 0, nrows, _numColumns); }
+	MatrixView<T> columns(int c, int ncolumns) const { return block(0, c, _numRows, ncolumns); }
+	MatrixView<T> transposed() const { return MatrixView<T>(_m, _numColumns, _numRows, _columnStride, _rowStride); }
+	
+protected:
+	T *_m;
+	int _numRows, _numColumns;
+	int _rowStride, _columnStride;
 };
 
 template <class T> class MatrixT
@@ -132,21 +268,19 @@ public:
 		_m = nullptr;
 	}
 	
-	MatrixT(int nrows, int ncolumn)
+	MatrixT(int nrows, int ncolumn, MatrixInit init = MatrixInit::ZERO)
 	{
 		_numRows = nrows;
 		_numColumns = ncolumn;
 		
 		// _m = new value_type[_numRows * _numColumns];
-		_m = (value_type *)MatrixMemoryAllocator::instance()->allocate(sizeof(value_type) * _numRows * _numColumns);
-		
-		for (int i = 0; i < _numRows * _numColumns; ++i)
-		{
-			_m[i] = (value_type)0.0;
-		}
+		if (init == MatrixInit::ZERO)
+			_m = (value_type *)MatrixMemoryAllocator::instance()->allocateZeroed(sizeof(value_type) * _numRows * _numColumns);
+		else
+			_m = (value_type *)MatrixMemoryAllocator::instance()->allocate(sizeof(value_type) * _numRows * _numColumns);
 	}
 	
-	MatrixT(const nn::MatrixT<T> &m) : MatrixT(m.numRows(), m.numColumns())
+	MatrixT(const nn::MatrixT<T> &m) : MatrixT(m.numRows(), m.numColumns(), MatrixInit::UNINITIALIZED)
 	{
 		for (int i = 0; i < _numRows * _numColumns; ++i)
 		{
@@ -154,16 +288,82 @@ public:
 		}
 	}
 	
+	// Takes the storage, m is left empty
+	MatrixT(nn::MatrixT<T> &&m) noexcept
+	{
+		_numRows = m._numRows;
+		_numColumns = m._numColumns;
+		_m = m._m;
+		
+		m._numRows = 0;
+		m._numColumns = 0;
+		m._m = nullptr;
+	}
+	
+	// Lazy expression, see MatrixExpression.h
+	template <class E> MatrixT(const MatrixExpression<E> &e) : MatrixT(static_cast<const E &>(e).numRows(), static_cast<const E &>(e).numColumns(), MatrixInit::UNINITIALIZED)
+	{
+		evaluate(view(), e);
+	}
+	
 	~MatrixT()
 	{
 		// delete [] _m;
 		MatrixMemoryAllocator::instance()->release((uint8_t *)_m, sizeof(value_type) * _numRows * _numColumns);
 	}
 	
+	MatrixT<T> &operator = (const nn::MatrixT<T> &m)
+	{
+		if (this != &m)
+		{
+			resize(m.numRows(), m.numColumns(), MatrixInit::UNINITIALIZED);
+			
+			for (int i = 0; i < _numRows * _numColumns; ++i)
+			{
+				_m[i] = m._m[i];
+			}
+		}
+		
+		return *this;
+	}
+	
+	MatrixT<T> &operator = (nn::MatrixT<T> &&m) noexcept
+	{
+		if (this != &m)
+		{
+			MatrixMemoryAllocator::instance()->release((uint8_t *)_m, sizeof(value_type) * _numRows * _numColumns);
+			
+			_numRows = m._numRows;
+			_numColumns = m._numColumns;
+			_m = m._m;
+			
+			m._numRows = 0;
+			m._numColumns = 0;
+			m._m = nullptr;
+		}
+		
+		return *this;
+	}
+	
+	template <class E> MatrixT<T> &operator = (const MatrixExpression<E> &e)
+	{
+		const E &x = static_cast<const E &>(e);
+		
+		// The expression may read this matrix, it has to stay valid until evaluated
+		if (x.numRows() != _numRows || x.numColumns() != _numColumns)
+		{
+			*this = MatrixT<T>(e);
+			return *this;
+		}
+		
+		evaluate(view(), e);
+		return *this;
+	}
+	
 	inline int numRows() const { return _numRows; }
 	inline int numColumns() const { return _numColumns; }
 	
-	void resize(int nrows, int ncolumn)
+	void resize(int nrows, int ncolumn, MatrixInit init = MatrixInit::ZERO)
 	{
 		if (nrows != numRows() || ncolumn != numColumns())
 		{
@@ -174,12 +374,15 @@ public:
 			_numColumns = ncolumn;
 			
 			// _m = new value_type[_numRows * _numColumns];
-			_m = (value_type *)MatrixMemoryAllocator::instance()->allocate(sizeof(value_type) * _numRows * _numColumns);
+			if (init == MatrixInit::ZERO)
+				_m = (value_type *)MatrixMemoryAllocator::instance()->allocateZeroed(sizeof(value_type) * _numRows * _numColumns);
+			else
+				_m = (value_type *)MatrixMemoryAllocator::instance()->allocate(sizeof(value_type) * _numRows * _numColumns);
 		}
-		
-		for (int i = 0; i < _numRows * _numColumns; ++i)
+		else if (init == MatrixInit::ZERO && _m != nullptr)
 		{
-			_m[i] = (value_type)0.0;
+			// All bits zero is 0.0
+			memset(_m, 0, sizeof(value_type) * _numRows * _numColumns);
 		}
 	}
 	
@@ -189,6 +392,15 @@ public:
 	inline value_type *ptr() { return _m; }
 	inline const value_type *ptr() const { return _m; }
 	
+	MatrixView<T> view() { return MatrixView<T>(_m, _numRows, _numColumns); }
+	MatrixView<const T> view() const { return MatrixView<const T>(_m, _numRows, _numColumns); }
+	
+	MatrixView<T> block(int r, int c, int nrows, int ncolumns) { return view().block(r, c, nrows, ncolumns); }
+	MatrixView<const T> block(int r, int c, int nrows, int ncolumns) const { return view().block(r, c, nrows, ncolumns); }
+	
+	MatrixView<T> rows(int r, int nrows) { return view().rows(r, nrows); }
+	MatrixView<const T> rows(int r, int nrows) const { return view().rows(r, nrows); }
+	
 protected:
 	int _numRows, _numColumns;
 	value_type *_m;
@@ -198,7 +410,16 @@ using Matrix = MatrixT<float>;
 using MatrixF = MatrixT<float>;
 using MatrixD = MatrixT<double>;
 
-template <class T> void add(const MatrixT<T> &a, const MatrixT<T> &b, MatrixT<T> &c)
+using MatrixViewF = MatrixView<float>;
+using ConstMatrixViewF = MatrixView<const float>;
+
+// Kernels work on views, the type is deduced from the output so inputs may be matrices or views of either constness
+template <class T> struct ConstViewOf
+{
+	using type = MatrixView<const T>;
+};
+
+template <class T> void add(typename ConstViewOf<T>::type a, typename ConstViewOf<T>::type b, MatrixView<T> c)
 {
 #ifdef NN_MATRIX_RUNTIME_CHECKS
 	if (a.numColumns() != b.numColumns() || a.numRows() != b.numRows())
@@ -217,7 +438,12 @@ template <class T> void add(const MatrixT<T> &a, const MatrixT<T> &b, MatrixT<T>
 	}
 }
 
-template <class T> void subtract(const MatrixT<T> &a, const MatrixT<T> &b, MatrixT<T> &c)
+template <class T> void add(const MatrixT<T> &a, const MatrixT<T> &b, MatrixT<T> &c)
+{
+	add<T>(a.view(), b.view(), c.view());
+}
+
+template <class T> void subtract(typename ConstViewOf<T>::type a, typename ConstViewOf<T>::type b, MatrixView<T> c)
 {
 #ifdef NN_MATRIX_RUNTIME_CHECKS
 	if (a.numColumns() != b.numColumns() || a.numRows() != b.numRows())
@@ -236,7 +462,12 @@ template <class T> void subtract(const MatrixT<T> &a, const MatrixT<T> &b, Matri
 	}
 }
 
-template <class T> void copy(const MatrixT<T> &a, MatrixT<T> &b)
+template <class T> void subtract(const MatrixT<T> &a, const MatrixT<T> &b, MatrixT<T> &c)
+{
+	subtract<T>(a.view(), b.view(), c.view());
+}
+
+template <class T> void copy(typename ConstViewOf<T>::type a, MatrixView<T> b)
 {
 #ifdef NN_MATRIX_RUNTIME_CHECKS
 	if (a.numColumns() != b.numColumns() || a.numRows() != b.numRows())
@@ -252,7 +483,12 @@ template <class T> void copy(const MatrixT<T> &a, MatrixT<T> &b)
 	}
 }
 
-template <class T> void dot(const MatrixT<T> &a, const MatrixT<T> &b, MatrixT<T> &c)
+template <class T> void copy(const MatrixT<T> &a, MatrixT<T> &b)
+{
+	copy<T>(a.view(), b.view());
+}
+
+template <class T> void dot(typename ConstViewOf<T>::type a, typename ConstViewOf<T>::type b, MatrixView<T> c)
 {
 #ifdef NN_MATRIX_RUNTIME_CHECKS
 	if (a.numColumns() != b.numRows())
@@ -276,7 +512,12 @@ template <class T> void dot(const MatrixT<T> &a, const MatrixT<T> &b, MatrixT<T>
 	}
 }
 
-template <class T> void multiply(const MatrixT<T> &a, const MatrixT<T> &b, MatrixT<T> &c)
+template <class T> void dot(const MatrixT<T> &a, const MatrixT<T> &b, MatrixT<T> &c)
+{
+	dot<T>(a.view(), b.view(), c.view());
+}
+
+template <class T> void multiply(typename ConstViewOf<T>::type a, typename ConstViewOf<T>::type b, MatrixView<T> c)
 {
 #ifdef NN_MATRIX_RUNTIME_CHECKS
 	if (a.numColumns() != b.numColumns() || a.numRows() != b.numRows())
@@ -296,7 +537,12 @@ template <class T> void multiply(const MatrixT<T> &a, const MatrixT<T> &b, Matri
 	}
 }
 
-template <class T> T sum(const MatrixT<T> &a, T s)
+template <class T> void multiply(const MatrixT<T> &a, const MatrixT<T> &b, MatrixT<T> &c)
+{
+	multiply<T>(a.view(), b.view(), c.view());
+}
+
+template <class T> T sum(typename ConstViewOf<T>::type a, T s)
 {
 	for (int ir = 0; ir < a.numRows(); ++ir)
 	{
@@ -308,9 +554,14 @@ template <class T> T sum(const MatrixT<T> &a, T s)
 	return s;
 }
 
-template <class T> T min(const MatrixT<T> &a, int &ir, int &ic)
+template <class T> T sum(const MatrixT<T> &a, T s)
 {
-	T v = a(0, 0);
+	return sum<T>(a.view(), s);
+}
+
+template <class T> typename MatrixView<T>::value_type min(MatrixView<T> a, int &ir, int &ic)
+{
+	typename MatrixView<T>::value_type v = a(0, 0);
 	ir = 0;
 	ic = 0;
 	
@@ -330,9 +581,14 @@ template <class T> T min(const MatrixT<T> &a, int &ir, int &ic)
 	return v;
 }
 
-template <class T> T max(const MatrixT<T> &a, int &ir, int &ic)
+template <class T> T min(const MatrixT<T> &a, int &ir, int &ic)
+{
+	return min(a.view(), ir, ic);
+}
+
+template <class T> typename MatrixView<T>::value_type max(MatrixView<T> a, int &ir, int &ic)
 {
-	T v = a(0, 0);
+	typename MatrixView<T>::value_type v = a(0, 0);
 	ir = 0;
 	ic = 0;
 	
@@ -352,7 +608,12 @@ template <class T> T max(const MatrixT<T> &a, int &ir, int &ic)
 	return v;
 }
 
-template <class T, class F> void map(MatrixT<T> &a, F f)
+template <class T> T max(const MatrixT<T> &a, int &ir, int &ic)
+{
+	return max(a.view(), ir, ic);
+}
+
+template <class T, class F> void map(MatrixView<T> a, F f)
 {
 	for (int ir = 0; ir < a.numRows(); ++ir)
 	{
@@ -364,7 +625,12 @@ template <class T, class F> void map(MatrixT<T> &a, F f)
 	}
 }
 
-template <class T, class F> void map(const MatrixT<T> &a, const MatrixT<T> &b, F f)
+template <class T, class F> void map(MatrixT<T> &a, F f)
+{
+	map(a.view(), f);
+}
+
+template <class TA, class TB, class F> void map(MatrixView<TA> a, MatrixView<TB> b, F f)
 {
 #ifdef NN_MATRIX_RUNTIME_CHECKS
 	if (a.numColumns() != b.numColumns() || a.numRows() != b.numRows())
@@ -375,14 +641,19 @@ template <class T, class F> void map(const MatrixT<T> &a, const MatrixT<T> &b, F
 	{
 		for (int ic = 0; ic < a.numColumns(); ++ic)
 		{
-			T va = a(ir, ic);
-			T vb = b(ir, ic);
+			typename MatrixView<TA>::value_type va = a(ir, ic);
+			typename MatrixView<TB>::value_type vb = b(ir, ic);
 			f(va, vb);
 		}
 	}
 }
 
-template <class T, class F> void imap(MatrixT<T> &a, F f)
+template <class T, class F> void map(const MatrixT<T> &a, const MatrixT<T> &b, F f)
+{
+	map(a.view(), b.view(), f);
+}
+
+template <class T, class F> void imap(MatrixView<T> a, F f)
 {
 	for (int ir = 0; ir < a.numRows(); ++ir)
 	{
@@ -394,7 +665,12 @@ template <class T, class F> void imap(MatrixT<T> &a, F f)
 	}
 }
 
-template <class T> void print(const MatrixT<T> &a, const char *label)
+template <class T, class F> void imap(MatrixT<T> &a, F f)
+{
+	imap(a.view(), f);
+}
+
+template <class T> void print(MatrixView<T> a, const char *label)
 {
 	printf("%s:\n", label);
 	for (int ir = 0; ir < a.numRows(); ++ir)
@@ -410,6 +686,11 @@ template <class T> void print(const MatrixT<T> &a, const char *label)
 	}
 }
 
+template <class T> void print(const MatrixT<T> &a, const char *label)
+{
+	print(a.view(), label);
+}
+
 }; // namespace nn
 
 #endif // __NN_MATRIX_H__
@@ -0,0 +1,349 @@
+#ifndef __NN_MATRIX_EXPRESSION_H__
+#define __NN_MATRIX_EXPRESSION_H__
+
+#include "Matrix.h"
+#include <cmath>
+#include <type_traits>
+
+namespace nn
+{
+
+// Lazy element-wise expressions over matrices and views.
+//
+// Usage:
+//   output = nn::sigmoid(weights * input + biases);
+//   float loss = nn::sum(nn::square(output - target));
+//
+// Element-wise chains are evaluated in a single loop without intermediate matrices. Products
+// (operator *) go through nn::dot before that loop, straight into the destination when nothing
+// else in the expression reads it, otherwise into a temporary.
+template <class E> struct MatrixExpression
+{
+	const E &self() const { return static_cast<const E &>(*this); }
+};
+
+template <class T> bool overlaps(const MatrixView<const T> &a, const MatrixView<const T> &b)
+{
+	if (a.numRows() == 0 || a.numColumns() == 0 || b.numRows() == 0 || b.numColumns() == 0)
+		return false;
+	
+	const T *aBegin = &a(0, 0);
+	const T *aEnd = &a(a.numRows() - 1, a.numColumns() - 1) + 1;
+	const T *bBegin = &b(0, 0);
+	const T *bEnd = &b(b.numRows() - 1, b.numColumns() - 1) + 1;
+	
+	return aBegin < bEnd && bBegin < aEnd;
+}
+
+template <class T> bool sameView(const MatrixView<const T> &a, const MatrixView<const T> &b)
+{
+	return a.ptr() == b.ptr() &&
+		a.numRows() == b.numRows() && a.numColumns() == b.numColumns() &&
+		a.rowStride() == b.rowStride() && a.columnStride() == b.columnStride();
+}
+
+// Every node provides:
+//   numRows(), numColumns(), operator () (r, c)  the element-wise value
+//   prepare(dst, dstTaken)                       computes products, into dst unless already taken
+//   reads(dst)                                   true when any operand overlaps dst
+//   conflicts(dst)                               true when an element-wise read overlaps dst at another element
+template <class T> struct ViewExpression : public MatrixExpression<ViewExpression<T>>
+{
+	using value_type = T;
+	
+	ViewExpression(const MatrixView<const T> &view) : _view(view)
+	{
+	}
+	
+	int numRows() const { return _view.numRows(); }
+	int numColumns() const { return _view.numColumns(); }
+	T operator () (int r, int c) const { return _view(r, c); }
+	
+	void prepare(const MatrixView<T> &dst, bool &dstTaken) const
+	{
+	}
+	
+	bool reads(const MatrixView<const T> &dst) const { return overlaps(_view, dst); }
+	bool conflicts(const MatrixView<const T> &dst) const { return reads(dst) && ! sameView(_view, dst); }
+	
+	MatrixView<const T> _view;
+};
+
+template <class A, class F> struct UnaryExpression : public MatrixExpression<UnaryExpression<A, F>>
+{
+	using value_type = typename A::value_type;
+	
+	UnaryExpression(const A &a, F f) : _a(a), _f(f)
+	{
+	}
+	
+	int numRows() const { return _a.numRows(); }
+	int numColumns() const { return _a.numColumns(); }
+	value_type operator () (int r, int c) const { return _f(_a(r, c)); }
+	
+	void prepare(const MatrixView<value_type> &dst, bool &dstTaken) const { _a.prepare(dst, dstTaken); }
+	bool reads(const MatrixView<const value_type> &dst) const { return _a.reads(dst); }
+	bool conflicts(const MatrixView<const value_type> &dst) const { return _a.conflicts(dst); }
+	
+	A _a;
+	F _f;
+};
+
+template <class A, class B, class F> struct BinaryExpression : public MatrixExpression<BinaryExpression<A, B, F>>
+{
+	using value_type = typename A::value_type;
+	
+	BinaryExpression(const A &a, const B &b, F f) : _a(a), _b(b), _f(f)
+	{
+#ifdef NN_MATRIX_RUNTIME_CHECKS
+		if (a.numRows() != b.numRows() || a.numColumns() != b.numColumns())
+			throw std::runtime_error("nn::BinaryExpression - a/b shape mismatch");
+#endif
+	}
+	
+	int numRows() const { return _a.numRows(); }
+	int numColumns() const { return _a.numColumns(); }
+	value_type operator () (int r, int c) const { return _f(_a(r, c), _b(r, c)); }
+	
+	void prepare(const MatrixView<value_type> &dst, bool &dstTaken) const
+	{
+		_a.prepare(dst, dstTaken);
+		_b.prepare(dst, dstTaken);
+	}
+	
+	bool reads(const MatrixView<const value_type> &dst) const { return _a.reads(dst) || _b.reads(dst); }
+	bool conflicts(const MatrixView<const value_type> &dst) const { return _a.conflicts(dst) || _b.conflicts(dst); }
+	
+	A _a;
+	B _b;
+	F _f;
+};
+
+template <class T, class E> void evaluate(MatrixView<T> dst, const MatrixExpression<E> &expression);
+
+// Operands of products are used in place when they are plain views, other expressions are evaluated first
+template <class T> MatrixView<const T> materialize(const ViewExpression<T> &e, MatrixT<T> &temp)
+{
+	return e._view;
+}
+
+template <class E> MatrixView<const typename E::value_type> materialize(const E &e, MatrixT<typename E::value_type> &temp)
+{
+	temp.resize(e.numRows(), e.numColumns(), MatrixInit::UNINITIALIZED);
+	evaluate(temp.view(), e);
+	return temp.view();
+}
+
+template <class A, class B> struct ProductExpression : public MatrixExpression<ProductExpression<A, B>>
+{
+	using value_type = typename A::value_type;
+	
+	ProductExpression(const A &a, const B &b) : _a(a), _b(b)
+	{
+#ifdef NN_MATRIX_RUNTIME_CHECKS
+		if (a.numColumns() != b.numRows())
+			throw std::runtime_error("nn::ProductExpression - a/b shape mismatch");
+#endif
+	}
+	
+	int numRows() const { return _a.numRows(); }
+	int numColumns() const { return _b.numColumns(); }
+	value_type operator () (int r, int c) const { return _result(r, c); }
+	
+	void prepare(const MatrixView<value_type> &dst, bool &dstTaken) const
+	{
+		_a.prepare(dst, dstTaken);
+		_b.prepare(dst, dstTaken);
+		
+		MatrixView<const value_type> a = materialize(_a, _aTemp);
+		MatrixView<const value_type> b = materialize(_b, _bTemp);
+		
+		if (! dstTaken)
+		{
+			dot<value_type>(a, b, dst);
+			_result = dst;
+			dstTaken = true;
+		}
+		else
+		{
+			_temp.resize(numRows(), numColumns(), MatrixInit::UNINITIALIZED);
+			dot<value_type>(a, b, _temp.view());
+			_result = _temp.view();
+		}
+	}
+	
+	// Operands are consumed by prepare, before anything is written to dst
+	bool reads(const MatrixView<const value_type> &dst) const { return _a.reads(dst) || _b.reads(dst); }
+	bool conflicts(const MatrixView<const value_type> &dst) const { return false; }
+	
+	A _a;
+	B _b;
+	
+	mutable MatrixT<value_type> _aTemp, _bTemp, _temp;
+	mutable MatrixView<const value_type> _result;
+};
+
+template <class T, class E> void evaluate(MatrixView<T> dst, const MatrixExpression<E> &expression)
+{
+	const E &e = expression.self();
+
+#ifdef NN_MATRIX_RUNTIME_CHECKS
+	if (dst.numRows() != e.numRows() || dst.numColumns() != e.numColumns())
+		throw std::runtime_error("nn::evaluate - shape mismatch");
+#endif
+
+	MatrixView<const T> cdst(dst);
+	
+	// dst(r, c) may only depend on dst(r, c) itself, otherwise go through a temporary
+	if (e.conflicts(cdst))
+	{
+		MatrixT<T> temp(dst.numRows(), dst.numColumns(), MatrixInit::UNINITIALIZED);
+		evaluate(temp.view(), e);
+		copy<T>(temp.view(), dst);
+		return;
+	}
+	
+	// A product may only be computed into dst when nothing else reads it
+	bool dstTaken = e.reads(cdst);
+	e.prepare(dst, dstTaken);
+	
+	for (int ir = 0; ir < dst.numRows(); ++ir)
+	{
+		for (int ic = 0; ic < dst.numColumns(); ++ic)
+		{
+			dst(ir, ic) = e(ir, ic);
+		}
+	}
+}
+
+template <class E> typename E::value_type sum(const MatrixExpression<E> &expression)
+{
+	const E &e = expression.self();
+	
+	MatrixView<typename E::value_type> none;
+	bool dstTaken = true;
+	e.prepare(none, dstTaken);
+	
+	typename E::value_type s = (typename E::value_type)0.0;
+	for (int ir = 0; ir < e.numRows(); ++ir)
+	{
+		for (int ic = 0; ic < e.numColumns(); ++ic)
+		{
+			s += e(ir, ic);
+		}
+	}
+	return s;
+}
+
+// Matrices, views and expressions are operands
+template <class X, class Enable = void> struct ExpressionOf
+{
+};
+
+template <class T> struct ExpressionOf<MatrixT<T>, void>
+{
+	using type = ViewExpression<T>;
+	static type make(const MatrixT<T> &m) { return type(m.view()); }
+};
+
+template <class T> struct ExpressionOf<MatrixView<T>, void>
+{
+	using type = ViewExpression<typename std::remove_const<T>::type>;
+	static type make(const MatrixView<T> &v) { return type(v); }
+};
+
+template <class E> struct ExpressionOf<E, typename std::enable_if<std::is_base_of<MatrixExpression<E>, E>::value>::type>
+{
+	using type = E;
+	static const E &make(const E &e) { return e; }
+};
+
+struct AddFunction
+{
+	template <class T> T operator () (T a, T b) const { return a + b; }
+};
+
+struct SubtractFunction
+{
+	template <class T> T operator () (T a, T b) const { return a - b; }
+};
+
+struct MultiplyFunction
+{
+	template <class T> T operator () (T a, T b) const { return a * b; }
+};
+
+struct SigmoidFunction
+{
+	template <class T> T operator () (T v) const { return (T)1.0 / ((T)1.0 + std::exp(-v)); }
+};
+
+struct ExpFunction
+{
+	template <class T> T operator () (T v) const { return std::exp(v); }
+};
+
+struct LogFunction
+{
+	template <class T> T operator () (T v) const { return std::log(v); }
+};
+
+struct SquareFunction
+{
+	template <class T> T operator () (T v) const { return v * v; }
+};
+
+template <class A, class B> BinaryExpression<typename ExpressionOf<A>::type, typename ExpressionOf<B>::type, AddFunction> operator + (const A &a, const B &b)
+{
+	using R = BinaryExpression<typename ExpressionOf<A>::type, typename ExpressionOf<B>::type, AddFunction>;
+	return R(ExpressionOf<A>::make(a), ExpressionOf<B>::make(b), AddFunction());
+}
+
+template <class A, class B> BinaryExpression<typename ExpressionOf<A>::type, typename ExpressionOf<B>::type, SubtractFunction> operator - (const A &a, const B &b)
+{
+	using R = BinaryExpression<typename ExpressionOf<A>::type, typename ExpressionOf<B>::type, SubtractFunction>;
+	return R(ExpressionOf<A>::make(a), ExpressionOf<B>::make(b), SubtractFunction());
+}
+
+// Matrix product
+template <class A, class B> ProductExpression<typename ExpressionOf<A>::type, typename ExpressionOf<B>::type> operator * (const A &a, const B &b)
+{
+	using R = ProductExpression<typename ExpressionOf<A>::type, typename ExpressionOf<B>::type>;
+	return R(ExpressionOf<A>::make(a), ExpressionOf<B>::make(b));
+}
+
+// Element-wise product
+template <class A, class B> BinaryExpression<typename ExpressionOf<A>::type, typename ExpressionOf<B>::type, MultiplyFunction> hadamard(const A &a, const B &b)
+{
+	using R = BinaryExpression<typename ExpressionOf<A>::type, typename ExpressionOf<B>::type, MultiplyFunction>;
+	return R(ExpressionOf<A>::make(a), ExpressionOf<B>::make(b), MultiplyFunction());
+}
+
+template <class A, class F> UnaryExpression<typename ExpressionOf<A>::type, F> apply(const A &a, F f)
+{
+	return UnaryExpression<typename ExpressionOf<A>::type, F>(ExpressionOf<A>::make(a), f);
+}
+
+template <class A> UnaryExpression<typename ExpressionOf<A>::type, SigmoidFunction> sigmoid(const A &a)
+{
+	return apply(a, SigmoidFunction());
+}
+
+template <class A> UnaryExpression<typename ExpressionOf<A>::type, ExpFunction> exp(const A &a)
+{
+	return apply(a, ExpFunction());
+}
+
+template <class A> UnaryExpression<typename ExpressionOf<A>::type, LogFunction> log(const A &a)
+{
+	return apply(a, LogFunction());
+}
+
+template <class A> UnaryExpression<typename ExpressionOf<A>::type, SquareFunction> square(const A &a)
+{
+	return apply(a, SquareFunction());
+}
+
+}; // namespace nn
+
+#endif // __NN_MATRIX_EXPRESSION_H__
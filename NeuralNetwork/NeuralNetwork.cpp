@@ -1,41 +1,243 @@
 #include "NeuralNetwork.h"
+#include "MatrixExpression.h"
 #include <cmath>
+#include <algorithm>
 #include <cassert>
+#include <cstdio>
+#include <memory>
 #include <random>
 
 namespace nn
 {
 std::default_random_engine _random_generator;
-std::uniform_real_distribution<float> _minus_one_one_distribution(-1.0f, 1.0f);
-std::uniform_real_distribution<float> _zero_one_distribution(0.0f, 1.0f);
+
+namespace
+{
+	// Distributions are local, so that seeded networks can be rebuilt from several threads at once
+	template <class R> void randomizeLayers(NeuralNetwork::LayerList &layers, R &random)
+	{
+		std::uniform_real_distribution<float> minus_one_one(-1.0f, 1.0f);
+		
+		for (auto &layer : layers)
+		{
+			nn::map(layer._weights, [&](nn::Matrix::value_type v) { return minus_one_one(random); });
+			nn::map(layer._biases, [&](nn::Matrix::value_type v) { return minus_one_one(random); });
+			
+			// After the biases, dense layers draw the same values as before factorization was added
+			if (layer.factorized())
+				nn::map(layer._factor, [&](nn::Matrix::value_type v) { return minus_one_one(random); });
+		}
+	}
+	
+	// Same draws as a row-major pass, a shared block is only duplicated once one of its values changes
+	template <class R> int mutateBlocks(nn::BlockMatrix &m, double rate, R &random)
+	{
+		std::uniform_real_distribution<float> minus_one_one(-1.0f, 1.0f);
+		std::uniform_real_distribution<float> zero_one(0.0f, 1.0f);
+		
+		int nmutations = 0;
+		for (int ib = 0; ib < m.numBlocks(); ++ib)
+		{
+			nn::MatrixView<float> block;
+			bool writable = false;
+			
+			for (int ir = 0; ir < m.blockNumRows(ib); ++ir)
+			{
+				for (int ic = 0; ic < m.numColumns(); ++ic)
+				{
+					float p = zero_one(random);
+					if (p <= rate)
+					{
+						if (! writable)
+						{
+							block = m.mutableBlock(ib);
+							writable = true;
+						}
+						
+						// block(ir, ic) += 0.5f * minus_one_one(random);
+						block(ir, ic) = minus_one_one(random);
+						nmutations += 1;
+					}
+				}
+			}
+		}
+		
+		return nmutations;
+	}
+	
+	// Where the rows of m are, blocks are shared between networks and may be replaced by mutation
+	const float *const *rowTable(const nn::BlockMatrix &m, std::vector<const float *> &rows)
+	{
+		rows.resize(m.numRows());
+		for (int r = 0; r < m.numRows(); ++r)
+		{
+			rows[r] = m.row(r);
+		}
+		return rows.data();
+	}
+	
+	// outputs = m x + biases for the first nsamples rows x of inputs, one sample per row. Rows of m go a tile at a time,
+	// a tile is small enough to stay in L2 while every sample passes over it. biases may be nullptr.
+	void batchProduct(const nn::BlockMatrix &m, const nn::Matrix &inputs, int nsamples, const float *biases, nn::Matrix &outputs, std::vector<const float *> &rows)
+	{
+		const int nrows = m.numRows();
+		const int ncolumns = m.numColumns();
+		const int tileRows = NeuralNetwork::batchTileRows(nrows, ncolumns);
+		
+		rowTable(m, rows);
+		
+		Jit &jit = Jit::instance();
+		GemvKernel tileKernel = jit.gemv(tileRows, ncolumns, biases != nullptr);
+		GemvKernel tailKernel = (nrows % tileRows != 0) ? jit.gemv(nrows % tileRows, ncolumns, biases != nullptr) : nullptr;
+		
+		for (int r0 = 0; r0 < nrows; r0 += tileRows)
+		{
+			const int n = std::min(tileRows, nrows - r0);
+			GemvKernel kernel = (n == tileRows) ? tileKernel : tailKernel;
+			
+			for (int s = 0; s < nsamples; ++s)
+			{
+				const float *x = &inputs(s, 0);
+				float *y = &outputs(s, r0);
+				
+				if (kernel != nullptr)
+				{
+					kernel(rows.data() + r0, x, (biases != nullptr) ? biases + r0 : nullptr, y);
+					continue;
+				}
+				
+				for (int r = 0; r < n; ++r)
+				{
+					const float *row = rows[r0 + r];
+					float v = 0.0f;
+					for (int i = 0; i < ncolumns; ++i)
+					{
+						v += row[i] * x[i];
+					}
+					y[r] = (biases != nullptr) ? v + biases[r0 + r] : v;
+				}
+			}
+		}
+	}
+	
+	const uint32_t CheckpointMagic = 0x4b434e4e; // "NNCK"
+	const uint32_t CheckpointVersion = 1;
+	
+	void writeValues(FILE *file, const void *values, size_t size, const std::string &path)
+	{
+		if (size > 0 && fwrite(values, 1, size, file) != size)
+		{
+			fclose(file);
+			throw std::runtime_error("nn::NeuralNetwork - unable to write '" + path + "'");
+		}
+	}
+	
+	void readValues(FILE *file, void *values, size_t size, const std::string &path)
+	{
+		if (size > 0 && fread(values, 1, size, file) != size)
+		{
+			fclose(file);
+			throw std::runtime_error("nn::NeuralNetwork - truncated checkpoint '" + path + "'");
+		}
+	}
+	
+	template <class R> void mutateLayers(NeuralNetwork::LayerList &layers, double rate, R &random)
+	{
+		std::uniform_real_distribution<float> minus_one_one(-1.0f, 1.0f);
+		std::uniform_real_distribution<float> zero_one(0.0f, 1.0f);
+		
+		// printf("NeuralNetwork::mutate(%f): ", rate);
+		int nmutations = 0, nvalues = 0;
+		
+		for (NeuralNetwork::Layer &layer : layers)
+		{
+			// U and V of a factorized layer are mutated directly, W is never formed
+			nmutations += mutateBlocks(layer._weights, rate, random);
+			nvalues += layer._weights.numRows() * layer._weights.numColumns();
+			
+			nn::map(layer._biases, [&] (nn::Matrix::value_type v) {
+				float p = zero_one(random);
+				if (p <= rate)
+				{
+					// v += 0.5f * minus_one_one(random);
+					v = minus_one_one(random);
+					nmutations += 1;
+				}
+				return v;
+			});
+			nvalues += layer._biases.numRows() * layer._biases.numColumns();
+			
+			if (layer.factorized())
+			{
+				nmutations += mutateBlocks(layer._factor, rate, random);
+				nvalues += layer._factor.numRows() * layer._factor.numColumns();
+			}
+		}
+		
+		// printf("%d / %d (%f)\n", nmutations, nvalues, (double)nmutations / (double)nvalues);
+	}
+};
 
 void NeuralNetwork::randomize()
 {
-	for (auto &layer : _layers)
+	randomizeLayers(_layers, _random_generator);
+}
+
+void NeuralNetwork::randomize(uint32_t seed)
+{
+	std::mt19937 random(seed);
+	randomizeLayers(_layers, random);
+}
+
+// Weights and biases are randomized by the network, outputs live in workspaces
+NeuralNetwork::NeuralNetwork::Layer::Layer(int nInputs, int nOutputs, ActivationFunction af, int rank) : 
+	_type(LayerType::DENSE), 
+	_weights(nOutputs, (rank > 0) ? rank : nInputs), 
+	_factor((rank > 0) ? rank : 0, nInputs), 
+	_biases(nOutputs, 1, MatrixInit::UNINITIALIZED), 
+	_af(af), 
+	_shape()
+{
+}
+
+NeuralNetwork::Layer::Layer(LayerType type, const ConvolutionShape &shape, int filters, ActivationFunction af) : 
+	_type(type), 
+	_af(af), 
+	_shape(shape)
+{
+	if (_type == LayerType::CONV2D)
 	{
-		nn::map(layer._weights, [&](nn::Matrix::value_type v) { return _minus_one_one_distribution(_random_generator); });
-		nn::map(layer._biases, [&](nn::Matrix::value_type v) { return _minus_one_one_distribution(_random_generator); });
+		_weights = nn::BlockMatrix(filters, shape.windowSize());
+		_biases.resize(filters, 1, MatrixInit::UNINITIALIZED);
 	}
 }
 
-NeuralNetwork::NeuralNetwork::Layer::Layer(int nInputs, int nOutputs, ActivationFunction af) : 
-	_weights(nOutputs, nInputs), 
-	_biases(nOutputs, 1), 
-	_output(nOutputs, 1), 
-	_af(af)
+int NeuralNetwork::Layer::numInputs() const
 {
+	if (_type != LayerType::DENSE)
+		return _shape._channels * _shape._height * _shape._width;
+	
+	return factorized() ? _factor.numColumns() : _weights.numColumns();
 }
 
-void NeuralNetwork::Layer::activate()
+int NeuralNetwork::Layer::numOutputs() const
+{
+	if (_type != LayerType::DENSE)
+		return numChannels() * _shape.outputSize();
+	
+	return _weights.numRows();
+}
+
+void NeuralNetwork::Layer::activate(nn::Matrix &output) const
 {
 	switch (_af)
 	{
 		case ActivationFunction::SIGMOID:
-			activation_sigmoid();
+			activation_sigmoid(output);
 			break;
 		
 		case ActivationFunction::SOFTMAX:
-			activation_softmax();
+			activation_softmax(output);
 			break;
 		
 		default:
@@ -44,40 +246,312 @@ void NeuralNetwork::Layer::activate()
 	};
 }
 
-void NeuralNetwork::Layer::activation_sigmoid()
+void NeuralNetwork::Layer::activateRows(MatrixView<float> outputs) const
+{
+	if (_af != ActivationFunction::SOFTMAX)
+	{
+		activation_sigmoid(outputs);
+		return;
+	}
+	
+	for (int s = 0; s < outputs.numRows(); ++s)
+	{
+		float *y = &outputs(s, 0);
+		
+		nn::Matrix::value_type sum = 0.0f;
+		for (int i = 0; i < outputs.numColumns(); ++i)
+		{
+			y[i] = std::expf(y[i]);
+			sum += y[i];
+		}
+		
+		for (int i = 0; i < outputs.numColumns(); ++i)
+		{
+			y[i] /= sum;
+		}
+	}
+}
+
+void NeuralNetwork::Layer::activation_sigmoid(nn::Matrix &output)
+{
+	activation_sigmoid(output.view());
+}
+
+void NeuralNetwork::Layer::activation_sigmoid(MatrixView<float> output)
+{
+	nn::map(output, [] (nn::Matrix::value_type v) { return 1.0f / (1.0f + std::expf(-v)); });
+}
+
+void NeuralNetwork::Layer::activation_softmax(nn::Matrix &output)
+{
+	nn::map(output, [] (nn::Matrix::value_type v) { return std::expf(v); });
+	nn::Matrix::value_type sum = nn::sum(output, 0.0f);
+	nn::map(output, [&] (nn::Matrix::value_type v) { return v / sum; });
+}
+
+void NeuralNetwork::init(int nInputs, const std::vector<LayerInfo> &layers, LossFunction lf)
 {
-	nn::map(_output, [] (nn::Matrix::value_type v) { return 1.0f / (1.0f + std::expf(-v)); });
+	_layers.reserve(layers.size());
+	
+	// Image geometry of the previous layer output, none after a dense layer
+	int channels = 0, height = 0, width = 0;
+	
+	for (const LayerInfo &info : layers)
+	{
+		if (info.type == LayerType::DENSE)
+		{
+			_layers.push_back(Layer(nInputs, info.units, info.af, info.rank));
+			channels = 0;
+			
+			// Shapes are fixed from now on, copies and children share the kernels
+			Layer &layer = _layers.back();
+			Jit &jit = Jit::instance();
+			layer._kernel = jit.gemv(layer._weights.numRows(), layer._weights.numColumns(), true);
+			if (layer.factorized())
+			{
+				layer._factorKernel = jit.gemv(layer._factor.numRows(), layer._factor.numColumns(), false);
+				if (layer._factorKernel == nullptr)
+					layer._kernel = nullptr;
+			}
+		}
+		else
+		{
+			if (info.width > 0 && info.height > 0)
+			{
+				width = info.width;
+				height = info.height;
+				channels = nInputs / (width * height);
+			}
+			
+			if (channels <= 0 || channels * height * width != nInputs)
+				throw std::runtime_error("nn::NeuralNetwork - image size of a convolution or pooling layer does not match its input");
+			
+			if (info.kernel <= 0 || info.stride <= 0 || info.kernel > width || info.kernel > height)
+				throw std::runtime_error("nn::NeuralNetwork - convolution or pooling window larger than its input");
+			
+			ConvolutionShape shape = { channels, height, width, info.kernel, info.stride };
+			_layers.push_back(Layer(info.type, shape, info.units, info.af));
+			
+			channels = _layers.back().numChannels();
+			height = shape.outputHeight();
+			width = shape.outputWidth();
+		}
+		
+		nInputs = _layers.back().numOutputs();
+	}
+	
+	_lf = lf;
 }
 
-void NeuralNetwork::Layer::activation_softmax()
+void NeuralNetwork::prepare(Workspace &workspace) const
 {
-	nn::map(_output, [] (nn::Matrix::value_type v) { return std::expf(v); });
-	nn::Matrix::value_type sum = nn::sum(_output, 0.0f);
-	nn::map(_output, [&] (nn::Matrix::value_type v) { return v / sum; });
+	if (workspace._outputs.size() != _layers.size())
+	{
+		workspace._outputs.resize(_layers.size());
+		workspace._projections.resize(_layers.size());
+	}
+	
+	for (size_t i = 0; i < _layers.size(); ++i)
+	{
+		if (workspace._outputs[i].numRows() != _layers[i].numOutputs() || workspace._outputs[i].numColumns() != 1)
+			workspace._outputs[i].resize(_layers[i].numOutputs(), 1, MatrixInit::UNINITIALIZED);
+		
+		if (_layers[i].factorized() && workspace._projections[i].numRows() != _layers[i].rank())
+			workspace._projections[i].resize(_layers[i].rank(), 1, MatrixInit::UNINITIALIZED);
+	}
+	
+	if (workspace._columns.numRows() < columnsSize())
+		workspace._columns.resize(columnsSize(), 1, MatrixInit::UNINITIALIZED);
 }
 
-void NeuralNetwork::feed_forward(const nn::Matrix &input)
+void NeuralNetwork::prepareBatch(Workspace &workspace, int nsamples) const
 {
+	if (workspace._batchOutputs.size() != _layers.size())
+	{
+		workspace._batchOutputs.resize(_layers.size());
+		workspace._batchProjections.resize(_layers.size());
+	}
+	
+	for (size_t i = 0; i < _layers.size(); ++i)
+	{
+		// Grown only, the allocator does not take storage back and batch sizes vary from call to call
+		if (workspace._batchOutputs[i].numRows() < nsamples || workspace._batchOutputs[i].numColumns() != _layers[i].numOutputs())
+			workspace._batchOutputs[i].resize(std::max(nsamples, workspace._batchOutputs[i].numRows()), _layers[i].numOutputs(), MatrixInit::UNINITIALIZED);
+		
+		if (_layers[i].factorized() && (workspace._batchProjections[i].numRows() < nsamples || workspace._batchProjections[i].numColumns() != _layers[i].rank()))
+			workspace._batchProjections[i].resize(std::max(nsamples, workspace._batchProjections[i].numRows()), _layers[i].rank(), MatrixInit::UNINITIALIZED);
+	}
+	
+	if (workspace._columns.numRows() < columnsSize())
+		workspace._columns.resize(columnsSize(), 1, MatrixInit::UNINITIALIZED);
+}
+
+const nn::Matrix &NeuralNetwork::forward(const nn::Matrix &input, Workspace &workspace) const
+{
+	prepare(workspace);
+	
 	const nn::Matrix *payload = &input;
 	
-	for (auto &layer : _layers)
+	for (size_t i = 0; i < _layers.size(); ++i)
+	{
+		const Layer &layer = _layers[i];
+		nn::Matrix &output = workspace._outputs[i];
+		
+		// Feature maps are the rows of the output, one per channel
+		if (layer._type == LayerType::MAXPOOL)
+		{
+			nn::maxPool<float>(layer._shape, payload->ptr(), MatrixView<float>(output.ptr(), layer.numChannels(), layer._shape.outputSize()));
+			payload = &output;
+			continue;
+		}
+		
+		if (layer._type == LayerType::CONV2D)
+		{
+			MatrixView<float> maps(output.ptr(), layer.numChannels(), layer._shape.outputSize());
+			nn::convolve<float>(layer._shape, layer._weights, payload->ptr(), workspace._columns.ptr(), maps);
+			
+			// One bias per filter
+			nn::imap(maps, [&] (int ir, int, float v) { return v + layer._biases(ir, 0); });
+			layer.activate(output);
+			
+			payload = &output;
+			continue;
+		}
+		
+		if (layer._kernel != nullptr)
+		{
+			const float *x = payload->ptr();
+			if (layer.factorized())
+			{
+				layer._factorKernel(rowTable(layer._factor, workspace._rows), x, nullptr, workspace._projections[i].ptr());
+				x = workspace._projections[i].ptr();
+			}
+			
+			layer._kernel(rowTable(layer._weights, workspace._rows), x, layer._biases.ptr(), output.ptr());
+			layer.activate(output);
+			
+			payload = &output;
+			continue;
+		}
+		
+		// The product is computed block by block into the output, bias and activation in one pass over it.
+		// A factorized layer computes U (V x), rank * (nInputs + nOutputs) multiply-adds instead of nInputs * nOutputs.
+		if (layer.factorized())
+		{
+			nn::dot(layer._factor, *payload, workspace._projections[i]);
+			nn::dot(layer._weights, workspace._projections[i], output);
+		}
+		else
+			nn::dot(layer._weights, *payload, output);
+		
+		switch (layer._af)
+		{
+			case ActivationFunction::SIGMOID:
+				output = nn::sigmoid(output + layer._biases);
+				break;
+			
+			case ActivationFunction::SOFTMAX:
+			{
+				output = nn::exp(output + layer._biases);
+				nn::Matrix::value_type sum = nn::sum(output, 0.0f);
+				nn::map(output, [&] (nn::Matrix::value_type v) { return v / sum; });
+				break;
+			}
+			
+			default:
+				output = output + layer._biases;
+				layer.activate(output);
+				break;
+		};
+		
+		payload = &output;
+	}
+	
+	return *payload;
+}
+
+const nn::Matrix &NeuralNetwork::forwardBatch(const nn::Matrix &inputs, int nsamples, Workspace &workspace) const
+{
+	if (inputs.numColumns() != numInputs())
+		throw std::runtime_error("nn::NeuralNetwork - batch input size mismatch");
+	
+	if (nsamples > inputs.numRows())
+		throw std::runtime_error("nn::NeuralNetwork - batch larger than its inputs");
+	
+	prepareBatch(workspace, nsamples);
+	
+	const nn::Matrix *payload = &inputs;
+	
+	for (size_t i = 0; i < _layers.size(); ++i)
+	{
+		const Layer &layer = _layers[i];
+		nn::Matrix &outputs = workspace._batchOutputs[i];
+		
+		// Convolution and pooling sample by sample, an output row holds the feature maps of a sample
+		if (layer._type != LayerType::DENSE)
+		{
+			for (int s = 0; s < nsamples; ++s)
+			{
+				MatrixView<float> maps(&outputs(s, 0), layer.numChannels(), layer._shape.outputSize());
+				
+				if (layer._type == LayerType::MAXPOOL)
+					nn::maxPool<float>(layer._shape, &(*payload)(s, 0), maps);
+				else
+				{
+					nn::convolve<float>(layer._shape, layer._weights, &(*payload)(s, 0), workspace._columns.ptr(), maps);
+					nn::imap(maps, [&] (int ir, int, float v) { return v + layer._biases(ir, 0); });
+				}
+			}
+			
+			if (layer._type == LayerType::CONV2D)
+				layer.activateRows(outputs.rows(0, nsamples));
+			
+			payload = &outputs;
+			continue;
+		}
+		
+		if (layer.factorized())
+		{
+			batchProduct(layer._factor, *payload, nsamples, nullptr, workspace._batchProjections[i], workspace._rows);
+			payload = &workspace._batchProjections[i];
+		}
+		
+		batchProduct(layer._weights, *payload, nsamples, layer._biases.ptr(), outputs, workspace._rows);
+		layer.activateRows(outputs.rows(0, nsamples));
+		
+		payload = &outputs;
+	}
+	
+	return *payload;
+}
+
+int NeuralNetwork::columnsSize() const
+{
+	int size = 0;
+	for (const Layer &layer : _layers)
 	{
-		nn::dot(layer._weights, *payload, layer._output);
-		nn::add(layer._biases, layer._output, layer._output);
-		layer.activate();
-		payload = &layer._output;
+		if (layer._type == LayerType::CONV2D)
+			size = std::max(size, layer._shape.columnsSize());
 	}
+	return size;
 }
 
-nn::Matrix::value_type NeuralNetwork::compute_loss(const nn::Matrix &target)
+int NeuralNetwork::batchTileRows(int nrows, int ncolumns)
+{
+	// A tile is small enough to stay in L2 while every sample of the batch passes over it
+	const int TileBytes = 128 * 1024;
+	return std::min(nrows, std::max(4, (TileBytes / (ncolumns * (int)sizeof(float))) & ~3));
+}
+
+nn::Matrix::value_type NeuralNetwork::compute_loss(const nn::Matrix &output, const nn::Matrix &target) const
 {
 	switch (_lf)
 	{
 		case LossFunction::MEAN_SQUARE_ERROR:
-			return compute_loss_mean_square_error(target);
+			return compute_loss_mean_square_error(output, target);
 		
 		case LossFunction::SOFTMAX_CROSS_ENTROPY:
-			return compute_loss_softmax_cross_entropy(target);
+			return compute_loss_softmax_cross_entropy(output, target);
 		
 		default:
 			assert(false);
@@ -86,22 +560,18 @@ nn::Matrix::value_type NeuralNetwork::compute_loss(const nn::Matrix &target)
 	return 0.0;
 }
 
-nn::Matrix::value_type NeuralNetwork::compute_loss_mean_square_error(const nn::Matrix &target)
+nn::Matrix::value_type NeuralNetwork::compute_loss_mean_square_error(const nn::Matrix &output, const nn::Matrix &target) const
 {
-	nn::Matrix::value_type v = (nn::Matrix::value_type)0.0;
-	nn::map(_layers.back()._output, target, [&] (nn::Matrix::value_type a, nn::Matrix::value_type b) {
-		v += (a - b) * (a - b);
-	});
+	nn::Matrix::value_type v = nn::sum(nn::square(output - target));
 	v /= (target.numRows() * target.numColumns());
 	return v;
 }
 
-nn::Matrix::value_type NeuralNetwork::compute_loss_softmax_cross_entropy(const nn::Matrix &target)
+nn::Matrix::value_type NeuralNetwork::compute_loss_softmax_cross_entropy(const nn::Matrix &output, const nn::Matrix &target) const
 {
-	nn::Matrix::value_type v = (nn::Matrix::value_type)0.0;
-	nn::map(_layers.back()._output, target, [&] (nn::Matrix::value_type a, nn::Matrix::value_type b) {
-		v += a * std::log(b);
-	});
+	// -sum(target * log(output)), outputs are clamped since a saturated softmax gives log(0) = -inf
+	const nn::Matrix::value_type epsilon = (nn::Matrix::value_type)1e-7;
+	nn::Matrix::value_type v = nn::sum(nn::hadamard(target, nn::apply(output, [=] (nn::Matrix::value_type o) { return std::log(std::max(o, epsilon)); })));
 	return -v;
 }
 
@@ -121,37 +591,147 @@ void NeuralNetwork::back_propagation(const nn::Matrix &input, const nn::Matrix &
 
 void NeuralNetwork::mutate(double rate)
 {
-	// printf("NeuralNetwork::mutate(%f): ", rate);
-	int nmutations = 0, nvalues = 0;
+	mutateLayers(_layers, rate, _random_generator);
+}
+
+void NeuralNetwork::mutate(double rate, uint32_t seed)
+{
+	std::mt19937 random(seed);
+	mutateLayers(_layers, rate, random);
+}
+
+void NeuralNetwork::relocate()
+{
+	// The previous bias storage is not recycled by the allocator, relocation is meant to happen once
+	relocateWeights();
+	for (Layer &layer : _layers)
+	{
+		layer._biases = nn::Matrix(layer._biases);
+	}
 	
+	// Reallocated on the next feed_forward
+	_workspace._outputs.clear();
+}
+
+void NeuralNetwork::relocateWeights()
+{
 	for (Layer &layer : _layers)
 	{
-		nn::map(layer._weights, [&] (nn::Matrix::value_type v) {
-			float p = _zero_one_distribution(_random_generator);
-			if (p <= rate)
+		layer._weights.relocate();
+		layer._factor.relocate();
+	}
+}
+
+void NeuralNetwork::save(const std::string &path) const
+{
+	FILE *file = fopen(path.c_str(), "wb");
+	if (file == nullptr)
+		throw std::runtime_error("nn::NeuralNetwork - unable to write '" + path + "'");
+	
+	// Header: magic, version, inputs, loss function, number of layers
+	const uint32_t header[5] = { CheckpointMagic, CheckpointVersion, (uint32_t)numInputs(), (uint32_t)_lf, (uint32_t)_layers.size() };
+	writeValues(file, header, sizeof(header), path);
+	
+	// Every layer as the LayerInfo that builds it: type, units, activation, rank, kernel, stride, width, height
+	for (const Layer &layer : _layers)
+	{
+		int32_t info[8] = { (int32_t)layer._type, 0, (int32_t)layer._af, 0, 0, 1, 0, 0 };
+		if (layer._type == LayerType::DENSE)
+		{
+			info[1] = layer.numOutputs();
+			info[3] = layer.rank();
+		}
+		else
+		{
+			info[1] = (layer._type == LayerType::CONV2D) ? layer.numChannels() : 0;
+			info[4] = layer._shape._kernel;
+			info[5] = layer._shape._stride;
+			info[6] = layer._shape._width;
+			info[7] = layer._shape._height;
+		}
+		writeValues(file, info, sizeof(info), path);
+	}
+	
+	// Then the parameters layer by layer, W (or U), V and the biases
+	for (const Layer &layer : _layers)
+	{
+		for (const nn::BlockMatrix *m : { &layer._weights, &layer._factor })
+		{
+			for (int ib = 0; ib < m->numBlocks(); ++ib)
 			{
-				// v += 0.5f * _minus_one_one_distribution(_random_generator);
-				v = _minus_one_one_distribution(_random_generator);
-				nmutations += 1;
+				writeValues(file, m->row(m->blockFirstRow(ib)), (size_t)m->blockNumRows(ib) * m->numColumns() * sizeof(float), path);
 			}
-			return v;
-		});
-		nvalues += layer._weights.numRows() * layer._weights.numColumns();
+		}
+		writeValues(file, layer._biases.ptr(), (size_t)layer._biases.numRows() * layer._biases.numColumns() * sizeof(float), path);
+	}
+	
+	if (fclose(file) != 0)
+		throw std::runtime_error("nn::NeuralNetwork - unable to write '" + path + "'");
+}
+
+NeuralNetwork NeuralNetwork::load(const std::string &path)
+{
+	FILE *file = fopen(path.c_str(), "rb");
+	if (file == nullptr)
+		throw std::runtime_error("nn::NeuralNetwork - unable to open '" + path + "'");
+	
+	uint32_t header[5];
+	readValues(file, header, sizeof(header), path);
+	if (header[0] != CheckpointMagic || header[1] != CheckpointVersion || header[4] == 0 || header[4] > 1024)
+	{
+		fclose(file);
+		throw std::runtime_error("nn::NeuralNetwork - '" + path + "' is not a checkpoint");
+	}
+	
+	std::vector<LayerInfo> layers(header[4], LayerInfo{ 0, ActivationFunction::SIGMOID });
+	for (LayerInfo &info : layers)
+	{
+		int32_t fields[8];
+		readValues(file, fields, sizeof(fields), path);
+		
+		info.type = (LayerType)fields[0];
+		info.units = fields[1];
+		info.af = (ActivationFunction)fields[2];
+		info.rank = fields[3];
+		info.kernel = fields[4];
+		info.stride = fields[5];
+		info.width = fields[6];
+		info.height = fields[7];
 		
-		nn::map(layer._biases, [&] (nn::Matrix::value_type v) {
-			float p = _zero_one_distribution(_random_generator);
-			if (p <= rate)
+		if (fields[0] < 0 || fields[0] > (int32_t)LayerType::MAXPOOL || fields[2] < 0 || fields[2] > (int32_t)ActivationFunction::SOFTMAX || 
+			(info.type != LayerType::MAXPOOL && info.units <= 0))
+		{
+			fclose(file);
+			throw std::runtime_error("nn::NeuralNetwork - '" + path + "' is not a checkpoint");
+		}
+	}
+	
+	// The seed only saves the shared generator, every parameter is overwritten
+	std::unique_ptr<NeuralNetwork> network;
+	try
+	{
+		network.reset(new NeuralNetwork((int)header[2], layers, (LossFunction)header[3], 0u));
+	}
+	catch (...)
+	{
+		fclose(file);
+		throw;
+	}
+	
+	for (Layer &layer : network->_layers)
+	{
+		for (nn::BlockMatrix *m : { &layer._weights, &layer._factor })
+		{
+			for (int ib = 0; ib < m->numBlocks(); ++ib)
 			{
-				// v += 0.5f * _minus_one_one_distribution(_random_generator);
-				v = _minus_one_one_distribution(_random_generator);
-				nmutations += 1;
+				readValues(file, &m->mutableBlock(ib)(0, 0), (size_t)m->blockNumRows(ib) * m->numColumns() * sizeof(float), path);
 			}
-			return v;
-		});
-		nvalues += layer._biases.numRows() * layer._biases.numColumns();
+		}
+		readValues(file, layer._biases.ptr(), (size_t)layer._biases.numRows() * layer._biases.numColumns() * sizeof(float), path);
 	}
 	
-	// printf("%d / %d (%f)\n", nmutations, nvalues, (double)nmutations / (double)nvalues);
+	fclose(file);
+	return *network;
 }
 
 }; // namespace nn
@@ -2,8 +2,13 @@
 #define __NN_NEURAL_NETWORK_H__
 
 #include "Matrix.h"
+#include "BlockMatrix.h"
+#include "Convolution.h"
+#include "Jit.h"
 #include <initializer_list>
 #include <vector>
+#include <string>
+#include <cstdint>
 
 namespace nn
 {
@@ -14,6 +19,14 @@ enum class ActivationFunction
 	SOFTMAX
 };
 
+// Convolution and pooling layers take and produce images stored channel by channel (CHW), flattened to a column
+enum class LayerType
+{
+	DENSE, 
+	CONV2D, 
+	MAXPOOL
+};
+
 enum class LossFunction
 {
 	MEAN_SQUARE_ERROR, 
@@ -29,57 +42,217 @@ public:
 		nn::Matrix _target;
 	};
 	
+	// Copies of a network share the weight blocks until either copy writes them, see BlockMatrix.
+	// A factorized layer stores W = U V with U (nOutputs x rank) in _weights and V (rank x nInputs) in _factor.
+	// A convolution stores one filter per row of _weights and one bias per filter, a pooling layer has no parameters.
 	struct Layer
 	{
-		nn::Matrix _weights;
+		LayerType _type;
+		nn::BlockMatrix _weights;
+		nn::BlockMatrix _factor;
 		nn::Matrix _biases;
-		nn::Matrix _output;
 		ActivationFunction _af;
 		
-		Layer(int nInputs, int nOutputs, ActivationFunction af);
+		// Input geometry of convolution and pooling layers
+		ConvolutionShape _shape;
+		
+		// Generated for the shape of a dense layer, bias included, nullptr when the generic path is used, see Jit.
+		// _factorKernel computes V x of the factorized layers.
+		GemvKernel _kernel = nullptr;
+		GemvKernel _factorKernel = nullptr;
+		
+		Layer(int nInputs, int nOutputs, ActivationFunction af, int rank = 0);
+		
+		// Convolution with the given number of filters, or pooling (filters is ignored)
+		Layer(LayerType type, const ConvolutionShape &shape, int filters, ActivationFunction af);
+		
+		bool factorized() const { return _factor.numRows() > 0; }
+		int rank() const { return _factor.numRows(); }
+		int numInputs() const;
+		int numOutputs() const;
+		
+		// Output channels of convolution and pooling layers
+		int numChannels() const { return (_type == LayerType::CONV2D) ? _weights.numRows() : _shape._channels; }
 		
-		void activate();
-		void activation_sigmoid();
-		void activation_softmax();
+		void activate(nn::Matrix &output) const;
+		
+		// Outputs of a batch, one sample per row
+		void activateRows(MatrixView<float> outputs) const;
+		static void activation_sigmoid(nn::Matrix &output);
+		static void activation_sigmoid(MatrixView<float> output);
+		static void activation_softmax(nn::Matrix &output);
 	};
 	
-	struct LayerInfo
+	// Activations of one evaluation, reused from call to call. The network itself is not written by forward(),
+	// so threads evaluate the same network concurrently as long as each one has its own workspace.
+	class Workspace
 	{
-		int units;
-		ActivationFunction af;
+	public:
+		Workspace()
+		{
+		}
+		
+		// Scratch content, not copied along with a network
+		Workspace(const Workspace &)
+		{
+		}
+		
+		Workspace &operator = (const Workspace &)
+		{
+			return *this;
+		}
+		
+		const nn::Matrix &output() const { return _outputs.back(); }
+		
+	protected:
+		friend class NeuralNetwork;
+		
+		// One per layer, allocated by the thread that first uses the workspace
+		std::vector<nn::Matrix> _outputs;
+		
+		// V x of the factorized layers, empty for the dense ones
+		std::vector<nn::Matrix> _projections;
+		
+		// Unfolded input of the convolutions taking the im2col path, one column sized for the largest of them
+		nn::Matrix _columns;
+		
+		// Row pointers passed to the generated kernels
+		std::vector<const float *> _rows;
+		
+		// Outputs and V x of every layer for a batch, one sample per row, see forwardBatch(). They only grow, a smaller
+		// batch uses their first rows.
+		std::vector<nn::Matrix> _batchOutputs;
+		std::vector<nn::Matrix> _batchProjections;
 	};
 	
-	NeuralNetwork(int nInputs, std::initializer_list<LayerInfo> layers, LossFunction lf)
+	// Dense layers are listed as { units, af }, convolution and pooling layers through conv2d() and maxPool()
+	struct LayerInfo
 	{
-		for (std::initializer_list<LayerInfo>::iterator it = layers.begin(); it != layers.end(); ++it)
+		int units;
+		ActivationFunction af;
+		
+		// Factorized layer of the given rank when non-zero, e.g. { 784, SIGMOID, 64 }
+		int rank = 0;
+		
+		LayerType type = LayerType::DENSE;
+		int kernel = 0;
+		int stride = 1;
+		
+		// Input image size, only needed when the previous layer is not a convolution or pooling one. The channels follow from the input size.
+		int width = 0;
+		int height = 0;
+		
+		// units is the number of filters
+		static LayerInfo conv2d(int filters, int kernel, ActivationFunction af, int width = 0, int height = 0)
 		{
-			_layers.push_back(Layer(nInputs, it->units, it->af));
-			nInputs = it->units;
+			LayerInfo info = { filters, af };
+			info.type = LayerType::CONV2D;
+			info.kernel = kernel;
+			info.width = width;
+			info.height = height;
+			return info;
 		}
 		
-		_lf = lf;
-		
+		// Non-overlapping size x size windows
+		static LayerInfo maxPool(int size, int width = 0, int height = 0)
+		{
+			LayerInfo info = { 0, ActivationFunction::SIGMOID };
+			info.type = LayerType::MAXPOOL;
+			info.kernel = size;
+			info.stride = size;
+			info.width = width;
+			info.height = height;
+			return info;
+		}
+	};
+	
+	NeuralNetwork(int nInputs, std::initializer_list<LayerInfo> layers, LossFunction lf) : NeuralNetwork(nInputs, std::vector<LayerInfo>(layers), lf)
+	{
+	}
+	
+	NeuralNetwork(int nInputs, const std::vector<LayerInfo> &layers, LossFunction lf)
+	{
+		init(nInputs, layers, lf);
 		randomize();
 	}
 	
+	// Seeded weights, does not touch the shared generator so networks can be built from any thread
+	NeuralNetwork(int nInputs, const std::vector<LayerInfo> &layers, LossFunction lf, uint32_t seed)
+	{
+		init(nInputs, layers, lf);
+		randomize(seed);
+	}
+	
 	using LayerList = std::vector<Layer>;
 	const LayerList &layers() const { return _layers; }
 	
+	int numInputs() const { return _layers.front().numInputs(); }
+	int numOutputs() const { return _layers.back().numOutputs(); }
+	
+	// Elements of the im2col scratch shared by the convolutions, see ConvolutionShape::columnsSize()
+	int columnsSize() const;
+	
 	void randomize();
 	
-	void feed_forward(const nn::Matrix &input);
+	// Same weights for the same seed on every platform, see Genome
+	void randomize(uint32_t seed);
+	
+	// Output of the last layer, stored in the workspace
+	const nn::Matrix &forward(const nn::Matrix &input, Workspace &workspace) const;
+	
+	// Outputs of the last layer for a batch of inputs, one sample per row of inputs and of the result. The weights of the
+	// dense layers are taken a tile of rows at a time for the whole batch, so they are read from memory once per batch
+	// rather than once per sample.
+	const nn::Matrix &forwardBatch(const nn::Matrix &inputs, Workspace &workspace) const { return forwardBatch(inputs, inputs.numRows(), workspace); }
+	
+	// Same for the first nsamples rows of inputs, the outputs are the first nsamples rows of the result. Callers with
+	// batches of varying size keep one input matrix for the largest, the workspace is not resized either.
+	const nn::Matrix &forwardBatch(const nn::Matrix &inputs, int nsamples, Workspace &workspace) const;
+	
+	// Rows of the tiles forwardBatch() takes from a dense matrix of that shape, the last tile holds nrows % tileRows
+	// rows when the division is not exact. Autotuner times the tile shapes along with the whole layer ones.
+	static int batchTileRows(int nrows, int ncolumns);
+	
+	nn::Matrix::value_type compute_loss(const nn::Matrix &output, const nn::Matrix &target) const;
+	nn::Matrix::value_type compute_loss_mean_square_error(const nn::Matrix &output, const nn::Matrix &target) const;
+	nn::Matrix::value_type compute_loss_softmax_cross_entropy(const nn::Matrix &output, const nn::Matrix &target) const;
 	
-	nn::Matrix::value_type compute_loss(const nn::Matrix &target);
-	nn::Matrix::value_type compute_loss_mean_square_error(const nn::Matrix &target);
-	nn::Matrix::value_type compute_loss_softmax_cross_entropy(const nn::Matrix &target);
+	// Single threaded shorthands over a workspace owned by the network
+	void feed_forward(const nn::Matrix &input) { forward(input, _workspace); }
+	nn::Matrix::value_type compute_loss(const nn::Matrix &target) const { return compute_loss(_workspace.output(), target); }
 	
 	void back_propagation(const nn::Matrix &input, const nn::Matrix &target);
 	
 	void mutate(double rate);
+	void mutate(double rate, uint32_t seed);
+	
+	// Copies the matrices into storage from the allocator arena of the calling thread, see MatrixMemoryAllocator::setThreadNode().
+	// Weight blocks already in that arena are left as they are, shared or not.
+	void relocate();
+	
+	// Same for the weight blocks only, the cheap part to repeat: blocks are recycled, other matrices are not
+	void relocateWeights();
+	
+	// Layers, loss function and parameters in a binary file, floats in the byte order of the machine. Throw on I/O errors
+	// and on files that are not checkpoints.
+	void save(const std::string &path) const;
+	static NeuralNetwork load(const std::string &path);
 	
 protected:
+	// Updates the parameters in place, see EvolutionStrategy
+	friend class EvolutionStrategy;
+	
+	// Throws when the geometry of a convolution or pooling layer does not match its input
+	void init(int nInputs, const std::vector<LayerInfo> &layers, LossFunction lf);
+	
+	// Sizes the outputs of a workspace for this network, for one sample or for at least nsamples samples
+	void prepare(Workspace &workspace) const;
+	void prepareBatch(Workspace &workspace, int nsamples) const;
+	
 	LayerList _layers;
 	LossFunction _lf;
+	
+	Workspace _workspace;
 };
 
 }; // namespace nn
@@ -1,105 +1,586 @@
 #include "Population.h"
+#include "Topology.h"
 #include <atomic>
+#include <memory>
+#include <future>
 #include <thread>
 #include <string>
-#include <random>
 #include <algorithm>
+#include <cmath>
+#include <unordered_set>
 
 namespace nn
 {
 
 namespace
 {
-	struct TaskRunner
+	// Tasks over the subjects _subjects of one node on the samples [_firstSample, _lastSample) of the draw.
+	// Task t is batch t / nSubjects of subject _subjects[t % nSubjects], so consecutive tasks belong to different subjects.
+	struct TaskGrid
+	{
+		const std::vector<const Population::Sample *> *_samples;
+		const std::vector<uint32_t> *_indices;
+		const Population *_owner;
+		const Population::SubjectList *_population;
+		std::vector<int> _subjects;
+		int _firstSample;
+		int _lastSample;
+		int _batchSize;
+		int _nBatches;
+		
+		std::atomic<int> _itask;
+		
+		int size() const { return (int)_subjects.size() * _nBatches; }
+	};
+	
+	// Sum of the losses and of the squared losses of one (subject, batch) task
+	struct TaskScore
 	{
-		struct Task
+		int _subject;
+		int _batch;
+		double _score;
+		double _squares;
+	};
+	
+	// Scores of the tasks run by one worker, written by that worker only. The entries are kept off the
+	// first and last cache line of the storage, so buffers of different workers never share a line.
+	class PartialScores
+	{
+	public:
+		static const int Padding = (64 + sizeof(TaskScore) - 1) / sizeof(TaskScore);
+		
+		// Capacity for the expected share of a round plus some slack, the buffer only grows. A worker running
+		// more tasks than expected grows it in add(), reserving the whole round per worker would cost
+		// workers times tasks entries.
+		void reset(int nExpected)
+		{
+			size_t capacity = (size_t)nExpected + nExpected / 4 + 2 * Padding + 64;
+			if (_storage.size() < capacity)
+				_storage.resize(capacity);
+			_count = 0;
+		}
+		
+		void add(int subject, int batch, double score, double squares)
 		{
-			const Population::Sample *_sample;
-			Population::Subject *_subject;
-		};
+			if ((size_t)(_count + 2 * Padding) >= _storage.size())
+				_storage.resize(2 * _storage.size());
+			
+			TaskScore &entry = _storage[Padding + _count++];
+			entry._subject = subject;
+			entry._batch = batch;
+			entry._score = score;
+			entry._squares = squares;
+		}
+		
+		const TaskScore *begin() const { return _storage.data() + Padding; }
+		const TaskScore *end() const { return begin() + _count; }
 		
+	protected:
+		std::vector<TaskScore> _storage;
+		int _count = 0;
+	};
+	
+	struct TaskRunner
+	{
 		TaskRunner()
 		{
-			_itask = nullptr;
-			_tasks = nullptr;
+			_grids = nullptr;
+			_nGrids = 0;
+			_home = 0;
+			_node = -1;
 		}
 		
-		void set(std::atomic<int> *itask, std::vector<Task> *tasks, int nRows, int nColumns)
+		void set(TaskGrid *grids, int nGrids, int home, int node, int nExpectedTasks, int nRows, int nColumns)
 		{
-			_itask = itask;
-			_tasks = tasks;
+			_grids = grids;
+			_nGrids = nGrids;
+			_home = home;
+			_node = node;
+			_scores.reset(nExpectedTasks);
 			_error.resize(nRows, nColumns);
 		}
 		
 		void run()
 		{
+			MatrixMemoryAllocator::setThreadNode(_node);
+			
+			// Subjects of the own node first, then the remaining tasks of the other nodes
+			for (int i = 0; i < _nGrids; ++i)
+			{
+				drain(_grids[(_home + i) % _nGrids]);
+			}
+		}
+		
+		void drain(TaskGrid &grid)
+		{
+			int nTasks = grid.size();
+			int nSubjects = (int)grid._subjects.size();
+			
 			while (true)
 			{
-				int nexttask = _itask->fetch_add(1);
-				if (nexttask >= (int)_tasks->size())
+				int nexttask = grid._itask.fetch_add(1);
+				if (nexttask >= nTasks)
 					break;
 				
-				Task &task = (*_tasks)[nexttask];
-				const Population::Sample *sample = task._sample;
-				Population::Subject *subject = task._subject;
+				int isubject = grid._subjects[nexttask % nSubjects];
+				int ibatch = nexttask / nSubjects;
 				
-				subject->_brain.feed_forward(sample->_input);
-				subject->_score += subject->_brain.compute_loss(sample->_target);
+				int first = grid._firstSample + ibatch * grid._batchSize;
+				int last = std::min(first + grid._batchSize, grid._lastSample);
+				
+				// The network is only read, activations go to the workspace of this worker
+				const Population::Subject *subject = (*grid._population)[isubject];
+				const NeuralNetwork &brain = grid._owner->brain(*subject, _scratch);
+				
+				double score = 0.0;
+				double squares = 0.0;
+				for (int i = first; i < last; ++i)
+				{
+					const Population::Sample *sample = (*grid._samples)[(*grid._indices)[i]];
+					
+					const nn::Matrix &output = brain.forward(sample->_input, _workspace);
+					double loss = brain.compute_loss(output, sample->_target);
+					score += loss;
+					squares += loss * loss;
+				}
+				
+				_scores.add(isubject, ibatch, score, squares);
 			}
 		}
 		
-		std::atomic<int> *_itask;
-		std::vector<Task> *_tasks;
+		TaskGrid *_grids;
+		int _nGrids;
+		int _home;
+		int _node;
 		nn::Matrix _error;
+		NeuralNetwork::Workspace _workspace;
+		Population::BrainScratch _scratch;
+		PartialScores _scores;
 		
 		std::thread _thread;
 	};
 	
-	std::vector<TaskRunner::Task> _tasks;
 	std::vector<TaskRunner> _task_runners;
 };
 
-void Population::feed_forward(const std::vector<const Sample *> &samples)
+// Worker i runs on _cpus[i % _cpus.size()], the subjects [_firstSubjects[k], _firstSubjects[k + 1]) are evaluated
+// by the workers of _nodes[k] first. A single pseudo node -1 holds every subject when placement is not NUMA aware.
+struct Population::Placement
+{
+	std::vector<int> _cpus;
+	std::vector<int> _nodes;
+	std::vector<int> _firstSubjects;
+	int _nWorkers;
+	bool _numa;
+	bool _pin;
+	bool _restrict;
+};
+
+Population::Population(int n, int nInputs, const std::vector<LayerInfo> &layers, LossFunction lf, Encoding encoding) : _layerInfos(layers)
 {
-	_tasks.resize(samples.size() * _subjects.size());
+	_nInputs = nInputs;
+	_lf = lf;
+	_encoding = encoding;
 	
-	std::default_random_engine _random_generator;
-	std::uniform_int_distribution<int> _distribution(0, samples.size() - 1);
+	_subjects.resize(n);
 	
-	for (int isubject = 0, k = 0; isubject < _subjects.size(); ++isubject)
+	for (Subject *&subject : _subjects)
 	{
-		for (int isample = 0; isample < samples.size(); ++isample, ++k)
+		Genome genome;
+		genome._seed = _mutationRandom();
+		
+		subject = new Subject(genome);
+		if (_encoding == Encoding::FULL)
 		{
-			_tasks[k]._sample = samples[_distribution(_random_generator)];
-			_tasks[k]._subject = _subjects[isubject];
+			subject->_brain.reset(new NeuralNetwork(_nInputs, _layerInfos, _lf, genome._seed));
+			genome.advance(*subject->_brain, 0);
 		}
 	}
+}
+
+const NeuralNetwork &Population::brain(const Subject &subject, BrainScratch &scratch) const
+{
+	if (subject._brain)
+		return *subject._brain;
+	
+	const Genome &genome = subject._genome;
 	
-	for (Subject *subject : _subjects)
+	// The scratch holds a prefix of the chain after the previous call for this subject, or for its parent
+	const bool extendsScratch = scratch._network && genome.extends(scratch._genome);
+	if (extendsScratch && scratch._genome._mutations.size() == genome._mutations.size())
+		return *scratch._network;
+	
+	const Elite *elite = findElite(genome);
+	if (extendsScratch && (elite == nullptr || elite->_genome._mutations.size() <= scratch._genome._mutations.size()))
+	{
+		genome.advance(*scratch._network, scratch._genome._mutations.size());
+	}
+	else
 	{
-		subject->_score = 0.0;
+		if (! scratch._network)
+			scratch._network.reset(new NeuralNetwork(_nInputs, _layerInfos, _lf, genome._seed));
+		
+		if (elite != nullptr)
+		{
+			*scratch._network = *elite->_network;
+			genome.advance(*scratch._network, elite->_genome._mutations.size());
+		}
+		else
+		{
+			genome.materialize(*scratch._network);
+		}
 	}
 	
-	int n = std::thread::hardware_concurrency();
-	_task_runners.reserve(n);
+	scratch._genome = genome;
+	return *scratch._network;
+}
+
+const Population::Elite *Population::findElite(const Genome &genome) const
+{
+	const Elite *best = nullptr;
+	for (const Elite &elite : _elites)
+	{
+		if (genome.extends(elite._genome) && (best == nullptr || elite._genome._mutations.size() > best->_genome._mutations.size()))
+			best = &elite;
+	}
+	return best;
+}
+
+void Population::updateElites()
+{
+	int n = std::min(_eliteCacheSize, (int)_subjects.size());
 	
-	std::atomic<int> itask(0);
+	std::vector<int> order(_subjects.size());
+	for (size_t i = 0; i < order.size(); ++i)
+	{
+		order[i] = (int)i;
+	}
+	std::partial_sort(order.begin(), order.begin() + n, order.end(), [&] (int a, int b) {
+		return ranksBefore(*_subjects[a], *_subjects[b]) || (! ranksBefore(*_subjects[b], *_subjects[a]) && a < b);
+	});
 	
+	// New elites start from the previous ones when they descend from them. The networks of the previous elites are
+	// reused, a network is only built when there are more elites than before: the allocator does not take storage back.
+	std::vector<int> sources(n);
+	std::vector<int> uses(_elites.size(), 0);
 	for (int i = 0; i < n; ++i)
 	{
-		_task_runners[i].set(&itask, &_tasks, samples.front()->_target.numRows(), samples.front()->_target.numColumns());
-		_task_runners[i]._thread = std::thread(&TaskRunner::run, std::ref(_task_runners[i]));
+		const Elite *elite = findElite(_subjects[order[i]]->_genome);
+		sources[i] = (elite != nullptr) ? (int)(elite - _elites.data()) : -1;
+		if (sources[i] >= 0)
+			++uses[sources[i]];
+	}
+	
+	// Networks no new elite starts from
+	std::vector<std::unique_ptr<NeuralNetwork>> spares;
+	for (size_t k = 0; k < _elites.size(); ++k)
+	{
+		if (uses[k] == 0)
+			spares.push_back(std::move(_elites[k]._network));
 	}
 	
+	std::vector<Elite> elites(n);
 	for (int i = 0; i < n; ++i)
+	{
+		const Genome &genome = _subjects[order[i]]->_genome;
+		std::unique_ptr<NeuralNetwork> &network = elites[i]._network;
+		
+		elites[i]._genome = genome;
+		
+		std::unique_ptr<NeuralNetwork> spare;
+		if (! spares.empty() && (sources[i] < 0 || uses[sources[i]] > 1))
+		{
+			spare = std::move(spares.back());
+			spares.pop_back();
+		}
+		
+		if (sources[i] >= 0)
+		{
+			// The last new elite starting from a network takes it over, the others copy it
+			const Elite &source = _elites[sources[i]];
+			if (--uses[sources[i]] == 0)
+				network = std::move(_elites[sources[i]]._network);
+			else if (spare)
+			{
+				network = std::move(spare);
+				*network = *source._network;
+			}
+			else
+				network.reset(new NeuralNetwork(*source._network));
+			
+			genome.advance(*network, source._genome._mutations.size());
+		}
+		else if (spare)
+		{
+			network = std::move(spare);
+			genome.materialize(*network);
+		}
+		else
+		{
+			// Randomized from the seed of the genome, only the mutations remain
+			network.reset(new NeuralNetwork(_nInputs, _layerInfos, _lf, genome._seed));
+			genome.advance(*network, 0);
+		}
+	}
+	
+	_elites = std::move(elites);
+}
+
+void Population::place(const std::vector<int> &nodes, const std::vector<int> &firstSubjects)
+{
+	std::vector<int> subjectNodes(_subjects.size(), -1);
+	for (size_t i = 0; i < nodes.size(); ++i)
+	{
+		std::fill(subjectNodes.begin() + firstSubjects[i], subjectNodes.begin() + firstSubjects[i + 1], nodes[i]);
+	}
+	
+	if (subjectNodes == _subjectNodes && _childrenPlaced)
+		return;
+	
+	// One thread per node, restricted to the CPUs of the node before it starts: matrices come from the
+	// node arena and are first touched on the node
+	const Topology &topology = Topology::instance();
+	for (size_t k = 0; k < nodes.size(); ++k)
+	{
+		std::promise<void> restricted;
+		std::future<void> started = restricted.get_future();
+		
+		std::thread thread([&] {
+			started.wait();
+			MatrixMemoryAllocator::setThreadNode(nodes[k]);
+			
+			for (int i = firstSubjects[k]; i < firstSubjects[k + 1]; ++i)
+			{
+				// Seed chain subjects have no network, workers rebuild them in their own arena
+				if (! _subjects[i]->_brain)
+					continue;
+				
+				// Only blocks a child shares with a parent of another node move, the others are already here
+				if (i < (int)_subjectNodes.size() && _subjectNodes[i] == subjectNodes[i])
+					_subjects[i]->_brain->relocateWeights();
+				else
+					_subjects[i]->_brain->relocate();
+			}
+		});
+		
+		if (nodes[k] >= 0)
+			Topology::restrictThread(thread, topology.nodeCpus(nodes[k]));
+		restricted.set_value();
+		thread.join();
+	}
+	
+	_subjectNodes = subjectNodes;
+	_childrenPlaced = true;
+}
+
+void Population::evaluate(const std::vector<const Sample *> &samples, const Placement &placement, int firstSample, int lastSample)
+{
+	const Topology &topology = Topology::instance();
+	
+	int nGrids = (int)placement._nodes.size();
+	int roundSize = lastSample - firstSample;
+	int batchSize = (_batchSize > 0) ? std::min(_batchSize, roundSize) : roundSize;
+	
+	// Seed chain subjects are rebuilt by every task, in the scratch of the worker running it. They are only split into
+	// as many batches as it takes to give every worker a task.
+	if (_encoding == Encoding::SEED_CHAIN)
+	{
+		int nSplits = (placement._nWorkers + (int)_active.size() - 1) / (int)_active.size();
+		batchSize = std::max(batchSize, (roundSize + nSplits - 1) / nSplits);
+	}
+	
+	int nBatches = (roundSize + batchSize - 1) / batchSize;
+	int nTasks = (int)_active.size() * nBatches;
+	
+	std::unique_ptr<TaskGrid[]> grids(new TaskGrid[nGrids]);
+	for (int i = 0; i < nGrids; ++i)
+	{
+		TaskGrid &grid = grids[i];
+		grid._samples = &samples;
+		grid._indices = &_indices;
+		grid._owner = this;
+		grid._population = &_subjects;
+		grid._firstSample = firstSample;
+		grid._lastSample = lastSample;
+		grid._batchSize = batchSize;
+		grid._nBatches = nBatches;
+		grid._itask = 0;
+		
+		for (int isubject : _active)
+		{
+			if (isubject >= placement._firstSubjects[i] && isubject < placement._firstSubjects[i + 1])
+				grid._subjects.push_back(isubject);
+		}
+	}
+	
+	for (int i = 0; i < placement._nWorkers; ++i)
+	{
+		int cpu = placement._cpus[i % placement._cpus.size()];
+		int node = placement._numa ? topology.cpuNode(cpu) : -1;
+		int home = (int)(std::find(placement._nodes.begin(), placement._nodes.end(), node) - placement._nodes.begin());
+		
+		_task_runners[i].set(grids.get(), nGrids, home, node, nTasks / placement._nWorkers, samples.front()->_target.numRows(), samples.front()->_target.numColumns());
+		_task_runners[i]._thread = std::thread(&TaskRunner::run, std::ref(_task_runners[i]));
+		
+		if (placement._pin)
+			Topology::pinThread(_task_runners[i]._thread, cpu);
+		else if (placement._restrict)
+			Topology::restrictThread(_task_runners[i]._thread, placement._cpus);
+	}
+	
+	for (int i = 0; i < placement._nWorkers; ++i)
 	{
 		_task_runners[i]._thread.join();
 	}
 	
-	for (Subject *subject : _subjects)
+	// Batch scores are summed in batch order, so scores do not depend on which worker ran a task, nor on the number of
+	// workers but through the batch size of seed chain rounds
+	_batchScores.resize((size_t)_subjects.size() * nBatches);
+	_batchSquares.resize((size_t)_subjects.size() * nBatches);
+	for (int i = 0; i < placement._nWorkers; ++i)
+	{
+		for (const TaskScore &entry : _task_runners[i]._scores)
+		{
+			_batchScores[(size_t)entry._subject * nBatches + entry._batch] = entry._score;
+			_batchSquares[(size_t)entry._subject * nBatches + entry._batch] = entry._squares;
+		}
+	}
+	
+	for (int isubject : _active)
+	{
+		for (int ibatch = 0; ibatch < nBatches; ++ibatch)
+		{
+			_sums[isubject] += _batchScores[(size_t)isubject * nBatches + ibatch];
+			_squares[isubject] += _batchSquares[(size_t)isubject * nBatches + ibatch];
+		}
+		_subjects[isubject]->_samples += roundSize;
+	}
+}
+
+void Population::feed_forward(const std::vector<const Sample *> &samples)
+{
+	if (samples.empty() || _subjects.empty())
+		return;
+	
+	// One permutation per generation shared by every subject
+	size_t nDraw = (_samplesPerGeneration > 0) ? (size_t)_samplesPerGeneration : samples.size();
+	_sampler.draw(samples.size(), nDraw, _indices);
+	
+	// CPUs are ordered node by node
+	const Topology &topology = Topology::instance();
+	
+	Placement placement;
+	placement._cpus = topology.selectCpus(_scheduler);
+	placement._nWorkers = (_scheduler._threads > 0) ? _scheduler._threads : (int)placement._cpus.size();
+	if (_task_runners.size() < (size_t)placement._nWorkers)
+		_task_runners.resize(placement._nWorkers);
+	
+	// With a NUMA aware allocator, workers are pinned and every node evaluates a range of subjects
+	// proportional to its number of workers, with the subjects stored on the node
+	placement._numa = MatrixMemoryAllocator::instance()->numaAware();
+	placement._pin = _scheduler._pin || placement._numa;
+	
+	// Unpinned workers still stay within the selected CPUs when they are not all the process may use
+	placement._restrict = ! placement._pin && placement._cpus.size() != topology.allowedCpus().size();
+	
+	std::vector<int> nodeWorkers;
+	if (placement._numa)
+	{
+		for (int i = 0; i < placement._nWorkers; ++i)
+		{
+			int node = topology.cpuNode(placement._cpus[i % placement._cpus.size()]);
+			size_t k = std::find(placement._nodes.begin(), placement._nodes.end(), node) - placement._nodes.begin();
+			if (k == placement._nodes.size())
+			{
+				placement._nodes.push_back(node);
+				nodeWorkers.push_back(0);
+			}
+			++nodeWorkers[k];
+		}
+	}
+	else
+	{
+		placement._nodes.push_back(-1);
+		nodeWorkers.push_back(placement._nWorkers);
+	}
+	
+	int nGrids = (int)placement._nodes.size();
+	placement._firstSubjects.assign(nGrids + 1, 0);
+	for (int i = 0, workers = 0; i < nGrids; ++i)
+	{
+		workers += nodeWorkers[i];
+		placement._firstSubjects[i + 1] = (int)((int64_t)_subjects.size() * workers / placement._nWorkers);
+	}
+	
+	if (placement._numa)
+		place(placement._nodes, placement._firstSubjects);
+	
+	_active.resize(_subjects.size());
+	for (size_t i = 0; i < _subjects.size(); ++i)
+	{
+		_active[i] = (int)i;
+		_subjects[i]->_samples = 0;
+	}
+	_sums.assign(_subjects.size(), 0.0);
+	_squares.assign(_subjects.size(), 0.0);
+	_racingRounds.clear();
+	
+	// Rounds double in size, the last one ends with the draw
+	int firstSample = 0;
+	int roundSize = (_racing._initialSamples > 0) ? std::min(_racing._initialSamples, (int)nDraw) : (int)nDraw;
+	while (true)
+	{
+		int lastSample = std::min(firstSample + roundSize, (int)nDraw);
+		evaluate(samples, placement, firstSample, lastSample);
+		
+		RacingRound round;
+		round._firstSample = firstSample;
+		round._samples = lastSample - firstSample;
+		round._subjects = (int)_active.size();
+		round._survivors = (int)_active.size();
+		round._cutoff = 0.0;
+		
+		if (lastSample < (int)nDraw)
+		{
+			// Survivors have all seen the same samples, so sums rank them like means. Ties go to the lower index.
+			std::stable_sort(_active.begin(), _active.end(), [&] (int a, int b) { return _sums[a] < _sums[b]; });
+			
+			int nSurvivors = (int)std::ceil(_active.size() * (1.0 - _racing._dropFraction));
+			nSurvivors = std::max(nSurvivors, std::max(_racing._minSurvivors, 1));
+			nSurvivors = std::min(nSurvivors, (int)_active.size());
+			
+			_active.resize(nSurvivors);
+			std::sort(_active.begin(), _active.end());
+			
+			round._survivors = nSurvivors;
+		}
+		
+		for (int isubject : _active)
+		{
+			round._cutoff = std::max(round._cutoff, _sums[isubject] / _subjects[isubject]->_samples);
+		}
+		_racingRounds.push_back(round);
+		
+		if (lastSample == (int)nDraw)
+			break;
+		
+		firstSample = lastSample;
+		roundSize *= 2;
+	}
+	
+	for (size_t i = 0; i < _subjects.size(); ++i)
 	{
-		subject->_score /= (double)samples.size();
+		Subject *subject = _subjects[i];
+		double n = (double)subject->_samples;
+		double mean = _sums[i] / n;
+		double variance = std::max(_squares[i] / n - mean * mean, 0.0);
+		
+		subject->_score = mean;
+		subject->_scoreError = std::sqrt(variance / n);
 	}
+	
+	if (_encoding == Encoding::SEED_CHAIN)
+		updateElites();
 }
 
 Population::Statistics Population::computePopulationStatistics() const
@@ -117,6 +598,29 @@ Population::Statistics Population::computePopulationStatistics() const
 	
 	Population::Statistics s;
 	s._score = sum;
+	
+	std::unordered_set<const void *> blocks;
+	s._weightBlocks = 0;
+	for (const Subject *subject : _subjects)
+	{
+		if (! subject->_brain)
+			continue;
+		
+		for (const NeuralNetwork::Layer &layer : subject->_brain->layers())
+		{
+			for (int ib = 0; ib < layer._weights.numBlocks(); ++ib)
+			{
+				blocks.insert(layer._weights.blockId(ib));
+			}
+			for (int ib = 0; ib < layer._factor.numBlocks(); ++ib)
+			{
+				blocks.insert(layer._factor.blockId(ib));
+			}
+			s._weightBlocks += layer._weights.numBlocks() + layer._factor.numBlocks();
+		}
+	}
+	s._uniqueWeightBlocks = blocks.size();
+	
 	return s;
 }
 
@@ -124,20 +628,71 @@ void Population::nextgeneration()
 {
 	// std::sort(_subjects.begin(), _subjects.end(), [] (Subject *a, Subject *b) { return a->_score > b->_score; });
 	
-	double min_mutation_rate = 0.1;
-	double max_mutation_rate = 0.5;
+	std::vector<int> children(_subjects.size());
+	for (size_t i = 0; i < children.size(); ++i)
+	{
+		children[i] = (int)i;
+	}
+	
+	// Best first, ties go to the lower index
+	int nParents = std::min(_parents, (int)_subjects.size());
+	if (nParents > 0)
+	{
+		std::vector<int> ranked = children;
+		std::stable_sort(ranked.begin(), ranked.end(), [&] (int a, int b) { return ranksBefore(*_subjects[a], *_subjects[b]); });
+		
+		// A child shares every weight block of its parent until mutated, place() moves the shared blocks of a parent
+		// on another node
+		children.clear();
+		for (size_t i = nParents; i < ranked.size(); ++i)
+		{
+			const Subject *parent = _subjects[ranked[i % nParents]];
+			Subject *child = _subjects[ranked[i]];
+			
+			child->_genome = parent->_genome;
+			child->_score = parent->_score;
+			if (parent->_brain)
+				*child->_brain = *parent->_brain;
+			
+			children.push_back(ranked[i]);
+		}
+		
+		_childrenPlaced = false;
+	}
+	
+	const int threadNode = MatrixMemoryAllocator::threadNode();
+	
+	double min_mutation_rate = _minMutationRate;
+	double max_mutation_rate = _maxMutationRate;
 	double avg_mutation_rate = 0.0;
-	for (Subject *subject : _subjects)
+	for (int ichild : children)
 	{
-		double t = (subject->_score - 0.0) / (1.0 - 0.0);
+		Subject *subject = _subjects[ichild];
+		
+		// Losses are not bounded by 1, a rate outside [min, max] would be meaningless
+		double t = std::min(std::max((subject->_score - 0.0) / (1.0 - 0.0), 0.0), 1.0);
 		double mutation_rate = min_mutation_rate + (max_mutation_rate - min_mutation_rate) * (1.0 - t);
 		avg_mutation_rate += mutation_rate;
-		subject->_brain.mutate(mutation_rate);
+		
+		// Genomes record every mutation, networks kept in memory follow them
+		Genome::Mutation mutation;
+		mutation._seed = _mutationRandom();
+		mutation._rate = mutation_rate;
+		subject->_genome._mutations.push_back(mutation);
+		
+		// Blocks duplicated by the mutation come from the arena of the node the subject is placed on
+		if (subject->_brain)
+		{
+			MatrixMemoryAllocator::setThreadNode((ichild < (int)_subjectNodes.size()) ? _subjectNodes[ichild] : -1);
+			subject->_brain->mutate(mutation._rate, mutation._seed);
+		}
 	}
 	
-	if (! _subjects.empty())
+	MatrixMemoryAllocator::setThreadNode(threadNode);
+	
+	if (! children.empty())
 	{
-		avg_mutation_rate /= (double)_subjects.size();
+		avg_mutation_rate /= (double)children.size();
 	}
 	
 	printf("mutation rate: %5.2f", avg_mutation_rate);
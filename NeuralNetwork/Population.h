@@ -2,7 +2,13 @@
 #define __NN_POPULATION_H__
 
 #include "NeuralNetwork.h"
+#include "Genome.h"
+#include "IndexSampler.h"
+#include "Topology.h"
 #include <initializer_list>
+#include <stdexcept>
+#include <memory>
+#include <random>
 
 namespace nn
 {
@@ -13,34 +19,137 @@ public:
 	using Sample = NeuralNetwork::Sample;
 	using LayerInfo = NeuralNetwork::LayerInfo;
 	
-	Population(int n, int nInputs, std::initializer_list<LayerInfo> layers, LossFunction lf)
+	// Subjects always carry their genome. FULL also keeps every network in memory, SEED_CHAIN only
+	// rebuilds them when evaluated, trading one pass over the weights per mutation for the memory.
+	enum class Encoding
 	{
-		_subjects.resize(n);
-		
-		for (Subject *&subject : _subjects)
-		{
-			subject = new Subject(nInputs, layers, lf);
-		}
-	}
+		FULL, 
+		SEED_CHAIN
+	};
+	
+	Population(int n, int nInputs, const std::vector<LayerInfo> &layers, LossFunction lf, Encoding encoding = Encoding::FULL);
 	
 	struct Subject
 	{
-		nn::NeuralNetwork _brain;
+		// Null with the seed chain encoding, see brain()
+		std::unique_ptr<nn::NeuralNetwork> _brain;
+		Genome _genome;
+		
+		// Mean loss over the _samples samples the subject was evaluated on, and its standard error
 		double _score;
+		double _scoreError;
+		int _samples;
 		
-		Subject(int nInputs, std::initializer_list<LayerInfo> layers, LossFunction lf) : _brain(nInputs, layers, lf), _score(0.0)
+		Subject(const Genome &genome) : _genome(genome), _score(0.0), _scoreError(0.0), _samples(0)
 		{
 		}
 	};
 	
+	// Selection order, best first: subjects that raced further, then lower mean loss. The mean of a subject dropped
+	// early only covers a prefix of the draw, it never competes with the full means of the survivors.
+	static bool ranksBefore(const Subject &a, const Subject &b)
+	{
+		return a._samples > b._samples || (a._samples == b._samples && a._score < b._score);
+	}
+	
+	// Network rebuilt from a genome, one per thread. Keyed by the genome it holds, not by subject: selection may give
+	// a subject another genome of the same length.
+	struct BrainScratch
+	{
+		std::unique_ptr<nn::NeuralNetwork> _network;
+		Genome _genome;
+	};
+	
+	// Successive halving over the draw of a generation: every subject is evaluated on the first
+	// _initialSamples samples, then the worst _dropFraction of them (highest mean loss) stop there while
+	// the others go on with twice as many samples, and so on until the draw is exhausted.
+	struct RacingConfig
+	{
+		// 0 evaluates every subject on the whole draw
+		int _initialSamples = 0;
+		double _dropFraction = 0.5;
+		int _minSurvivors = 1;
+	};
+	
+	// One round of the last generation, subjects scoring above _cutoff were dropped after it
+	struct RacingRound
+	{
+		int _firstSample;
+		int _samples;
+		int _subjects;
+		int _survivors;
+		double _cutoff;
+	};
+	
 	using SubjectList = std::vector<Subject *>;
 	const SubjectList &subjects() const { return _subjects; }
 	
+	// Every subject is evaluated on the same draw of samples per generation, taken from an epoch shuffle of samples.
+	// Work is split in (subject, batch) tasks, batches of one subject run concurrently on per-worker workspaces.
+	// With racing, subjects dropped early are scored on a prefix of the draw, see RacingConfig.
 	void feed_forward(const std::vector<const Sample *> &samples);
 	
+	// Samples drawn per generation, 0 for samples.size()
+	void setSamplesPerGeneration(int n) { _samplesPerGeneration = n; }
+	
+	// Samples per task, 0 for one task per subject. Batches of one subject run on different workers, so a population
+	// smaller than the number of workers still keeps them all busy. Seed chain subjects, rebuilt by every task, are
+	// only split when there are fewer of them than workers.
+	static const int DefaultBatchSize = 16;
+	void setBatchSize(int n) { _batchSize = n; }
+	
+	// Seeds the sample draws and the mutations, genomes of the initial subjects depend on the construction order only
+	void setSeed(unsigned int seed)
+	{
+		_sampler.seed(seed);
+		_mutationRandom.seed(seed);
+	}
+	
+	Encoding encoding() const { return _encoding; }
+	
+	// Network of a subject. With the seed chain encoding it is rebuilt into scratch, starting from the network
+	// already there or the closest cached elite, whichever has the longer common chain. Safe to call from several
+	// threads with one scratch each.
+	const NeuralNetwork &brain(const Subject &subject, BrainScratch &scratch) const;
+	
+	// Best subjects of the last generation kept materialized, descendants of an elite are rebuilt from it
+	void setEliteCacheSize(int n) { _eliteCacheSize = n; }
+	
+	// Worker threads of feed_forward, throws when no CPU matches the config
+	void setSchedulerConfig(const SchedulerConfig &config)
+	{
+		if (Topology::instance().selectCpus(config).empty())
+			throw std::runtime_error("nn::Population - no CPU matches the scheduler config");
+		_scheduler = config;
+	}
+	
+	const SchedulerConfig &schedulerConfig() const { return _scheduler; }
+	
+	void setRacingConfig(const RacingConfig &config) { _racing = config; }
+	const RacingConfig &racingConfig() const { return _racing; }
+	
+	// Rounds of the last feed_forward, a single one without racing
+	const std::vector<RacingRound> &racingRounds() const { return _racingRounds; }
+	
+	// Truncation selection in nextgeneration(): the n best subjects in ranksBefore() order survive unchanged and every
+	// other subject is replaced by a mutated child of one of them. 0 mutates every subject in place.
+	void setParents(int n) { _parents = n; }
+	
+	// Per weight mutation probability, from max for a score of 0 to min for a score of 1. Children only
+	// duplicate the weight blocks their mutation touches, so low rates keep most blocks shared.
+	void setMutationRates(double min, double max)
+	{
+		_minMutationRate = min;
+		_maxMutationRate = max;
+	}
+	
 	struct Statistics
 	{
 		double _score;
+		
+		// Weight blocks referenced by all subjects, and distinct ones, children share unmutated blocks with their parents
+		size_t _weightBlocks;
+		size_t _uniqueWeightBlocks;
 	};
 	
 	Statistics computePopulationStatistics() const;
@@ -48,7 +157,64 @@ public:
 	void nextgeneration();
 	
 protected:
+	// Moves the brains of subjects [firstSubjects[i], firstSubjects[i + 1]) to the arena of nodes[i], and the weight
+	// blocks of subjects already there that children of the last selection share with another node
+	void place(const std::vector<int> &nodes, const std::vector<int> &firstSubjects);
+	
+	struct Placement;
+	
+	struct Elite
+	{
+		Genome _genome;
+		std::unique_ptr<NeuralNetwork> _network;
+	};
+	
+	// Cached elite with the longest chain leading to genome, nullptr when none
+	const Elite *findElite(const Genome &genome) const;
+	void updateElites();
+	
+	// Evaluates the active subjects on samples [firstSample, lastSample) of the draw, adds to the sums of losses
+	void evaluate(const std::vector<const Sample *> &samples, const Placement &placement, int firstSample, int lastSample);
+	
 	SubjectList _subjects;
+	
+	int _nInputs;
+	std::vector<LayerInfo> _layerInfos;
+	LossFunction _lf;
+	Encoding _encoding;
+	
+	std::mt19937 _mutationRandom;
+	
+	int _eliteCacheSize = 4;
+	int _parents = 0;
+	double _minMutationRate = 0.1;
+	double _maxMutationRate = 0.5;
+	std::vector<Elite> _elites;
+	
+	int _samplesPerGeneration = 0;
+	int _batchSize = DefaultBatchSize;
+	
+	SchedulerConfig _scheduler;
+	RacingConfig _racing;
+	std::vector<RacingRound> _racingRounds;
+	
+	IndexSampler _sampler;
+	std::vector<uint32_t> _indices;
+	
+	// Score of every (subject, batch) task of the last round, reduced per subject after the workers joined
+	std::vector<double> _batchScores;
+	std::vector<double> _batchSquares;
+	
+	// Subjects still racing, and the sums of losses and squared losses of every subject
+	std::vector<int> _active;
+	std::vector<double> _sums;
+	std::vector<double> _squares;
+	
+	// NUMA node holding each subject, empty until the first placement
+	std::vector<int> _subjectNodes;
+	
+	// False once selection made children, they may share weight blocks with parents placed on other nodes
+	bool _childrenPlaced = true;
 };
 
 }; // namespace nn
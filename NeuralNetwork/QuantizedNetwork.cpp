@@ -0,0 +1,353 @@
+#include "QuantizedNetwork.h"
+#include "Topology.h"
+#include <algorithm>
+#include <stdexcept>
+#include <cmath>
+
+// SIMD kernels rely on the target attribute of clang and gcc, the project compiler
+#if (defined(__x86_64__) || defined(_M_X64)) && (defined(__clang__) || defined(__GNUC__))
+#define NN_INT8_X86
+#include <immintrin.h>
+#endif
+
+namespace nn
+{
+
+namespace
+{
+	// Activations are quantized to 7 bits: pmaddubsw adds two u8 x s8 products into a saturating int16,
+	// 2 * 127 * 127 fits where 2 * 255 * 127 would not. Every kernel then computes the exact same sums.
+	const int ActivationMax = 127;
+	
+	// Row stride of quantized matrices, one AVX-512 vector
+	const int RowAlignment = 64;
+	
+	// acc[r] = sum of x[k] * w[r * stride + k] over the stride
+	typedef void (*DotKernel)(const uint8_t *x, const int8_t *w, int stride, int nrows, int32_t *acc);
+	
+	void dotScalar(const uint8_t *x, const int8_t *w, int stride, int nrows, int32_t *acc)
+	{
+		for (int r = 0; r < nrows; ++r, w += stride)
+		{
+			int32_t sum = 0;
+			for (int k = 0; k < stride; ++k)
+			{
+				sum += (int32_t)x[k] * (int32_t)w[k];
+			}
+			acc[r] = sum;
+		}
+	}
+
+#ifdef NN_INT8_X86
+	__attribute__((target("avx2"))) inline int32_t hsum(__m256i v)
+	{
+		__m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+		s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+		s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+		return _mm_cvtsi128_si32(s);
+	}
+	
+	// pmaddubsw to int16 pairs, pmaddwd by ones to int32. Four rows at a time share the activation loads.
+	__attribute__((target("avx2"))) void dotAvx2(const uint8_t *x, const int8_t *w, int stride, int nrows, int32_t *acc)
+	{
+		const __m256i ones = _mm256_set1_epi16(1);
+		
+		int r = 0;
+		for (; r + 4 <= nrows; r += 4)
+		{
+			const int8_t *w0 = w + (size_t)r * stride;
+			__m256i a0 = _mm256_setzero_si256(), a1 = _mm256_setzero_si256(), a2 = _mm256_setzero_si256(), a3 = _mm256_setzero_si256();
+			
+			for (int k = 0; k < stride; k += 32)
+			{
+				__m256i xv = _mm256_loadu_si256((const __m256i *)(x + k));
+				a0 = _mm256_add_epi32(a0, _mm256_madd_epi16(_mm256_maddubs_epi16(xv, _mm256_loadu_si256((const __m256i *)(w0 + k))), ones));
+				a1 = _mm256_add_epi32(a1, _mm256_madd_epi16(_mm256_maddubs_epi16(xv, _mm256_loadu_si256((const __m256i *)(w0 + stride + k))), ones));
+				a2 = _mm256_add_epi32(a2, _mm256_madd_epi16(_mm256_maddubs_epi16(xv, _mm256_loadu_si256((const __m256i *)(w0 + 2 * stride + k))), ones));
+				a3 = _mm256_add_epi32(a3, _mm256_madd_epi16(_mm256_maddubs_epi16(xv, _mm256_loadu_si256((const __m256i *)(w0 + 3 * stride + k))), ones));
+			}
+			
+			acc[r] = hsum(a0);
+			acc[r + 1] = hsum(a1);
+			acc[r + 2] = hsum(a2);
+			acc[r + 3] = hsum(a3);
+		}
+		
+		for (; r < nrows; ++r)
+		{
+			const int8_t *wr = w + (size_t)r * stride;
+			__m256i a = _mm256_setzero_si256();
+			for (int k = 0; k < stride; k += 32)
+			{
+				__m256i xv = _mm256_loadu_si256((const __m256i *)(x + k));
+				a = _mm256_add_epi32(a, _mm256_madd_epi16(_mm256_maddubs_epi16(xv, _mm256_loadu_si256((const __m256i *)(wr + k))), ones));
+			}
+			acc[r] = hsum(a);
+		}
+	}
+	
+	// vpdpbusd accumulates the four u8 x s8 products of every int32 lane in one instruction, without intermediate saturation
+	__attribute__((target("avx512f,avx512vnni"))) void dotVnni(const uint8_t *x, const int8_t *w, int stride, int nrows, int32_t *acc)
+	{
+		int r = 0;
+		for (; r + 4 <= nrows; r += 4)
+		{
+			const int8_t *w0 = w + (size_t)r * stride;
+			__m512i a0 = _mm512_setzero_si512(), a1 = _mm512_setzero_si512(), a2 = _mm512_setzero_si512(), a3 = _mm512_setzero_si512();
+			
+			for (int k = 0; k < stride; k += 64)
+			{
+				__m512i xv = _mm512_loadu_si512(x + k);
+				a0 = _mm512_dpbusd_epi32(a0, xv, _mm512_loadu_si512(w0 + k));
+				a1 = _mm512_dpbusd_epi32(a1, xv, _mm512_loadu_si512(w0 + stride + k));
+				a2 = _mm512_dpbusd_epi32(a2, xv, _mm512_loadu_si512(w0 + 2 * stride + k));
+				a3 = _mm512_dpbusd_epi32(a3, xv, _mm512_loadu_si512(w0 + 3 * stride + k));
+			}
+			
+			acc[r] = _mm512_reduce_add_epi32(a0);
+			acc[r + 1] = _mm512_reduce_add_epi32(a1);
+			acc[r + 2] = _mm512_reduce_add_epi32(a2);
+			acc[r + 3] = _mm512_reduce_add_epi32(a3);
+		}
+		
+		for (; r < nrows; ++r)
+		{
+			const int8_t *wr = w + (size_t)r * stride;
+			__m512i a = _mm512_setzero_si512();
+			for (int k = 0; k < stride; k += 64)
+			{
+				a = _mm512_dpbusd_epi32(a, _mm512_loadu_si512(x + k), _mm512_loadu_si512(wr + k));
+			}
+			acc[r] = _mm512_reduce_add_epi32(a);
+		}
+	}
+#endif
+
+	DotKernel dotKernel(Int8Kernel kernel)
+	{
+		switch (kernel)
+		{
+#ifdef NN_INT8_X86
+			case Int8Kernel::AVX2:
+				return dotAvx2;
+			
+			case Int8Kernel::AVX512_VNNI:
+				return dotVnni;
+#endif
+
+			default:
+				return dotScalar;
+		};
+	}
+};
+
+QuantizedMatrix::QuantizedMatrix(const nn::BlockMatrix &m)
+{
+	_numColumns = m.numColumns();
+	_stride = (m.numColumns() + RowAlignment - 1) / RowAlignment * RowAlignment;
+	
+	_values.assign((size_t)m.numRows() * _stride, 0);
+	_scales.resize(m.numRows());
+	_rowSums.resize(m.numRows());
+	
+	for (int r = 0; r < m.numRows(); ++r)
+	{
+		const float *row = m.row(r);
+		
+		float maxAbs = 0.0f;
+		for (int c = 0; c < _numColumns; ++c)
+		{
+			maxAbs = std::max(maxAbs, std::fabs(row[c]));
+		}
+		
+		// An all zero row quantizes to zeros whatever its scale
+		_scales[r] = (maxAbs > 0.0f) ? maxAbs / 127.0f : 1.0f;
+		
+		int8_t *q = _values.data() + (size_t)r * _stride;
+		int32_t sum = 0;
+		for (int c = 0; c < _numColumns; ++c)
+		{
+			q[c] = (int8_t)std::max(-127.0f, std::min(127.0f, std::round(row[c] / _scales[r])));
+			sum += q[c];
+		}
+		_rowSums[r] = sum;
+	}
+}
+
+QuantizedNetwork::QuantizedNetwork(const NeuralNetwork &network) : _network(network)
+{
+	for (const NeuralNetwork::Layer &layer : _network.layers())
+	{
+		if (layer._type == LayerType::DENSE)
+			_weights.push_back(QuantizedMatrix(layer._weights));
+		else
+			_weights.push_back(QuantizedMatrix());
+		
+		if (layer.factorized())
+			_factors.push_back(QuantizedMatrix(layer._factor));
+		else
+			_factors.push_back(QuantizedMatrix());
+	}
+	
+	_kernel = bestKernel();
+}
+
+bool QuantizedNetwork::isSupported(Int8Kernel kernel)
+{
+	const Topology::InstructionSets &sets = Topology::instance().instructionSets();
+	
+	switch (kernel)
+	{
+		case Int8Kernel::SCALAR:
+			return true;
+		
+#ifdef NN_INT8_X86
+		case Int8Kernel::AVX2:
+			return sets._avx2;
+		
+		case Int8Kernel::AVX512_VNNI:
+			return sets._avx512vnni;
+#endif
+		
+		default:
+			return false;
+	};
+}
+
+Int8Kernel QuantizedNetwork::bestKernel()
+{
+	static const Int8Kernel kernel =
+		isSupported(Int8Kernel::AVX512_VNNI) ? Int8Kernel::AVX512_VNNI :
+		isSupported(Int8Kernel::AVX2) ? Int8Kernel::AVX2 :
+		Int8Kernel::SCALAR;
+	
+	return kernel;
+}
+
+const char *QuantizedNetwork::kernelName(Int8Kernel kernel)
+{
+	switch (kernel)
+	{
+		case Int8Kernel::AVX2:
+			return "AVX2";
+		
+		case Int8Kernel::AVX512_VNNI:
+			return "AVX-512 VNNI";
+		
+		default:
+			return "scalar";
+	};
+}
+
+void QuantizedNetwork::setKernel(Int8Kernel kernel)
+{
+	if (! isSupported(kernel))
+		throw std::runtime_error("nn::QuantizedNetwork - kernel not supported by the CPU");
+	
+	_kernel = kernel;
+}
+
+size_t QuantizedNetwork::sizeInBytes() const
+{
+	size_t size = 0;
+	for (size_t i = 0; i < _weights.size(); ++i)
+	{
+		size += _weights[i].sizeInBytes() + _factors[i].sizeInBytes();
+	}
+	return size;
+}
+
+void QuantizedNetwork::product(const QuantizedMatrix &w, const nn::Matrix &x, nn::Matrix &y, Workspace &workspace) const
+{
+	const int n = x.numRows();
+	const float *v = x.ptr();
+	
+	// Asymmetric range including zero, so that zero is exactly representable
+	float lo = 0.0f, hi = 0.0f;
+	for (int i = 0; i < n; ++i)
+	{
+		lo = std::min(lo, v[i]);
+		hi = std::max(hi, v[i]);
+	}
+	
+	const float scale = (hi > lo) ? (hi - lo) / ActivationMax : 1.0f;
+	const int zeroPoint = std::max(0, std::min(ActivationMax, (int)std::round(-lo / scale)));
+	
+	// Padding holds the zero point, it meets zero weights
+	workspace._activations.resize(w.stride());
+	uint8_t *q = workspace._activations.data();
+	for (int i = 0; i < n; ++i)
+	{
+		q[i] = (uint8_t)std::max(0, std::min(ActivationMax, (int)std::round(v[i] / scale) + zeroPoint));
+	}
+	std::fill(q + n, q + w.stride(), (uint8_t)zeroPoint);
+	
+	workspace._accumulators.resize(w.numRows());
+	dotKernel(_kernel)(q, w.row(0), w.stride(), w.numRows(), workspace._accumulators.data());
+	
+	float *out = y.ptr();
+	for (int r = 0; r < w.numRows(); ++r)
+	{
+		out[r] = w.scale(r) * scale * (float)(workspace._accumulators[r] - zeroPoint * w.rowSum(r));
+	}
+}
+
+const nn::Matrix &QuantizedNetwork::forward(const nn::Matrix &input, Workspace &workspace) const
+{
+	const NeuralNetwork::LayerList &layers = _network.layers();
+	
+	if (workspace._outputs.size() != layers.size())
+	{
+		workspace._outputs.resize(layers.size());
+		workspace._projections.resize(layers.size());
+		for (size_t i = 0; i < layers.size(); ++i)
+		{
+			workspace._outputs[i].resize(layers[i].numOutputs(), 1, MatrixInit::UNINITIALIZED);
+			if (layers[i].factorized())
+				workspace._projections[i].resize(layers[i].rank(), 1, MatrixInit::UNINITIALIZED);
+		}
+		
+		workspace._columns.resize(_network.columnsSize(), 1, MatrixInit::UNINITIALIZED);
+	}
+	
+	const nn::Matrix *payload = &input;
+	
+	for (size_t i = 0; i < layers.size(); ++i)
+	{
+		const NeuralNetwork::Layer &layer = layers[i];
+		nn::Matrix &output = workspace._outputs[i];
+		
+		if (layer._type == LayerType::MAXPOOL)
+		{
+			nn::maxPool<float>(layer._shape, payload->ptr(), MatrixView<float>(output.ptr(), layer.numChannels(), layer._shape.outputSize()));
+		}
+		else if (layer._type == LayerType::CONV2D)
+		{
+			MatrixView<float> maps(output.ptr(), layer.numChannels(), layer._shape.outputSize());
+			nn::convolve<float>(layer._shape, layer._weights, payload->ptr(), workspace._columns.ptr(), maps);
+			
+			nn::imap(maps, [&] (int ir, int, float v) { return v + layer._biases(ir, 0); });
+			layer.activate(output);
+		}
+		else
+		{
+			// The projection of a factorized layer is quantized again before U
+			if (layer.factorized())
+			{
+				product(_factors[i], *payload, workspace._projections[i], workspace);
+				payload = &workspace._projections[i];
+			}
+			
+			product(_weights[i], *payload, output, workspace);
+			
+			nn::imap(output, [&] (int ir, int, float v) { return v + layer._biases(ir, 0); });
+			layer.activate(output);
+		}
+		
+		payload = &output;
+	}
+	
+	return *payload;
+}
+
+}; // namespace nn
@@ -0,0 +1,107 @@
+#ifndef __NN_QUANTIZED_NETWORK_H__
+#define __NN_QUANTIZED_NETWORK_H__
+
+#include "NeuralNetwork.h"
+#include <vector>
+#include <cstdint>
+
+namespace nn
+{
+
+// Int8 dot product kernels, the widest one supported by the CPU is picked at runtime
+enum class Int8Kernel
+{
+	SCALAR, 
+	AVX2, 
+	AVX512_VNNI
+};
+
+// Rows quantized symmetrically to [-127, 127] with one scale per row, each row padded with zeros to whole 64 byte vectors
+class QuantizedMatrix
+{
+public:
+	QuantizedMatrix()
+	{
+	}
+	
+	QuantizedMatrix(const nn::BlockMatrix &m);
+	
+	int numRows() const { return (int)_scales.size(); }
+	int numColumns() const { return _numColumns; }
+	int stride() const { return _stride; }
+	
+	const int8_t *row(int r) const { return _values.data() + (size_t)r * _stride; }
+	float scale(int r) const { return _scales[r]; }
+	
+	// Sum of the quantized values of a row, cancels the zero point of the activations
+	int32_t rowSum(int r) const { return _rowSums[r]; }
+	
+	size_t sizeInBytes() const { return _values.size() + _scales.size() * sizeof(float) + _rowSums.size() * sizeof(int32_t); }
+	
+protected:
+	int _numColumns = 0;
+	int _stride = 0;
+	
+	std::vector<int8_t> _values;
+	std::vector<float> _scales;
+	std::vector<int32_t> _rowSums;
+};
+
+// Post-training quantization of a network for inference. Weights of the dense layers (U and V of the factorized ones)
+// are int8 with per-row scales, their inputs are quantized on the fly to 7 bits with a per-vector scale and zero point,
+// products accumulate in int32. Biases, activations, convolution and pooling layers stay in fp32.
+//
+// Usage:
+//   QuantizedNetwork q(network);
+//   QuantizedNetwork::Workspace workspace;
+//   q.forward(input, workspace);
+class QuantizedNetwork
+{
+public:
+	// Scratch of one evaluation, one per thread
+	struct Workspace
+	{
+		std::vector<nn::Matrix> _outputs;
+		std::vector<nn::Matrix> _projections;
+		
+		// Unfolded input of the convolutions taking the im2col path, sized for the largest of them
+		nn::Matrix _columns;
+		
+		std::vector<uint8_t> _activations;
+		std::vector<int32_t> _accumulators;
+	};
+	
+	QuantizedNetwork(const NeuralNetwork &network);
+	
+	const nn::Matrix &forward(const nn::Matrix &input, Workspace &workspace) const;
+	
+	// Best kernel of the CPU, and the one in use, throws when the CPU does not support it
+	static Int8Kernel bestKernel();
+	static bool isSupported(Int8Kernel kernel);
+	static const char *kernelName(Int8Kernel kernel);
+	
+	Int8Kernel kernel() const { return _kernel; }
+	void setKernel(Int8Kernel kernel);
+	
+	// The fp32 network, its weights are shared rather than copied, see BlockMatrix
+	const NeuralNetwork &network() const { return _network; }
+	
+	// Quantized weights, scales and row sums
+	size_t sizeInBytes() const;
+	
+protected:
+	// y = W x for a quantized W, x is quantized into the workspace first
+	void product(const QuantizedMatrix &w, const nn::Matrix &x, nn::Matrix &y, Workspace &workspace) const;
+	
+	NeuralNetwork _network;
+	
+	// Per layer, empty for convolution and pooling layers. _factors holds V of the factorized layers.
+	std::vector<QuantizedMatrix> _weights;
+	std::vector<QuantizedMatrix> _factors;
+	
+	Int8Kernel _kernel;
+};
+
+}; // namespace nn
+
+#endif // __NN_QUANTIZED_NETWORK_H__
@@ -0,0 +1,449 @@
+#include "Topology.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <cstdint>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#endif
+
+#if (defined(__x86_64__) || defined(_M_X64)) && (defined(__clang__) || defined(__GNUC__))
+#define NN_TOPOLOGY_X86
+#include <cpuid.h>
+#endif
+
+namespace nn
+{
+
+#ifndef _WIN32
+namespace
+{
+	// "0-3,8-11" as found in sysfs cpulist files
+	std::vector<int> parseCpuList(const std::string &s)
+	{
+		std::vector<int> cpus;
+		
+		const char *p = s.c_str();
+		while (*p != '\0')
+		{
+			char *end;
+			long first = strtol(p, &end, 10);
+			if (end == p)
+				break;
+			
+			long last = first;
+			p = end;
+			if (*p == '-')
+			{
+				last = strtol(p + 1, &end, 10);
+				p = end;
+			}
+			
+			for (long cpu = first; cpu <= last; ++cpu)
+			{
+				cpus.push_back((int)cpu);
+			}
+			
+			if (*p == ',')
+				++p;
+			else
+				break;
+		}
+		
+		return cpus;
+	}
+	
+	bool readLine(const std::string &path, std::string &line)
+	{
+		FILE *f = fopen(path.c_str(), "r");
+		if (f == nullptr)
+			return false;
+		
+		char buffer[4096];
+		bool ok = fgets(buffer, sizeof(buffer), f) != nullptr;
+		fclose(f);
+		
+		if (ok)
+			line = buffer;
+		return ok;
+	}
+};
+#endif
+
+const Topology &Topology::instance()
+{
+	static Topology topology;
+	return topology;
+}
+
+Topology::Topology()
+{
+	probe();
+	
+	if (_cpus.empty())
+	{
+		int n = std::max((int)std::thread::hardware_concurrency(), 1);
+		for (int cpu = 0; cpu < n; ++cpu)
+		{
+			addCpu(cpu, 0);
+		}
+	}
+	
+	std::sort(_cpus.begin(), _cpus.end());
+	
+	// Without core information every CPU is its own core
+	probeCores();
+	for (int cpu : _cpus)
+	{
+		if (_cpuCores[cpu] < 0)
+			setCore(cpu, cpu, 0);
+	}
+	
+	probeAffinity();
+	if (_allowedCpus.empty())
+		_allowedCpus = _cpus;
+	
+	probeInstructionSets();
+	probeCpuModel();
+}
+
+void Topology::probeInstructionSets()
+{
+#ifdef NN_TOPOLOGY_X86
+	unsigned int regs[4];
+	__cpuid_count(0, 0, regs[0], regs[1], regs[2], regs[3]);
+	if (regs[0] < 7)
+		return;
+	
+	// OSXSAVE, then the register state enabled by the OS: XMM and YMM, and for AVX-512 the opmask and ZMM state
+	__cpuid_count(1, 0, regs[0], regs[1], regs[2], regs[3]);
+	if ((regs[2] & (1u << 27)) == 0)
+		return;
+	const bool fma = (regs[2] & (1u << 12)) != 0;
+	
+	uint32_t eax, edx;
+	__asm__ volatile ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+	const uint64_t state = ((uint64_t)edx << 32) | eax;
+	
+	__cpuid_count(7, 0, regs[0], regs[1], regs[2], regs[3]);
+	
+	const bool avx = (state & 0x6) == 0x6;
+	_instructionSets._avx2 = avx && (regs[1] & (1u << 5)) != 0;
+	_instructionSets._fma = avx && fma;
+	_instructionSets._avx512vnni = (state & 0xe6) == 0xe6 && (regs[1] & (1u << 16)) != 0 && (regs[2] & (1u << 11)) != 0;
+#endif
+}
+
+void Topology::probeCpuModel()
+{
+	_cpuModel = "unknown";
+	
+#ifdef NN_TOPOLOGY_X86
+	unsigned int regs[12];
+	__cpuid(0x80000000, regs[0], regs[1], regs[2], regs[3]);
+	if (regs[0] < 0x80000004)
+		return;
+	
+	// 48 characters over three leaves, padded with spaces and zeros
+	char brand[sizeof(regs) + 1] = {};
+	for (unsigned int i = 0; i < 3; ++i)
+	{
+		__cpuid(0x80000002 + i, regs[4 * i], regs[4 * i + 1], regs[4 * i + 2], regs[4 * i + 3]);
+	}
+	memcpy(brand, regs, sizeof(regs));
+	
+	std::string model(brand);
+	const size_t first = model.find_first_not_of(' ');
+	if (first != std::string::npos)
+		_cpuModel = model.substr(first, model.find_last_not_of(' ') - first + 1);
+#endif
+}
+
+void Topology::addCpu(int cpu, int node)
+{
+	if (cpu < 0 || node < 0)
+		return;
+	
+	if (cpu >= (int)_cpuNodes.size())
+	{
+		_cpuNodes.resize(cpu + 1, -1);
+		_cpuCores.resize(cpu + 1, -1);
+		_cpuSiblings.resize(cpu + 1, -1);
+	}
+	if (_cpuNodes[cpu] >= 0)
+		return;
+	
+	if (node >= (int)_nodeCpus.size())
+		_nodeCpus.resize(node + 1);
+	
+	_cpuNodes[cpu] = node;
+	_nodeCpus[node].push_back(cpu);
+	_cpus.push_back(cpu);
+}
+
+void Topology::setCore(int cpu, int core, int sibling)
+{
+	if (cpuNode(cpu) < 0)
+		return;
+	
+	_cpuCores[cpu] = core;
+	_cpuSiblings[cpu] = sibling;
+}
+
+int Topology::cpuNode(int cpu) const
+{
+	if (cpu < 0 || cpu >= (int)_cpuNodes.size())
+		return -1;
+	return _cpuNodes[cpu];
+}
+
+int Topology::cpuCore(int cpu) const
+{
+	if (cpu < 0 || cpu >= (int)_cpuCores.size())
+		return -1;
+	return _cpuCores[cpu];
+}
+
+int Topology::cpuSibling(int cpu) const
+{
+	if (cpu < 0 || cpu >= (int)_cpuSiblings.size())
+		return -1;
+	return _cpuSiblings[cpu];
+}
+
+std::vector<int> Topology::selectCpus(const SchedulerConfig &config) const
+{
+	std::vector<int> cpus;
+	for (int cpu : config._cpus.empty() ? _allowedCpus : config._cpus)
+	{
+		if (cpuNode(cpu) < 0)
+			continue;
+		if (! config._nodes.empty() && std::find(config._nodes.begin(), config._nodes.end(), cpuNode(cpu)) == config._nodes.end())
+			continue;
+		if (std::find(cpus.begin(), cpus.end(), cpu) != cpus.end())
+			continue;
+		
+		cpus.push_back(cpu);
+	}
+	
+	std::sort(cpus.begin(), cpus.end(), [this] (int a, int b) {
+		if (cpuNode(a) != cpuNode(b))
+			return cpuNode(a) < cpuNode(b);
+		if (cpuSibling(a) != cpuSibling(b))
+			return cpuSibling(a) < cpuSibling(b);
+		return a < b;
+	});
+	
+	// The lowest selected sibling of every core, not necessarily the first one when the CPU set excludes it
+	if (config._physicalCores)
+	{
+		std::vector<int> cores;
+		cpus.erase(std::remove_if(cpus.begin(), cpus.end(), [&] (int cpu) {
+			if (std::find(cores.begin(), cores.end(), cpuCore(cpu)) != cores.end())
+				return true;
+			cores.push_back(cpuCore(cpu));
+			return false;
+		}), cpus.end());
+	}
+	
+	return cpus;
+}
+
+#ifdef _WIN32
+
+void Topology::probe()
+{
+	ULONG highest = 0;
+	if (! GetNumaHighestNodeNumber(&highest))
+		return;
+	
+	for (ULONG node = 0; node <= highest; ++node)
+	{
+		GROUP_AFFINITY affinity = {};
+		if (! GetNumaNodeProcessorMaskEx((USHORT)node, &affinity))
+			continue;
+		
+		for (int bit = 0; bit < 64; ++bit)
+		{
+			if (affinity.Mask & ((KAFFINITY)1 << bit))
+				addCpu(affinity.Group * 64 + bit, (int)node);
+		}
+	}
+}
+
+void Topology::probeCores()
+{
+	DWORD size = 0;
+	GetLogicalProcessorInformationEx(RelationProcessorCore, nullptr, &size);
+	if (GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+		return;
+	
+	std::vector<uint8_t> buffer(size);
+	if (! GetLogicalProcessorInformationEx(RelationProcessorCore, (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX *)buffer.data(), &size))
+		return;
+	
+	for (DWORD offset = 0; offset < size; )
+	{
+		const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX *info = (const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX *)(buffer.data() + offset);
+		offset += info->Size;
+		
+		// Cores never span processor groups
+		const GROUP_AFFINITY &affinity = info->Processor.GroupMask[0];
+		
+		int core = -1;
+		int sibling = 0;
+		for (int bit = 0; bit < 64; ++bit)
+		{
+			if ((affinity.Mask & ((KAFFINITY)1 << bit)) == 0)
+				continue;
+			
+			int cpu = affinity.Group * 64 + bit;
+			if (core < 0)
+				core = cpu;
+			setCore(cpu, core, sibling++);
+		}
+	}
+}
+
+void Topology::probeAffinity()
+{
+	// Processes spanning several groups are not restricted here
+	USHORT groups[4];
+	USHORT nGroups = 4;
+	if (! GetProcessGroupAffinity(GetCurrentProcess(), &nGroups, groups) || nGroups != 1)
+		return;
+	
+	DWORD_PTR processMask, systemMask;
+	if (! GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+		return;
+	
+	for (int cpu : _cpus)
+	{
+		if (cpu / 64 == groups[0] && (processMask & ((DWORD_PTR)1 << (cpu % 64))))
+			_allowedCpus.push_back(cpu);
+	}
+}
+
+bool Topology::pinThread(std::thread &thread, int cpu)
+{
+	return restrictThread(thread, { cpu });
+}
+
+bool Topology::restrictThread(std::thread &thread, const std::vector<int> &cpus)
+{
+	if (cpus.empty())
+		return false;
+	
+	// A thread affinity is limited to one processor group, the one of the first CPU
+	GROUP_AFFINITY affinity = {};
+	affinity.Group = (WORD)(cpus.front() / 64);
+	for (int cpu : cpus)
+	{
+		if (cpu / 64 == affinity.Group)
+			affinity.Mask |= (KAFFINITY)1 << (cpu % 64);
+	}
+	return SetThreadGroupAffinity((HANDLE)thread.native_handle(), &affinity, nullptr) != 0;
+}
+
+#else
+
+void Topology::probe()
+{
+	std::string online;
+	if (! readLine("/sys/devices/system/cpu/online", online))
+		return;
+	std::vector<int> onlineCpus = parseCpuList(online);
+	
+	DIR *dir = opendir("/sys/devices/system/node");
+	if (dir != nullptr)
+	{
+		while (dirent *entry = readdir(dir))
+		{
+			int node;
+			char tail;
+			if (sscanf(entry->d_name, "node%d%c", &node, &tail) != 1)
+				continue;
+			
+			std::string list;
+			if (! readLine("/sys/devices/system/node/" + std::string(entry->d_name) + "/cpulist", list))
+				continue;
+			
+			for (int cpu : parseCpuList(list))
+			{
+				if (std::find(onlineCpus.begin(), onlineCpus.end(), cpu) != onlineCpus.end())
+					addCpu(cpu, node);
+			}
+		}
+		closedir(dir);
+	}
+	
+	// Kernels without NUMA support have no node directory
+	for (int cpu : onlineCpus)
+	{
+		addCpu(cpu, 0);
+	}
+	
+	// Node numbers may have gaps, memory only nodes and missing ones have no CPU
+}
+
+void Topology::probeCores()
+{
+	for (int cpu : _cpus)
+	{
+		std::string list;
+		if (! readLine("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/thread_siblings_list", list))
+			continue;
+		
+		std::vector<int> siblings = parseCpuList(list);
+		std::vector<int>::iterator it = std::find(siblings.begin(), siblings.end(), cpu);
+		if (it == siblings.end())
+			continue;
+		
+		setCore(cpu, siblings.front(), (int)(it - siblings.begin()));
+	}
+}
+
+void Topology::probeAffinity()
+{
+	// Restricted by taskset, numactl or a cgroup cpuset
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) != 0)
+		return;
+	
+	for (int cpu : _cpus)
+	{
+		if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &set))
+			_allowedCpus.push_back(cpu);
+	}
+}
+
+bool Topology::pinThread(std::thread &thread, int cpu)
+{
+	return restrictThread(thread, { cpu });
+}
+
+bool Topology::restrictThread(std::thread &thread, const std::vector<int> &cpus)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : cpus)
+	{
+		if (cpu < 0 || cpu >= CPU_SETSIZE)
+			return false;
+		CPU_SET(cpu, &set);
+	}
+	return ! cpus.empty() && pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) == 0;
+}
+
+#endif
+
+}; // namespace nn
@@ -0,0 +1,99 @@
+#ifndef __NN_TOPOLOGY_H__
+#define __NN_TOPOLOGY_H__
+
+#include <vector>
+#include <thread>
+#include <string>
+
+namespace nn
+{
+
+// Placement of worker threads, the default runs one unpinned worker per CPU the process is allowed on
+struct SchedulerConfig
+{
+	// Number of workers, 0 for one per selected CPU. Workers beyond the selected CPUs share them.
+	int _threads = 0;
+	
+	// OS CPU indices workers may run on, empty for every CPU the process is allowed on (taskset, cgroup cpuset)
+	std::vector<int> _cpus;
+	
+	// Only NUMA nodes listed here, empty for every node
+	std::vector<int> _nodes;
+	
+	// One hardware thread per physical core, SMT siblings are left to other jobs
+	bool _physicalCores = false;
+	
+	// Pins each worker to one CPU, otherwise workers float over the selected CPUs
+	bool _pin = false;
+};
+
+// CPUs, physical cores and NUMA nodes of the machine, probed once from sysfs on Linux and from the
+// processor information API on Windows. Falls back to a single node with hardware_concurrency() CPUs.
+class Topology
+{
+public:
+	static const Topology &instance();
+	
+	int numCpus() const { return (int)_cpus.size(); }
+	int numNodes() const { return (int)_nodeCpus.size(); }
+	
+	// CPU indices are the OS ones, they may not be contiguous
+	const std::vector<int> &cpus() const { return _cpus; }
+	const std::vector<int> &nodeCpus(int node) const { return _nodeCpus[node]; }
+	int cpuNode(int cpu) const;
+	
+	// First CPU of the physical core of cpu, and the rank of cpu among the SMT siblings of the core
+	int cpuCore(int cpu) const;
+	int cpuSibling(int cpu) const;
+	
+	// CPUs the process is allowed to run on, a subset of cpus()
+	const std::vector<int> &allowedCpus() const { return _allowedCpus; }
+	
+	// CPUs selected by a config, ordered node by node with the first hardware thread of every core before
+	// the SMT siblings, so that assigning workers in order spreads them over cores. Empty when nothing matches.
+	std::vector<int> selectCpus(const SchedulerConfig &config) const;
+	
+	// Restricts a thread to one CPU or to a set of CPUs, returns false when the OS refused
+	static bool pinThread(std::thread &thread, int cpu);
+	static bool restrictThread(std::thread &thread, const std::vector<int> &cpus);
+	
+	// x86-64 extensions both supported by the CPU and enabled by the OS, all false on other architectures
+	struct InstructionSets
+	{
+		bool _avx2 = false;
+		bool _fma = false;
+		bool _avx512vnni = false;
+	};
+	
+	const InstructionSets &instructionSets() const { return _instructionSets; }
+	
+	// Processor brand string, "unknown" when the CPU does not report one
+	const std::string &cpuModel() const { return _cpuModel; }
+	
+protected:
+	Topology();
+	
+	void probe();
+	void probeCores();
+	void probeAffinity();
+	void probeInstructionSets();
+	void probeCpuModel();
+	void addCpu(int cpu, int node);
+	void setCore(int cpu, int core, int sibling);
+	
+	std::vector<int> _cpus;
+	std::vector<int> _allowedCpus;
+	std::vector<std::vector<int>> _nodeCpus;
+	
+	// Indexed by OS CPU index, -1 for CPUs that are not online
+	std::vector<int> _cpuNodes;
+	std::vector<int> _cpuCores;
+	std::vector<int> _cpuSiblings;
+	
+	InstructionSets _instructionSets;
+	std::string _cpuModel;
+};
+
+}; // namespace nn
+
+#endif // __NN_TOPOLOGY_H__
@@ -32,6 +32,15 @@ Buffer *BufferManager::create(VkDeviceSize size, VkBufferUsageFlags usage, VkMem
 	bufferCreateInfo.usage = usage;
 	bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 	
+	// Buffers are written by the transfer queue and read by the compute queue
+	const std::vector<uint32_t> &queueFamilies = _device->queueFamilyIndices();
+	if (queueFamilies.size() > 1)
+	{
+		bufferCreateInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+		bufferCreateInfo.queueFamilyIndexCount = (uint32_t)queueFamilies.size();
+		bufferCreateInfo.pQueueFamilyIndices = queueFamilies.data();
+	}
+	
 	if (vkCreateBuffer(*_device, &bufferCreateInfo, nullptr, &buffer._handle) != VK_SUCCESS)
 	{
 		throw std::runtime_error("wvk::BufferManager - failed to create buffer");
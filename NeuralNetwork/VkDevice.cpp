@@ -3,8 +3,10 @@
 #include "VkBufferManager.h"
 #include "VkImageManager.h"
 #include "VkComputePipelineManager.h"
+#include "VkProfiler.h"
 
 #include <set>
+#include <atomic>
 #include <algorithm>
 #include <exception>
 #include <stdexcept>
@@ -12,8 +14,17 @@
 namespace wvk
 {
 
+thread_local Device::ThreadCommandPoolsCache Device::_threadCommandPoolsCache;
+
+namespace
+{
+	// Unique across the devices of the process, 0 is never used
+	std::atomic<uint64_t> nextPoolsId(1);
+};
+
 Device::Device()
 {
+	_poolsId = nextPoolsId++;
 }
 
 Device::~Device()
@@ -29,8 +40,34 @@ void Device::setValidationEnabled(bool enabled)
 	_validationEnabled = enabled;
 }
 
+void Device::setPhysicalDeviceIndex(int index)
+{
+	_physicalDeviceIndex = index;
+}
+
+void Device::setComputeQueueCount(uint32_t count)
+{
+	_requestedComputeQueueCount = std::max(count, 1u);
+}
+
+void Device::setStorage16BitEnabled(bool enabled)
+{
+	_storage16BitRequested = enabled;
+}
+
 namespace
 {
+	uint32_t queueFamilyQueueCount(VkPhysicalDevice physicalDevice, int queueFamilyIndex)
+	{
+		uint32_t queueFamilyCount = 0;
+		vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+		
+		std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+		vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
+		
+		return queueFamilies[queueFamilyIndex].queueCount;
+	}
+	
 	int findQueueFamilyIndex(VkPhysicalDevice physicalDevice, VkFlags queueFlags)
 	{
 		uint32_t queueFamilyCount = 0;
@@ -53,6 +90,95 @@ namespace
 		return -1;
 	}
 	
+	// A queue family supporting queueFlags but none of the excludedFlags, e.g. a DMA-only transfer family
+	int findDedicatedQueueFamilyIndex(VkPhysicalDevice physicalDevice, VkFlags queueFlags, VkFlags excludedFlags)
+	{
+		uint32_t queueFamilyCount = 0;
+		vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+		
+		std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+		vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
+		
+		int i = 0;
+		for (const auto &queueFamily : queueFamilies)
+		{
+			if (queueFamily.queueCount > 0 && (queueFamily.queueFlags & queueFlags) == queueFlags && (queueFamily.queueFlags & excludedFlags) == 0)
+			{
+				return i;
+			}
+			
+			++i;
+		}
+		
+		return -1;
+	}
+	
+	VkAccessFlags accessMaskForLayout(VkImageLayout layout)
+	{
+		switch (layout)
+		{
+			case VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL:
+				return VK_ACCESS_TRANSFER_WRITE_BIT;
+			
+			case VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL:
+				return VK_ACCESS_TRANSFER_READ_BIT;
+			
+			case VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL:
+				return VK_ACCESS_SHADER_READ_BIT;
+			
+			default:
+				return 0;
+		};
+	}
+	
+	bool supportsStorage16Bit(VkPhysicalDevice physicalDevice)
+	{
+		VkPhysicalDeviceVulkan11Features features11 = {};
+		features11.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES;
+		
+		VkPhysicalDeviceFeatures2 features = {};
+		features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+		features.pNext = &features11;
+		
+		vkGetPhysicalDeviceFeatures2(physicalDevice, &features);
+		
+		return features11.storageBuffer16BitAccess == VK_TRUE;
+	}
+	
+	bool supportsTimelineSemaphores(VkPhysicalDevice physicalDevice)
+	{
+		VkPhysicalDeviceProperties deviceProperties;
+		vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
+		
+		if (deviceProperties.apiVersion < VK_API_VERSION_1_2)
+			return false;
+		
+		VkPhysicalDeviceVulkan12Features features12 = {};
+		features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+		
+		VkPhysicalDeviceFeatures2 features = {};
+		features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+		features.pNext = &features12;
+		
+		vkGetPhysicalDeviceFeatures2(physicalDevice, &features);
+		
+		return features12.timelineSemaphore == VK_TRUE;
+	}
+	
+	bool supportsHostQueryReset(VkPhysicalDevice physicalDevice)
+	{
+		VkPhysicalDeviceVulkan12Features features12 = {};
+		features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+		
+		VkPhysicalDeviceFeatures2 features = {};
+		features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+		features.pNext = &features12;
+		
+		vkGetPhysicalDeviceFeatures2(physicalDevice, &features);
+		
+		return features12.hostQueryReset == VK_TRUE;
+	}
+	
 	VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback
 	(
 		VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity, 
@@ -142,7 +268,7 @@ void Device::create()
 	appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
 	appInfo.pEngineName = "No Engine";
 	appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-	appInfo.apiVersion = VK_API_VERSION_1_0;
+	appInfo.apiVersion = VK_API_VERSION_1_2;
 	
 	VkInstanceCreateInfo instanceCreateInfo = {};
 	instanceCreateInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
@@ -196,40 +322,67 @@ void Device::create()
 	std::vector<VkPhysicalDevice> physicaldevices(physicalDeviceCount);
 	vkEnumeratePhysicalDevices(_instance, &physicalDeviceCount, physicaldevices.data());
 	
+	// Discrete GPUs first, other devices (integrated GPUs, CPU implementations like lavapipe) after them
+	std::vector<VkPhysicalDevice> candidates;
 	for (auto physicalDevice : physicaldevices)
 	{
-		VkPhysicalDeviceProperties deviceProperties;
-		vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
-		
-		if (deviceProperties.deviceType != VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU)
+		if (findQueueFamilyIndex(physicalDevice, VK_QUEUE_COMPUTE_BIT) < 0)
 			continue;
 		
-		int computeQueueFamilyIndex = findQueueFamilyIndex(physicalDevice, VK_QUEUE_COMPUTE_BIT);
-		
-		if (computeQueueFamilyIndex < 0)
+		if (! supportsTimelineSemaphores(physicalDevice))
 			continue;
 		
-		_physicalDevice = physicalDevice;
-		_computeQueueFamilyIndex = computeQueueFamilyIndex;
-		break;
+		candidates.push_back(physicalDevice);
+	}
+	
+	std::stable_sort(candidates.begin(), candidates.end(), [] (VkPhysicalDevice a, VkPhysicalDevice b) {
+		VkPhysicalDeviceProperties pa, pb;
+		vkGetPhysicalDeviceProperties(a, &pa);
+		vkGetPhysicalDeviceProperties(b, &pb);
+		return (pa.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) && (pb.deviceType != VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU);
+	});
+	
+	_physicalDeviceCount = (uint32_t)candidates.size();
+	
+	if (candidates.empty())
+	{
+		throw std::runtime_error("wvk::Device - failed to find GPU with compute support and timeline semaphores");
 	}
 	
-	if (_physicalDevice == VK_NULL_HANDLE || _computeQueueFamilyIndex < 0)
+	if (_physicalDeviceIndex < 0 || _physicalDeviceIndex >= (int)candidates.size())
 	{
-		throw std::runtime_error("wvk::Device - failed to find discrete GPU with compute support");
+		char buffer[1024];
+		sprintf(buffer, "wvk::Device - invalid physical device index %d (%d available)", _physicalDeviceIndex, (int)candidates.size());
+		throw std::runtime_error(buffer);
 	}
 	
+	_physicalDevice = candidates[_physicalDeviceIndex];
+	vkGetPhysicalDeviceProperties(_physicalDevice, &_properties);
+	
+	_computeQueueFamilyIndex = findQueueFamilyIndex(_physicalDevice, VK_QUEUE_COMPUTE_BIT);
+	_transferQueueFamilyIndex = findDedicatedQueueFamilyIndex(_physicalDevice, VK_QUEUE_TRANSFER_BIT, VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT);
+	if (_transferQueueFamilyIndex < 0)
+		_transferQueueFamilyIndex = _computeQueueFamilyIndex;
+	
+	uint32_t computeQueueCount = std::min(_requestedComputeQueueCount, queueFamilyQueueCount(_physicalDevice, _computeQueueFamilyIndex));
+	
 	std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
-	std::set<int> uniqueQueueFamilies = { _computeQueueFamilyIndex };
-
-	float queuePriority = 1.0f;
+	std::set<int> uniqueQueueFamilies = { _computeQueueFamilyIndex, _transferQueueFamilyIndex };
+	
+	_queueFamilyIndices.clear();
+	for (int queueFamily : uniqueQueueFamilies)
+	{
+		_queueFamilyIndices.push_back((uint32_t)queueFamily);
+	}
+	
+	std::vector<float> queuePriorities(computeQueueCount, 1.0f);
 	for (int queueFamily : uniqueQueueFamilies)
 	{
 		VkDeviceQueueCreateInfo queueCreateInfo = {};
 		queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
 		queueCreateInfo.queueFamilyIndex = queueFamily;
-		queueCreateInfo.queueCount = 1;
-		queueCreateInfo.pQueuePriorities = &queuePriority;
+		queueCreateInfo.queueCount = (queueFamily == _computeQueueFamilyIndex) ? computeQueueCount : 1;
+		queueCreateInfo.pQueuePriorities = queuePriorities.data();
 		queueCreateInfos.push_back(queueCreateInfo);
 	}
 	
@@ -241,6 +394,22 @@ void Device::create()
 	VkPhysicalDeviceFeatures deviceFeatures = {};
 	deviceCreateInfo.pEnabledFeatures = &deviceFeatures;
 	
+	VkPhysicalDeviceVulkan12Features features12 = {};
+	features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+	features12.timelineSemaphore = VK_TRUE;
+	deviceCreateInfo.pNext = &features12;
+	
+	// Profiler queries are reset from the host, between submissions of reusable command buffers
+	_hostQueryResetEnabled = supportsHostQueryReset(_physicalDevice);
+	features12.hostQueryReset = _hostQueryResetEnabled ? VK_TRUE : VK_FALSE;
+	
+	_storage16BitEnabled = _storage16BitRequested && supportsStorage16Bit(_physicalDevice);
+	
+	VkPhysicalDeviceVulkan11Features features11 = {};
+	features11.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES;
+	features11.storageBuffer16BitAccess = _storage16BitEnabled ? VK_TRUE : VK_FALSE;
+	features12.pNext = &features11;
+	
 	deviceCreateInfo.enabledLayerCount = static_cast<uint32_t>(_instanceLayers.size());
 	deviceCreateInfo.ppEnabledLayerNames = _instanceLayers.empty() ? nullptr : _instanceLayers.data();
 	deviceCreateInfo.enabledExtensionCount = static_cast<uint32_t>(_deviceExtensions.size());
@@ -251,22 +420,20 @@ void Device::create()
 		throw std::runtime_error("wvk::Device - failed to create logical device");
 	}
 	
-	vkGetDeviceQueue(_device, _computeQueueFamilyIndex, 0, &_computeQueue);
-	
-	VkCommandPoolCreateInfo commandPoolCreateInfo = {};
-	commandPoolCreateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-	commandPoolCreateInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-	commandPoolCreateInfo.queueFamilyIndex = _computeQueueFamilyIndex;
-	
-	if (vkCreateCommandPool(_device, &commandPoolCreateInfo, nullptr, &_computeCommandPool) != VK_SUCCESS)
+	_computeQueues.resize(computeQueueCount);
+	for (uint32_t i = 0; i < computeQueueCount; ++i)
 	{
-		throw std::runtime_error("wvk::Device - failed to create compute command pool");
+		vkGetDeviceQueue(_device, _computeQueueFamilyIndex, i, &_computeQueues[i]);
 	}
 	
+	_computeQueue = _computeQueues[0];
+	vkGetDeviceQueue(_device, _transferQueueFamilyIndex, 0, &_transferQueue);
+	
 	_memoryManager = new DeviceMemoryManager(this);
 	_bufferManager = new BufferManager(this);
 	_imageManager = new ImageManager(this);
 	_computePipelineManager = new ComputePipelineManager(this);
+	_profiler = new Profiler(this);
 }
 
 void Device::destroy()
@@ -285,19 +452,27 @@ void Device::destroy()
 		delete _memoryManager;
 		_memoryManager = nullptr;
 		
-		destroyAllCommandBuffers();
+		vkDeviceWaitIdle(_device);
+		
+		delete _profiler;
+		_profiler = nullptr;
+		
+		destroyAllCommandPools();
+		destroyAllFences();
 		destroyAllPipelineLayouts();
 		destroyAllDescriptorSetLayouts();
 		destroyAllShaderModules();
 		
-		vkDestroyCommandPool(_device, _computeCommandPool, nullptr);
-		_computeCommandPool = VK_NULL_HANDLE;
-		
 		vkDestroyDevice(_device, nullptr);
 		_device = VK_NULL_HANDLE;
 		_physicalDevice = VK_NULL_HANDLE;
 		_computeQueueFamilyIndex = -1;
 		_computeQueue = VK_NULL_HANDLE;
+		_computeQueues.clear();
+		_storage16BitEnabled = false;
+		_transferQueueFamilyIndex = -1;
+		_transferQueue = VK_NULL_HANDLE;
+		_queueFamilyIndices.clear();
 	}
 	
 	if (_instance != VK_NULL_HANDLE)
@@ -319,11 +494,9 @@ void Device::destroy()
 	}
 }
 
-const std::string _beginSingleTimeCommandsKey = "single time commands";
-
 Device::CommandBuffer *Device::beginSingleTimeCommands()
 {
-	CommandBuffer *cb = getOrCreateComputeCommandBuffer(_beginSingleTimeCommandsKey);
+	CommandBuffer *cb = acquireCommandBuffer(QueueType::COMPUTE);
 	beginRecordCommands(cb, VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
 	return cb;
 }
@@ -332,9 +505,14 @@ void Device::endSingleTimeCommands(Device::CommandBuffer *cb)
 {
 	endRecordCommands(cb);
 	submitComputeCommands(cb);
-	waitComputeQueueIdle();
 	
-	destroyComputeCommandBuffer(_beginSingleTimeCommandsKey);
+	// Only this submission is waited for, not the whole queue
+	if (vkWaitForFences(_device, 1, &cb->_fence, VK_TRUE, ~0ull) != VK_SUCCESS)
+	{
+		throw std::runtime_error("wvk::Device - failed to wait for single time commands");
+	}
+	
+	releaseCommandBuffer(cb);
 }
 
 const Device::ShaderModule &Device::getOrCreateShaderModule(const std::string &spvFileName)
@@ -363,7 +541,7 @@ const Device::ShaderModule &Device::getOrCreateShaderModule(const std::string &s
 	createInfo.flags = 0;
 	createInfo.codeSize = len;
 	createInfo.pCode = reinterpret_cast<const uint32_t *>(buffer);
-
+	
 	VkShaderModule shaderModule;
 	if (vkCreateShaderModule(_device, &createInfo, nullptr, &shaderModule) != VK_SUCCESS)
 	{
@@ -422,16 +600,42 @@ void Device::destroyAllPipelineLayouts()
 	_registeredPipelineLayouts.clear();
 }
 
-Device::CommandBuffer *Device::getOrCreateComputeCommandBuffer(const std::string &key)
+Device::CommandPool &Device::threadCommandPool(QueueType queue)
 {
-	auto it = _computeCommandBuffers.find(key);
-	if (it != _computeCommandBuffers.end())
-		return &it->second;
+	ThreadCommandPoolsCache &cache = _threadCommandPoolsCache;
+	if (cache._poolsId != _poolsId)
+	{
+		std::lock_guard<std::mutex> lock(_threadCommandPoolsMutex);
+		cache._pools = &_threadCommandPools[std::this_thread::get_id()];
+		cache._poolsId = _poolsId;
+	}
+	
+	CommandPool &pool = (queue == QueueType::TRANSFER) ? cache._pools->_transfer : cache._pools->_compute;
+	
+	// Only this thread creates or destroys its pools
+	if (pool._handle == VK_NULL_HANDLE)
+	{
+		VkCommandPoolCreateInfo commandPoolCreateInfo = {};
+		commandPoolCreateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+		commandPoolCreateInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+		commandPoolCreateInfo.queueFamilyIndex = (queue == QueueType::TRANSFER) ? _transferQueueFamilyIndex : _computeQueueFamilyIndex;
+		pool._queueFamilyIndex = commandPoolCreateInfo.queueFamilyIndex;
+		
+		if (vkCreateCommandPool(_device, &commandPoolCreateInfo, nullptr, &pool._handle) != VK_SUCCESS)
+		{
+			throw std::runtime_error("wvk::Device - failed to create command pool");
+		}
+	}
 	
+	return pool;
+}
+
+Device::CommandBuffer *Device::createCommandBuffer(CommandPool &pool)
+{
 	VkCommandBufferAllocateInfo allocInfo = {};
 	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
 	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-	allocInfo.commandPool = _computeCommandPool;
+	allocInfo.commandPool = pool._handle;
 	allocInfo.commandBufferCount = 1;
 	
 	VkCommandBuffer commandBuffer;
@@ -440,29 +644,178 @@ Device::CommandBuffer *Device::getOrCreateComputeCommandBuffer(const std::string
 		throw std::runtime_error("wvk::Device - failed to allocate command buffer");
 	}
 	
-	CommandBuffer &cb = _computeCommandBuffers[key];
+	pool._commandBuffers.push_back(CommandBuffer());
+	CommandBuffer &cb = pool._commandBuffers.back();
 	cb._buffer = commandBuffer;
 	cb._state = CommandBuffer::State::UNDEFINED;
+	cb._pool = &pool;
 	
 	return &cb;
 }
 
-void Device::destroyComputeCommandBuffer(const std::string &key)
+Device::CommandBuffer *Device::allocateCommandBuffer(QueueType queue)
 {
-	auto it = _computeCommandBuffers.find(key);
-	if (it != _computeCommandBuffers.end())
+	return createCommandBuffer(threadCommandPool(queue));
+}
+
+void Device::freeCommandBuffer(CommandBuffer *cb)
+{
+	CommandPool &pool = *cb->_pool;
+	
+	vkFreeCommandBuffers(_device, pool._handle, 1, &cb->_buffer);
+	
+	for (auto it = pool._commandBuffers.begin(); it != pool._commandBuffers.end(); ++it)
 	{
-		vkFreeCommandBuffers(_device, _computeCommandPool, 1, &it->second._buffer);
-		_computeCommandBuffers.erase(it);
+		if (&*it == cb)
+		{
+			pool._commandBuffers.erase(it);
+			break;
+		}
 	}
 }
 
-void Device::destroyAllCommandBuffers()
+Device::CommandBuffer *Device::acquireCommandBuffer(QueueType queue)
 {
-	while (! _computeCommandBuffers.empty())
+	CommandPool &pool = threadCommandPool(queue);
+	recycle(pool);
+	
+	if (pool._available.empty())
 	{
-		destroyComputeCommandBuffer(_computeCommandBuffers.begin()->first);
+		CommandBuffer *cb = createCommandBuffer(pool);
+		cb->_fence = acquireFence();
+		return cb;
 	}
+	
+	CommandBuffer *cb = pool._available.back();
+	pool._available.pop_back();
+	return cb;
+}
+
+void Device::releaseCommandBuffer(CommandBuffer *cb)
+{
+	if (cb->_state == CommandBuffer::State::SUBMITTED)
+	{
+		cb->_pool->_pending.push_back(cb);
+	}
+	else
+	{
+		cb->_pool->_available.push_back(cb);
+	}
+}
+
+void Device::recycle(CommandPool &pool)
+{
+	for (size_t i = 0; i < pool._pending.size(); )
+	{
+		CommandBuffer *cb = pool._pending[i];
+		
+		if (vkGetFenceStatus(_device, cb->_fence) != VK_SUCCESS)
+		{
+			++i;
+			continue;
+		}
+		
+		// The command buffer itself is reset by the next vkBeginCommandBuffer
+		vkResetFences(_device, 1, &cb->_fence);
+		cb->_state = CommandBuffer::State::UNDEFINED;
+		
+		pool._available.push_back(cb);
+		pool._pending[i] = pool._pending.back();
+		pool._pending.pop_back();
+	}
+}
+
+void Device::destroyThreadCommandPools()
+{
+	if (_threadCommandPoolsCache._poolsId == _poolsId)
+		_threadCommandPoolsCache = ThreadCommandPoolsCache();
+	
+	std::lock_guard<std::mutex> lock(_threadCommandPoolsMutex);
+	
+	auto it = _threadCommandPools.find(std::this_thread::get_id());
+	if (it == _threadCommandPools.end())
+		return;
+	
+	for (CommandPool *pool : { &it->second._compute, &it->second._transfer })
+	{
+		for (CommandBuffer &cb : pool->_commandBuffers)
+		{
+			if (cb._fence != VK_NULL_HANDLE)
+				releaseFence(cb._fence);
+		}
+		
+		if (pool->_handle != VK_NULL_HANDLE)
+		{
+			vkDestroyCommandPool(_device, pool->_handle, nullptr);
+		}
+	}
+	
+	_threadCommandPools.erase(it);
+}
+
+void Device::destroyAllCommandPools()
+{
+	std::lock_guard<std::mutex> lock(_threadCommandPoolsMutex);
+	
+	for (auto &item : _threadCommandPools)
+	{
+		for (CommandPool *pool : { &item.second._compute, &item.second._transfer })
+		{
+			if (pool->_handle != VK_NULL_HANDLE)
+			{
+				vkDestroyCommandPool(_device, pool->_handle, nullptr);
+			}
+		}
+	}
+	
+	_threadCommandPools.clear();
+	_poolsId = nextPoolsId++;
+}
+
+VkFence Device::acquireFence()
+{
+	std::lock_guard<std::mutex> lock(_fencesMutex);
+	
+	if (! _availableFences.empty())
+	{
+		VkFence fence = _availableFences.back();
+		_availableFences.pop_back();
+		return fence;
+	}
+	
+	VkFenceCreateInfo fenceCreateInfo = {};
+	fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	fenceCreateInfo.flags = 0;
+	
+	VkFence fence;
+	if (vkCreateFence(_device, &fenceCreateInfo, nullptr, &fence) != VK_SUCCESS)
+	{
+		throw std::runtime_error("wvk::Device - failed to create fence");
+	}
+	
+	_fences.push_back(fence);
+	return fence;
+}
+
+void Device::releaseFence(VkFence fence)
+{
+	vkResetFences(_device, 1, &fence);
+	
+	std::lock_guard<std::mutex> lock(_fencesMutex);
+	_availableFences.push_back(fence);
+}
+
+void Device::destroyAllFences()
+{
+	std::lock_guard<std::mutex> lock(_fencesMutex);
+	
+	for (VkFence fence : _fences)
+	{
+		vkDestroyFence(_device, fence, nullptr);
+	}
+	
+	_fences.clear();
+	_availableFences.clear();
 }
 
 void Device::beginRecordCommands(CommandBuffer *cb, VkCommandBufferUsageFlags usage)
@@ -483,18 +836,126 @@ void Device::endRecordCommands(CommandBuffer *cb)
 
 void Device::submitComputeCommands(CommandBuffer *cb, VkFence fence)
 {
+	submit(_computeQueue, cb, TimelinePoint(), 0, TimelinePoint(), fence);
+}
+
+void Device::waitComputeQueueIdle()
+{
+	std::lock_guard<std::mutex> lock(_queueMutex);
+	vkQueueWaitIdle(_computeQueue);
+}
+
+VkSemaphore Device::createTimelineSemaphore(uint64_t initialValue)
+{
+	VkSemaphoreTypeCreateInfo typeCreateInfo = {};
+	typeCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+	typeCreateInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+	typeCreateInfo.initialValue = initialValue;
+	
+	VkSemaphoreCreateInfo createInfo = {};
+	createInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+	createInfo.pNext = &typeCreateInfo;
+	
+	VkSemaphore semaphore;
+	if (vkCreateSemaphore(_device, &createInfo, nullptr, &semaphore) != VK_SUCCESS)
+	{
+		throw std::runtime_error("wvk::Device - failed to create timeline semaphore");
+	}
+	
+	return semaphore;
+}
+
+void Device::destroySemaphore(VkSemaphore semaphore)
+{
+	vkDestroySemaphore(_device, semaphore, nullptr);
+}
+
+uint64_t Device::getTimelineValue(VkSemaphore semaphore)
+{
+	uint64_t value = 0;
+	if (vkGetSemaphoreCounterValue(_device, semaphore, &value) != VK_SUCCESS)
+	{
+		throw std::runtime_error("wvk::Device - failed to get timeline semaphore value");
+	}
+	return value;
+}
+
+void Device::waitTimeline(const TimelinePoint &point)
+{
+	if (point._semaphore == VK_NULL_HANDLE)
+		return;
+	
+	VkSemaphoreWaitInfo waitInfo = {};
+	waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+	waitInfo.semaphoreCount = 1;
+	waitInfo.pSemaphores = &point._semaphore;
+	waitInfo.pValues = &point._value;
+	
+	if (vkWaitSemaphores(_device, &waitInfo, ~0ull) != VK_SUCCESS)
+	{
+		throw std::runtime_error("wvk::Device - failed to wait for timeline semaphore");
+	}
+}
+
+void Device::submitComputeCommands(CommandBuffer *cb, const TimelinePoint &wait, VkPipelineStageFlags waitStage, const TimelinePoint &signal, VkFence fence)
+{
+	submit(_computeQueue, cb, wait, waitStage, signal, fence);
+}
+
+void Device::submitComputeCommands(uint32_t queueIndex, CommandBuffer *cb, const TimelinePoint &wait, VkPipelineStageFlags waitStage, const TimelinePoint &signal, VkFence fence)
+{
+	submit(_computeQueues[queueIndex], cb, wait, waitStage, signal, fence);
+}
+
+void Device::submitTransferCommands(CommandBuffer *cb, const TimelinePoint &wait, VkPipelineStageFlags waitStage, const TimelinePoint &signal, VkFence fence)
+{
+	submit(_transferQueue, cb, wait, waitStage, signal, fence);
+}
+
+void Device::submit(VkQueue queue, CommandBuffer *cb, const TimelinePoint &wait, VkPipelineStageFlags waitStage, const TimelinePoint &signal, VkFence fence)
+{
+	VkTimelineSemaphoreSubmitInfo timelineInfo = {};
+	timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+	
 	VkSubmitInfo submitInfo = {};
 	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.pNext = &timelineInfo;
 	submitInfo.commandBufferCount = 1;
 	submitInfo.pCommandBuffers = &cb->_buffer;
 	
-	vkQueueSubmit(_computeQueue, 1, &submitInfo, fence);
+	if (wait._semaphore != VK_NULL_HANDLE)
+	{
+		submitInfo.waitSemaphoreCount = 1;
+		submitInfo.pWaitSemaphores = &wait._semaphore;
+		submitInfo.pWaitDstStageMask = &waitStage;
+		timelineInfo.waitSemaphoreValueCount = 1;
+		timelineInfo.pWaitSemaphoreValues = &wait._value;
+	}
+	
+	if (signal._semaphore != VK_NULL_HANDLE)
+	{
+		submitInfo.signalSemaphoreCount = 1;
+		submitInfo.pSignalSemaphores = &signal._semaphore;
+		timelineInfo.signalSemaphoreValueCount = 1;
+		timelineInfo.pSignalSemaphoreValues = &signal._value;
+	}
+	
+	// Transient command buffers always signal their own fence, the pool recycles them once it has
+	VkFence submitFence = (cb->_fence != VK_NULL_HANDLE) ? cb->_fence : fence;
+	
+	std::lock_guard<std::mutex> lock(_queueMutex);
+	
+	if (vkQueueSubmit(queue, 1, &submitInfo, submitFence) != VK_SUCCESS)
+	{
+		throw std::runtime_error("wvk::Device - failed to submit command buffer");
+	}
 	cb->_state = CommandBuffer::State::SUBMITTED;
-}
-
-void Device::waitComputeQueueIdle()
-{
-	vkQueueWaitIdle(_computeQueue);
+	
+	// The fence of the caller as well, signalled by an empty submission once the work submitted before it completes
+	if (submitFence != fence && fence != VK_NULL_HANDLE && vkQueueSubmit(queue, 0, nullptr, fence) != VK_SUCCESS)
+	{
+		throw std::runtime_error("wvk::Device - failed to submit fence");
+	}
 }
 
 void Device::copy(CommandBuffer *cb, Buffer *src, Buffer *dst)
@@ -547,9 +1008,14 @@ void Device::copy(CommandBuffer *cb, Image *src, Image *dst)
 }
 
 void Device::copy(CommandBuffer *cb, Buffer *src, Image *dst)
+{
+	copy(cb, src, (VkDeviceSize)0, dst);
+}
+
+void Device::copy(CommandBuffer *cb, Buffer *src, VkDeviceSize srcOffset, Image *dst)
 {
 	VkBufferImageCopy copyRegion = {};
-	copyRegion.bufferOffset = 0;
+	copyRegion.bufferOffset = srcOffset;
 	copyRegion.bufferRowLength = 0;
 	copyRegion.bufferImageHeight = 0;
 	copyRegion.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -605,8 +1071,8 @@ void Device::commit(CommandBuffer *cb, Image *image, VkImageLayout newLayout, Vk
 	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
 	barrier.image = *image;
 	
-	barrier.srcAccessMask = 0;
-	barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.srcAccessMask = accessMaskForLayout(image->_layout);
+	barrier.dstAccessMask = accessMaskForLayout(newLayout);
 	
 	vkCmdPipelineBarrier(
 		*cb, 				// command buffer
@@ -621,4 +1087,43 @@ void Device::commit(CommandBuffer *cb, Image *image, VkImageLayout newLayout, Vk
 	image->_layout = newLayout;
 }
 
+void Device::release(CommandBuffer *cb, Image *image, VkImageLayout newLayout, VkPipelineStageFlags srcStageMask, uint32_t srcQueueFamilyIndex, uint32_t dstQueueFamilyIndex)
+{
+	VkImageMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	
+	// Whole image
+	barrier.subresourceRange = {};
+	barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	barrier.subresourceRange.baseMipLevel = 0;
+	barrier.subresourceRange.levelCount = 1;
+	barrier.subresourceRange.baseArrayLayer = 0;
+	barrier.subresourceRange.layerCount = 1;
+	
+	barrier.oldLayout = image->_layout;
+	barrier.newLayout = newLayout;
+	barrier.image = *image;
+	
+	// Concurrent images are owned by every family of the device, there is nothing to transfer
+	const bool transfer = image->_ci.sharingMode == VK_SHARING_MODE_EXCLUSIVE && srcQueueFamilyIndex != dstQueueFamilyIndex;
+	barrier.srcQueueFamilyIndex = transfer ? srcQueueFamilyIndex : VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = transfer ? dstQueueFamilyIndex : VK_QUEUE_FAMILY_IGNORED;
+	
+	// Accesses of the other queue are not in scope of a barrier recorded on this one
+	barrier.srcAccessMask = accessMaskForLayout(image->_layout);
+	barrier.dstAccessMask = 0;
+	
+	vkCmdPipelineBarrier(
+		*cb, 								// command buffer
+		srcStageMask, 					// source stage mask
+		VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 	// destination stage mask
+		0, 								// dependency flags
+		0, nullptr, 					// memory barriers
+		0, nullptr, 					// buffer memory barriers
+		1, &barrier 					// image memory barriers
+	);
+	
+	image->_layout = newLayout;
+}
+
 }; // namespace wvk
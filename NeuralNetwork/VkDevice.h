@@ -3,8 +3,11 @@
 
 #include <vulkan/vulkan.h>
 #include <vector>
+#include <list>
 #include <map>
 #include <string>
+#include <mutex>
+#include <thread>
 
 namespace wvk
 {
@@ -14,6 +17,7 @@ class Buffer;
 class ImageManager;
 class Image;
 class ComputePipelineManager;
+class Profiler;
 
 class Device
 {
@@ -23,6 +27,17 @@ public:
 	
 	void setValidationEnabled(bool enabled);
 	
+	// Index among the devices with compute support and timeline semaphores, discrete GPUs first.
+	// Several wvk::Device may be created on the same physical device.
+	void setPhysicalDeviceIndex(int index);
+	
+	// Number of compute queues to create, clamped to what the compute queue family exposes
+	void setComputeQueueCount(uint32_t count);
+	
+	// 16-bit types in storage buffers (VK_KHR_16bit_storage, core in Vulkan 1.1), enabled only when supported
+	void setStorage16BitEnabled(bool enabled);
+	bool storage16BitEnabled() const { return _storage16BitEnabled; }
+	
 	void create();
 	void destroy();
 	
@@ -31,6 +46,18 @@ public:
 	ImageManager *imageManager() { return _imageManager; }
 	ComputePipelineManager *computePipelineManager() { return _computePipelineManager; }
 	
+	// Timestamp profiler, disabled until Profiler::setEnabled(true)
+	Profiler *profiler() { return _profiler; }
+	bool hostQueryResetEnabled() const { return _hostQueryResetEnabled; }
+	
+	enum class QueueType
+	{
+		COMPUTE, 
+		TRANSFER
+	};
+	
+	struct CommandPool;
+	
 	struct CommandBuffer
 	{
 		VkCommandBuffer _buffer;
@@ -45,18 +72,75 @@ public:
 		
 		State _state;
 		
+		// Owning pool, and for transient command buffers the fence signalled by their last submission
+		CommandPool *_pool = nullptr;
+		VkFence _fence = VK_NULL_HANDLE;
+		
 		operator VkCommandBuffer () { return _buffer; }
 	};
 	
-	CommandBuffer *getOrCreateComputeCommandBuffer(const std::string &key);
-	void destroyComputeCommandBuffer(const std::string &key);
-	void destroyAllCommandBuffers();
+	struct CommandPool
+	{
+		VkCommandPool _handle = VK_NULL_HANDLE;
+		uint32_t _queueFamilyIndex = 0;
+		
+		using CommandBufferList = std::list<CommandBuffer>;
+		CommandBufferList _commandBuffers;
+		
+		// Transient command buffers ready to use, and released ones waiting for their fence
+		std::vector<CommandBuffer *> _available;
+		std::vector<CommandBuffer *> _pending;
+	};
+	
+	// Command pools are per thread, command buffers must be recorded and released on the thread that got them.
+	// Reusable command buffer, recorded once and submitted as many times as needed
+	CommandBuffer *allocateCommandBuffer(QueueType queue);
+	void freeCommandBuffer(CommandBuffer *cb);
+	
+	// Transient command buffer, back in the pool once released and its submission has completed
+	CommandBuffer *acquireCommandBuffer(QueueType queue);
+	void releaseCommandBuffer(CommandBuffer *cb);
+	
+	// Destroys the command pools of the calling thread, worker threads call it before exiting
+	void destroyThreadCommandPools();
+	
+	VkFence acquireFence();
+	void releaseFence(VkFence fence);
 	
 	void beginRecordCommands(CommandBuffer *cb, VkCommandBufferUsageFlags usage);
 	void endRecordCommands(CommandBuffer *cb);
 	void submitComputeCommands(CommandBuffer *cb, VkFence fence = VK_NULL_HANDLE);
 	void waitComputeQueueIdle();
 	
+	// A point on a timeline semaphore, a null semaphore means "none"
+	struct TimelinePoint
+	{
+		VkSemaphore _semaphore = VK_NULL_HANDLE;
+		uint64_t _value = 0;
+	};
+	
+	VkSemaphore createTimelineSemaphore(uint64_t initialValue = 0);
+	void destroySemaphore(VkSemaphore semaphore);
+	uint64_t getTimelineValue(VkSemaphore semaphore);
+	void waitTimeline(const TimelinePoint &point);
+	
+	void submitComputeCommands(CommandBuffer *cb, const TimelinePoint &wait, VkPipelineStageFlags waitStage, const TimelinePoint &signal, VkFence fence = VK_NULL_HANDLE);
+	void submitComputeCommands(uint32_t queueIndex, CommandBuffer *cb, const TimelinePoint &wait, VkPipelineStageFlags waitStage, const TimelinePoint &signal, VkFence fence = VK_NULL_HANDLE);
+	void submitTransferCommands(CommandBuffer *cb, const TimelinePoint &wait, VkPipelineStageFlags waitStage, const TimelinePoint &signal, VkFence fence = VK_NULL_HANDLE);
+	
+	// The transfer queue is the compute queue when the device has no dedicated transfer family
+	int computeQueueFamilyIndex() const { return _computeQueueFamilyIndex; }
+	int transferQueueFamilyIndex() const { return _transferQueueFamilyIndex; }
+	bool hasDedicatedTransferQueue() const { return _transferQueueFamilyIndex != _computeQueueFamilyIndex; }
+	
+	// Queue families resources must be shared between (concurrent sharing mode when more than one)
+	const std::vector<uint32_t> &queueFamilyIndices() const { return _queueFamilyIndices; }
+	
+	// Suitable physical devices found by create(), valid values for setPhysicalDeviceIndex()
+	uint32_t physicalDeviceCount() const { return _physicalDeviceCount; }
+	uint32_t computeQueueCount() const { return (uint32_t)_computeQueues.size(); }
+	const VkPhysicalDeviceProperties &properties() const { return _properties; }
+	
 	CommandBuffer *beginSingleTimeCommands();
 	void endSingleTimeCommands(CommandBuffer *cb);
 	
@@ -87,10 +171,16 @@ public:
 	
 	void copy(CommandBuffer *cb, Image *src, Image *dst);
 	void copy(CommandBuffer *cb, Buffer *src, Image *dst);
+	void copy(CommandBuffer *cb, Buffer *src, VkDeviceSize srcOffset, Image *dst);
 	void copy(CommandBuffer *cb, Image *src, Buffer *dst);
 	
 	void commit(CommandBuffer *cb, Image *image, VkImageLayout newLayout, VkPipelineStageFlags srcStageMask, VkPipelineStageFlags dstStageMask);
 	
+	// Last barrier of an image on the queue of cb before a queue of dstQueueFamilyIndex uses it: layout transition and,
+	// for an exclusive image, ownership release. Nothing is made visible here, the other queue waits on a semaphore
+	// (and acquires the ownership of an exclusive image with the matching barrier).
+	void release(CommandBuffer *cb, Image *image, VkImageLayout newLayout, VkPipelineStageFlags srcStageMask, uint32_t srcQueueFamilyIndex, uint32_t dstQueueFamilyIndex);
+	
 	std::vector<const char *> _instanceExtensions;
 	std::vector<const char *> _instanceLayers;
 	std::vector<const char *> _deviceExtensions;
@@ -109,16 +199,62 @@ protected:
 		VkPipelineStageFlags dstStageMask
 	);
 	
+	void submit(VkQueue queue, CommandBuffer *cb, const TimelinePoint &wait, VkPipelineStageFlags waitStage, const TimelinePoint &signal, VkFence fence);
+	
+	CommandPool &threadCommandPool(QueueType queue);
+	CommandBuffer *createCommandBuffer(CommandPool &pool);
+	void recycle(CommandPool &pool);
+	void destroyAllCommandPools();
+	void destroyAllFences();
+	
 	VkInstance _instance = VK_NULL_HANDLE;
 	VkPhysicalDevice _physicalDevice = VK_NULL_HANDLE;
 	VkDevice _device = VK_NULL_HANDLE;
+	int _physicalDeviceIndex = 0;
+	uint32_t _physicalDeviceCount = 0;
+	VkPhysicalDeviceProperties _properties = {};
 	int _computeQueueFamilyIndex = -1;
 	VkQueue _computeQueue = VK_NULL_HANDLE;
+	uint32_t _requestedComputeQueueCount = 1;
+	bool _storage16BitRequested = false;
+	bool _storage16BitEnabled = false;
+	bool _hostQueryResetEnabled = false;
+	std::vector<VkQueue> _computeQueues;
+	int _transferQueueFamilyIndex = -1;
+	VkQueue _transferQueue = VK_NULL_HANDLE;
+	std::vector<uint32_t> _queueFamilyIndices;
+	
+	// Queues are externally synchronized, and the transfer queue may be one of the compute queues
+	std::mutex _queueMutex;
 	
 	bool _validationEnabled = false;
 	VkDebugUtilsMessengerEXT _debugMessenger = VK_NULL_HANDLE;
 	
-	VkCommandPool _computeCommandPool = VK_NULL_HANDLE;
+	struct ThreadCommandPools
+	{
+		CommandPool _compute;
+		CommandPool _transfer;
+	};
+	
+	using ThreadCommandPoolMap = std::map<std::thread::id, ThreadCommandPools>;
+	ThreadCommandPoolMap _threadCommandPools;
+	std::mutex _threadCommandPoolsMutex;
+	
+	// Pools of the device the calling thread last asked for, found without the map and its mutex. Entries of the map
+	// do not move, the cache only goes stale when pools are destroyed: the thread's own ones reset it, destroying
+	// them all gives the device a new _poolsId.
+	struct ThreadCommandPoolsCache
+	{
+		uint64_t _poolsId = 0;
+		ThreadCommandPools *_pools = nullptr;
+	};
+	
+	static thread_local ThreadCommandPoolsCache _threadCommandPoolsCache;
+	uint64_t _poolsId;
+	
+	std::vector<VkFence> _fences;
+	std::vector<VkFence> _availableFences;
+	std::mutex _fencesMutex;
 	
 	using ShaderModules = std::map<std::string, ShaderModule>;
 	ShaderModules _shaderModules;
@@ -139,13 +275,11 @@ protected:
 	using PipelineLayouts = std::vector<PipelineLayout>;
 	PipelineLayouts _registeredPipelineLayouts;
 	
-	using CommandBuffers = std::map<std::string, CommandBuffer>;
-	CommandBuffers _computeCommandBuffers;
-	
 	wvk::DeviceMemoryManager *_memoryManager = nullptr;
 	wvk::BufferManager *_bufferManager = nullptr;
 	wvk::ImageManager *_imageManager = nullptr;
 	wvk::ComputePipelineManager *_computePipelineManager = nullptr;
+	wvk::Profiler *_profiler = nullptr;
 };
 
 }; // namespace wvk
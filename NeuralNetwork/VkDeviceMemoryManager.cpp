@@ -186,6 +186,8 @@ DeviceMemoryManager::DeviceMemory DeviceMemoryManager::allocate(VkMemoryProperty
 	if (chunk._size < _pageSize)
 		chunk._size = _pageSize;
 	chunk._mode = MemoryChunk::RangeMode::SORTED_BY_OFFSET;
+	chunk._mapped = nullptr;
+	chunk._mapCount = 0;
 	
 	VkMemoryAllocateInfo memAllocInfo = {};
 	memAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
@@ -239,19 +241,45 @@ void DeviceMemoryManager::release(DeviceMemory &dm)
 	}
 }
 
+DeviceMemoryManager::MemoryChunk *DeviceMemoryManager::findChunk(VkDeviceMemory deviceMemory)
+{
+	for (MemoryChunk &chunk : _memoryChunks)
+	{
+		if (chunk._deviceMemory == deviceMemory)
+			return &chunk;
+	}
+	
+	throw std::runtime_error("wvk::DeviceMemoryManager - unknown device memory");
+	return nullptr;
+}
+
 void *DeviceMemoryManager::map(const DeviceMemory &dm)
 {
-	void *data;
-	if (vkMapMemory(*_device, dm._deviceMemory, dm._offset, dm._size, 0, &data) != VK_SUCCESS)
+	// A VkDeviceMemory can only be mapped once, so ranges sharing a chunk share its mapping
+	MemoryChunk *chunk = findChunk(dm._deviceMemory);
+	
+	if (chunk->_mapCount == 0)
 	{
-		throw std::runtime_error("wvk::DeviceMemoryManager - failed to map device memory");
+		if (vkMapMemory(*_device, chunk->_deviceMemory, 0, VK_WHOLE_SIZE, 0, &chunk->_mapped) != VK_SUCCESS)
+		{
+			throw std::runtime_error("wvk::DeviceMemoryManager - failed to map device memory");
+		}
 	}
-	return data;
+	
+	++chunk->_mapCount;
+	return (uint8_t *)chunk->_mapped + dm._offset;
 }
 
 void DeviceMemoryManager::unmap(const DeviceMemory &dm)
 {
-	vkUnmapMemory(*_device, dm._deviceMemory);
+	MemoryChunk *chunk = findChunk(dm._deviceMemory);
+	
+	assert(chunk->_mapCount > 0);
+	if (--chunk->_mapCount == 0)
+	{
+		vkUnmapMemory(*_device, chunk->_deviceMemory);
+		chunk->_mapped = nullptr;
+	}
 }
 
 void DeviceMemoryManager::releaseUnusedPages()
@@ -38,6 +38,10 @@ public:
 		};
 		
 		RangeMode _mode;
+		
+		// The whole chunk is mapped once and shared by all its ranges
+		void *_mapped;
+		uint32_t _mapCount;
 	};
 	
 	struct DeviceMemory
@@ -58,6 +62,7 @@ public:
 	
 protected:
 	uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties);
+	MemoryChunk *findChunk(VkDeviceMemory deviceMemory);
 	
 	wvk::Device *_device;
 	
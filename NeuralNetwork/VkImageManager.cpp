@@ -149,6 +149,15 @@ Image *ImageManager::create3D(
 
 void ImageManager::create(Image &image, VkMemoryPropertyFlags properties)
 {
+	// Images are written by the transfer queue and read by the compute queue
+	const std::vector<uint32_t> &queueFamilies = _device->queueFamilyIndices();
+	if (queueFamilies.size() > 1)
+	{
+		image._ci.sharingMode = VK_SHARING_MODE_CONCURRENT;
+		image._ci.queueFamilyIndexCount = (uint32_t)queueFamilies.size();
+		image._ci.pQueueFamilyIndices = queueFamilies.data();
+	}
+	
 	if (vkCreateImage(*_device, &image._ci, nullptr, &image._handle) != VK_SUCCESS)
 	{
 		throw std::runtime_error("wvk::ImageManager - failed to create image");
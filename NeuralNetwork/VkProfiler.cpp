@@ -0,0 +1,296 @@
+#include "VkProfiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <stdexcept>
+#include <cstdio>
+
+namespace wvk
+{
+
+namespace
+{
+	void writeJsonString(FILE *file, const std::string &s)
+	{
+		fputc('"', file);
+		for (char c : s)
+		{
+			if (c == '"' || c == '\\')
+				fputc('\\', file);
+			fputc(c, file);
+		}
+		fputc('"', file);
+	}
+};
+
+const Profiler::Scope Profiler::NoScope;
+
+Profiler::Profiler(wvk::Device *device, uint32_t maxScopes)
+{
+	_device = device;
+	_maxScopes = maxScopes;
+	_period = _device->properties().limits.timestampPeriod;
+	
+	uint32_t queueFamilyCount = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(*_device, &queueFamilyCount, nullptr);
+	
+	std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+	vkGetPhysicalDeviceQueueFamilyProperties(*_device, &queueFamilyCount, queueFamilies.data());
+	
+	_validBits.resize(queueFamilyCount);
+	for (uint32_t i = 0; i < queueFamilyCount; ++i)
+	{
+		_validBits[i] = queueFamilies[i].timestampValidBits;
+	}
+}
+
+Profiler::~Profiler()
+{
+	if (_queryPool != VK_NULL_HANDLE)
+	{
+		vkDestroyQueryPool(*_device, _queryPool, nullptr);
+	}
+}
+
+void Profiler::setEnabled(bool enabled)
+{
+	// Calibration goes through the compute queue
+	bool supported = _device->hostQueryResetEnabled() && _validBits[_device->computeQueueFamilyIndex()] > 0 && _period > 0.0;
+	
+	if (enabled && supported && _queryPool == VK_NULL_HANDLE)
+	{
+		VkQueryPoolCreateInfo queryPoolCreateInfo = {};
+		queryPoolCreateInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+		queryPoolCreateInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+		queryPoolCreateInfo.queryCount = 2 * _maxScopes;
+		
+		if (vkCreateQueryPool(*_device, &queryPoolCreateInfo, nullptr, &_queryPool) != VK_SUCCESS)
+		{
+			throw std::runtime_error("wvk::Profiler - failed to create query pool");
+		}
+		
+		vkResetQueryPool(*_device, _queryPool, 0, 2 * _maxScopes);
+		
+		_scopes.resize(_maxScopes);
+		_available.clear();
+		for (uint32_t i = _maxScopes; i > 0; --i)
+		{
+			_available.push_back(i - 1);
+		}
+		
+		calibrate();
+	}
+	
+	_enabled = enabled && supported;
+}
+
+void Profiler::calibrate()
+{
+	// Scope 0 is free at this point, the error is the submission latency
+	Device::CommandBuffer *cb = _device->beginSingleTimeCommands();
+	vkCmdWriteTimestamp(*cb, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, _queryPool, 0);
+	_device->endSingleTimeCommands(cb);
+	
+	uint64_t host = now();
+	
+	uint64_t ticks = 0;
+	if (vkGetQueryPoolResults(*_device, _queryPool, 0, 1, sizeof(ticks), &ticks, sizeof(ticks), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT) != VK_SUCCESS)
+	{
+		throw std::runtime_error("wvk::Profiler - failed to read calibration timestamp");
+	}
+	
+	vkResetQueryPool(*_device, _queryPool, 0, 1);
+	
+	_offset = (int64_t)host - (int64_t)toNanoseconds(ticks, _validBits[_device->computeQueueFamilyIndex()]);
+}
+
+uint64_t Profiler::toNanoseconds(uint64_t ticks, uint32_t validBits) const
+{
+	if (validBits < 64)
+		ticks &= (uint64_t(1) << validBits) - 1;
+	
+	return (uint64_t)((double)ticks * _period);
+}
+
+uint64_t Profiler::now()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Profiler::Scope Profiler::begin(Device::CommandBuffer *cb, const std::string &name, const std::string &track)
+{
+	if (! _enabled)
+		return NoScope;
+	
+	uint32_t validBits = _validBits[cb->_pool->_queueFamilyIndex];
+	if (validBits == 0)
+		return NoScope;
+	
+	Scope scope;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		
+		// Out of queries, the scope is dropped
+		if (_available.empty())
+			return NoScope;
+		
+		scope = _available.back();
+		_available.pop_back();
+		
+		ScopeInfo &info = _scopes[scope];
+		info._name = name;
+		info._track = track;
+		info._validBits = validBits;
+	}
+	
+	vkCmdWriteTimestamp(*cb, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, _queryPool, 2 * scope);
+	return scope;
+}
+
+void Profiler::end(Device::CommandBuffer *cb, Scope scope)
+{
+	if (scope == NoScope)
+		return;
+	
+	vkCmdWriteTimestamp(*cb, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, _queryPool, 2 * scope + 1);
+}
+
+void Profiler::collect(Scope scope)
+{
+	if (scope == NoScope)
+		return;
+	
+	uint64_t ticks[2];
+	if (vkGetQueryPoolResults(*_device, _queryPool, 2 * scope, 2, sizeof(ticks), ticks, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT) != VK_SUCCESS)
+	{
+		throw std::runtime_error("wvk::Profiler - failed to read timestamps");
+	}
+	
+	std::lock_guard<std::mutex> lock(_mutex);
+	
+	// Ready for the next submission of the command buffer
+	vkResetQueryPool(*_device, _queryPool, 2 * scope, 2);
+	
+	const ScopeInfo &info = _scopes[scope];
+	
+	Event event;
+	event._name = info._name;
+	event._track = info._track;
+	event._begin = (uint64_t)((int64_t)toNanoseconds(ticks[0], info._validBits) + _offset);
+	event._end = (uint64_t)((int64_t)toNanoseconds(ticks[1], info._validBits) + _offset);
+	event._end = std::max(event._begin, event._end);
+	_events.push_back(event);
+}
+
+void Profiler::release(Scope scope)
+{
+	if (scope == NoScope)
+		return;
+	
+	std::lock_guard<std::mutex> lock(_mutex);
+	_available.push_back(scope);
+}
+
+void Profiler::addHostEvent(const std::string &name, const std::string &track, uint64_t beginNs, uint64_t endNs)
+{
+	if (! _enabled)
+		return;
+	
+	Event event;
+	event._name = name;
+	event._track = track;
+	event._begin = beginNs;
+	event._end = std::max(beginNs, endNs);
+	
+	std::lock_guard<std::mutex> lock(_mutex);
+	_events.push_back(event);
+}
+
+size_t Profiler::eventCount() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _events.size();
+}
+
+uint64_t Profiler::total(const std::string &name, size_t first) const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	
+	uint64_t sum = 0;
+	for (size_t i = first; i < _events.size(); ++i)
+	{
+		if (_events[i]._name == name)
+			sum += _events[i]._end - _events[i]._begin;
+	}
+	
+	return sum;
+}
+
+bool Profiler::writeChromeTrace(const char *fileName) const
+{
+	return writeChromeTrace(fileName, std::vector<const Profiler *>(1, this));
+}
+
+bool Profiler::writeChromeTrace(const char *fileName, const std::vector<const Profiler *> &profilers)
+{
+	FILE *file = fopen(fileName, "w");
+	if (file == nullptr)
+		return false;
+	
+	// Timestamps relative to the first event, in microseconds
+	uint64_t origin = ~uint64_t(0);
+	for (const Profiler *profiler : profilers)
+	{
+		std::lock_guard<std::mutex> lock(profiler->_mutex);
+		for (const Event &event : profiler->_events)
+		{
+			origin = std::min(origin, event._begin);
+		}
+	}
+	
+	fprintf(file, "{\"traceEvents\":[");
+	
+	bool first = true;
+	for (size_t pid = 0; pid < profilers.size(); ++pid)
+	{
+		const Profiler *profiler = profilers[pid];
+		std::lock_guard<std::mutex> lock(profiler->_mutex);
+		
+		fprintf(file, "%s\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":", first ? "" : ",", (int)pid);
+		writeJsonString(file, profiler->_device->properties().deviceName);
+		fprintf(file, "}}");
+		first = false;
+		
+		std::vector<std::string> tracks;
+		for (const Event &event : profiler->_events)
+		{
+			auto it = std::find(tracks.begin(), tracks.end(), event._track);
+			int tid = (int)(it - tracks.begin());
+			
+			if (it == tracks.end())
+			{
+				tracks.push_back(event._track);
+				
+				fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":", (int)pid, tid);
+				writeJsonString(file, event._track);
+				fprintf(file, "}}");
+			}
+			
+			fprintf(file, ",\n{\"name\":");
+			writeJsonString(file, event._name);
+			fprintf(file, ",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				(int)pid, 
+				tid, 
+				(double)(event._begin - origin) * 1e-3, 
+				(double)(event._end - event._begin) * 1e-3
+			);
+		}
+	}
+	
+	fprintf(file, "\n]}\n");
+	
+	return fclose(file) == 0;
+}
+
+}; // namespace wvk
@@ -0,0 +1,97 @@
+#ifndef __WVK_PROFILER_H__
+#define __WVK_PROFILER_H__
+
+#include "VkDevice.h"
+#include <vector>
+#include <string>
+#include <mutex>
+
+namespace wvk
+{
+
+// GPU timestamp profiler backed by a query pool, one per wvk::Device.
+//
+// Usage:
+//   Profiler::Scope s = profiler->begin(cb, "dispatch", "compute 0");
+//   ... record commands ...
+//   profiler->end(cb, s);
+//   ... submit, wait for completion ...
+//   profiler->collect(s);
+//   profiler->release(s);
+//
+// A scope may live in a reusable command buffer, collect() then has to be called after every
+// submission has completed and before the next one. Events are kept in host time (steady clock
+// nanoseconds), device timestamps are converted using a calibration done when profiling is enabled.
+//
+// Scopes are no-ops when profiling is disabled, or when the queue family of the command buffer
+// has no timestamp support.
+class Profiler
+{
+public:
+	Profiler(wvk::Device *device, uint32_t maxScopes = 4096);
+	~Profiler();
+	
+	// Requires hostQueryReset, has no effect when the device does not support timestamps
+	void setEnabled(bool enabled);
+	bool enabled() const { return _enabled; }
+	
+	using Scope = uint32_t;
+	static const Scope NoScope = ~0u;
+	
+	Scope begin(Device::CommandBuffer *cb, const std::string &name, const std::string &track);
+	void end(Device::CommandBuffer *cb, Scope scope);
+	void collect(Scope scope);
+	void release(Scope scope);
+	
+	// Host side work (readback, ...), times from now()
+	void addHostEvent(const std::string &name, const std::string &track, uint64_t beginNs, uint64_t endNs);
+	static uint64_t now();
+	
+	struct Event
+	{
+		std::string _name;
+		std::string _track;
+		uint64_t _begin, _end;
+	};
+	
+	size_t eventCount() const;
+	
+	// Sum of the durations of the events with that name, from event index first on
+	uint64_t total(const std::string &name, size_t first = 0) const;
+	
+	// Chrome trace (chrome://tracing, Perfetto) with one process per profiler and one thread per track
+	bool writeChromeTrace(const char *fileName) const;
+	static bool writeChromeTrace(const char *fileName, const std::vector<const Profiler *> &profilers);
+	
+protected:
+	uint64_t toNanoseconds(uint64_t ticks, uint32_t validBits) const;
+	void calibrate();
+	
+	wvk::Device *_device;
+	
+	VkQueryPool _queryPool = VK_NULL_HANDLE;
+	uint32_t _maxScopes;
+	bool _enabled = false;
+	
+	// Nanoseconds per tick, valid bits per queue family, host minus device time
+	double _period = 1.0;
+	std::vector<uint32_t> _validBits;
+	int64_t _offset = 0;
+	
+	struct ScopeInfo
+	{
+		std::string _name;
+		std::string _track;
+		uint32_t _validBits;
+	};
+	
+	std::vector<ScopeInfo> _scopes;
+	std::vector<Scope> _available;
+	
+	std::vector<Event> _events;
+	mutable std::mutex _mutex;
+};
+
+}; // namespace wvk
+
+#endif // __WVK_PROFILER_H__
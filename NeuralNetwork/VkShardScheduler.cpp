@@ -0,0 +1,96 @@
+#include "VkShardScheduler.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace wvk
+{
+
+ShardScheduler::ShardScheduler(int nWorkers, int nItems)
+{
+	_workers.resize(std::max(nWorkers, 1));
+	_nItems = nItems;
+	
+	for (Worker &worker : _workers)
+	{
+		worker._throughput = 0.0;
+	}
+	
+	rebalance();
+}
+
+void ShardScheduler::report(int iworker, int nItems, double seconds)
+{
+	if (nItems <= 0 || seconds <= 0.0)
+		return;
+	
+	Worker &worker = _workers[iworker];
+	double throughput = (double)nItems / seconds;
+	
+	if (worker._throughput <= 0.0)
+		worker._throughput = throughput;
+	else
+		worker._throughput = _alpha * throughput + (1.0 - _alpha) * worker._throughput;
+}
+
+void ShardScheduler::rebalance()
+{
+	int n = (int)_workers.size();
+	
+	// Workers that never reported get the average throughput
+	double sum = 0.0;
+	int nmeasured = 0;
+	for (const Worker &worker : _workers)
+	{
+		if (worker._throughput > 0.0)
+		{
+			sum += worker._throughput;
+			++nmeasured;
+		}
+	}
+	
+	double average = (nmeasured > 0) ? sum / nmeasured : 1.0;
+	
+	std::vector<double> weights(n);
+	double total = 0.0;
+	for (int i = 0; i < n; ++i)
+	{
+		weights[i] = (_workers[i]._throughput > 0.0) ? _workers[i]._throughput : average;
+		total += weights[i];
+	}
+	
+	// Every worker keeps at least one item when possible, otherwise it could never be measured again
+	int nreserved = std::min(n, _nItems);
+	int nshared = _nItems - nreserved;
+	
+	// Largest remainder rounding of the weighted shares
+	std::vector<int> counts(n);
+	std::vector<std::pair<double, int>> remainders(n);
+	int assigned = 0;
+	for (int i = 0; i < n; ++i)
+	{
+		double share = nshared * weights[i] / total;
+		counts[i] = (int)std::floor(share) + (i < nreserved ? 1 : 0);
+		remainders[i] = std::make_pair(share - std::floor(share), i);
+		assigned += counts[i];
+	}
+	
+	std::sort(remainders.begin(), remainders.end(), [] (const std::pair<double, int> &a, const std::pair<double, int> &b) {
+		return a.first > b.first;
+	});
+	
+	for (int i = 0; assigned < _nItems; ++i, ++assigned)
+	{
+		counts[remainders[i % n].second] += 1;
+	}
+	
+	int begin = 0;
+	for (int i = 0; i < n; ++i)
+	{
+		_workers[i]._range._begin = begin;
+		_workers[i]._range._end = begin + counts[i];
+		begin += counts[i];
+	}
+}
+
+}; // namespace wvk
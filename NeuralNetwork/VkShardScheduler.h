@@ -0,0 +1,56 @@
+#ifndef __WVK_SHARD_SCHEDULER_H__
+#define __WVK_SHARD_SCHEDULER_H__
+
+#include <vector>
+
+namespace wvk
+{
+
+// Splits [0, nItems) into one contiguous range per worker (a device queue), sized after
+// the throughput each worker was measured at.
+//
+// Usage:
+//   ShardScheduler scheduler(nWorkers, nItems);
+//   ShardScheduler::Range r = scheduler.range(iworker);
+//   ... evaluate [r._begin, r._end) on the worker ...
+//   scheduler.report(iworker, r._end - r._begin, seconds);
+//   scheduler.rebalance();
+//
+// Until a worker has reported, it is assumed to be as fast as the average worker.
+class ShardScheduler
+{
+public:
+	ShardScheduler(int nWorkers, int nItems);
+	
+	struct Range
+	{
+		int _begin, _end;
+	};
+	
+	int numWorkers() const { return (int)_workers.size(); }
+	const Range &range(int iworker) const { return _workers[iworker]._range; }
+	
+	// Items per second, 0 until the worker has reported
+	double throughput(int iworker) const { return _workers[iworker]._throughput; }
+	
+	// Measurements are smoothed, 1 only keeps the last one
+	void setSmoothing(double alpha) { _alpha = alpha; }
+	
+	void report(int iworker, int nItems, double seconds);
+	void rebalance();
+	
+protected:
+	struct Worker
+	{
+		Range _range;
+		double _throughput;
+	};
+	
+	std::vector<Worker> _workers;
+	int _nItems;
+	double _alpha = 0.5;
+};
+
+}; // namespace wvk
+
+#endif // __WVK_SHARD_SCHEDULER_H__
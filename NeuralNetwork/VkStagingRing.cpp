@@ -0,0 +1,227 @@
+#include "VkStagingRing.h"
+#include "VkDeviceMemoryManager.h"
+#include "VkBufferManager.h"
+#include "VkImageManager.h"
+#include "VkProfiler.h"
+
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+
+namespace wvk
+{
+
+namespace
+{
+	VkDeviceSize alignUp(VkDeviceSize v, VkDeviceSize alignment)
+	{
+		return (v + alignment - 1) / alignment * alignment;
+	}
+};
+
+StagingRing::StagingRing(wvk::Device *device, VkDeviceSize size, const std::string &track)
+{
+	_device = device;
+	_track = track;
+	
+	VkPhysicalDeviceProperties deviceProperties;
+	vkGetPhysicalDeviceProperties(*_device, &deviceProperties);
+	_alignment = std::max((VkDeviceSize)16, deviceProperties.limits.optimalBufferCopyOffsetAlignment);
+	
+	_size = alignUp(size, _alignment);
+	_buffer = _device->bufferManager()->create(
+		_size, 
+		VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
+	);
+	
+	// Mapped for the lifetime of the ring
+	_mapped = (uint8_t *)_device->memoryManager()->map(_buffer->_dm);
+	
+	_semaphore = _device->createTimelineSemaphore(0);
+}
+
+StagingRing::~StagingRing()
+{
+	waitIdle();
+	
+	_device->destroySemaphore(_semaphore);
+	
+	_device->memoryManager()->unmap(_buffer->_dm);
+	_device->bufferManager()->destroy(_buffer);
+}
+
+StagingRing::Allocation StagingRing::allocate(VkDeviceSize size)
+{
+	if (size > _size)
+	{
+		throw std::runtime_error("wvk::StagingRing - allocation larger than the ring");
+	}
+	
+	retire(_device->getTimelineValue(_semaphore));
+	
+	VkDeviceSize offset;
+	while (! tryAllocate(size, offset))
+	{
+		// The ring is full, block on the oldest upload
+		uint64_t value = _regions.front()._value;
+		if (value == _nextValue)
+			flush();
+		
+		Device::TimelinePoint point;
+		point._semaphore = _semaphore;
+		point._value = value;
+		_device->waitTimeline(point);
+		
+		retire(_device->getTimelineValue(_semaphore));
+	}
+	
+	// The region is released by the flush submitting the commands using it
+	recordingCommandBuffer();
+	
+	Region region;
+	region._begin = offset;
+	region._end = offset + size;
+	region._value = _nextValue;
+	_regions.push_back(region);
+	
+	Allocation a;
+	a._data = _mapped + offset;
+	a._offset = offset;
+	a._size = size;
+	return a;
+}
+
+bool StagingRing::tryAllocate(VkDeviceSize size, VkDeviceSize &offset) const
+{
+	if (_regions.empty())
+	{
+		offset = 0;
+		return true;
+	}
+	
+	VkDeviceSize tail = _regions.front()._begin;
+	VkDeviceSize head = alignUp(_regions.back()._end, _alignment);
+	
+	if (_regions.back()._begin >= tail)
+	{
+		// [tail, head) in use, free space at the end of the ring, then at the beginning
+		if (head + size <= _size)
+		{
+			offset = head;
+			return true;
+		}
+		
+		if (size <= tail)
+		{
+			offset = 0;
+			return true;
+		}
+		
+		return false;
+	}
+	
+	// Wrapped, [head, tail) is free
+	if (head + size <= tail)
+	{
+		offset = head;
+		return true;
+	}
+	
+	return false;
+}
+
+void StagingRing::retire(uint64_t completedValue)
+{
+	while (! _regions.empty() && _regions.front()._value <= completedValue)
+	{
+		_regions.pop_front();
+	}
+	
+	while (! _scopes.empty() && _scopes.front()._value <= completedValue)
+	{
+		_device->profiler()->collect(_scopes.front()._scope);
+		_device->profiler()->release(_scopes.front()._scope);
+		_scopes.pop_front();
+	}
+}
+
+Device::CommandBuffer *StagingRing::recordingCommandBuffer()
+{
+	if (_recording != nullptr)
+		return _recording;
+	
+	_recording = _device->acquireCommandBuffer(Device::QueueType::TRANSFER);
+	_device->beginRecordCommands(_recording, VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+	_recordingScope = _device->profiler()->begin(_recording, "upload", _track);
+	
+	return _recording;
+}
+
+void StagingRing::copy(const Allocation &a, Buffer *dst, VkDeviceSize dstOffset)
+{
+	Device::CommandBuffer *cb = recordingCommandBuffer();
+	_device->copy(cb, _buffer, dst, a._offset, dstOffset, a._size);
+}
+
+void StagingRing::copy(const Allocation &a, Image *dst)
+{
+	Device::CommandBuffer *cb = recordingCommandBuffer();
+	
+	if (dst->_layout != VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL)
+		_device->commit(cb, dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+	
+	_device->copy(cb, _buffer, a._offset, dst);
+	
+	// Handed over to the compute queue, which sees the copy once it has waited on the timeline semaphore
+	_device->release(cb, dst, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_TRANSFER_BIT, 
+		(uint32_t)_device->transferQueueFamilyIndex(), (uint32_t)_device->computeQueueFamilyIndex());
+}
+
+Device::TimelinePoint StagingRing::flush()
+{
+	return flush(Device::TimelinePoint(), VK_PIPELINE_STAGE_TRANSFER_BIT);
+}
+
+Device::TimelinePoint StagingRing::flush(const Device::TimelinePoint &wait, VkPipelineStageFlags waitStage)
+{
+	if (_recording == nullptr)
+		return lastFlush();
+	
+	Device::TimelinePoint signal;
+	signal._semaphore = _semaphore;
+	signal._value = _nextValue;
+	
+	_device->profiler()->end(_recording, _recordingScope);
+	_device->endRecordCommands(_recording);
+	_device->submitTransferCommands(_recording, wait, waitStage, signal);
+	
+	FlushScope flushScope;
+	flushScope._value = signal._value;
+	flushScope._scope = _recordingScope;
+	_scopes.push_back(flushScope);
+	
+	_device->releaseCommandBuffer(_recording);
+	
+	_recording = nullptr;
+	++_nextValue;
+	
+	return signal;
+}
+
+Device::TimelinePoint StagingRing::lastFlush() const
+{
+	Device::TimelinePoint point;
+	point._semaphore = _semaphore;
+	point._value = _nextValue - 1;
+	return point;
+}
+
+void StagingRing::waitIdle()
+{
+	flush();
+	_device->waitTimeline(lastFlush());
+	retire(lastFlush()._value);
+}
+
+}; // namespace wvk
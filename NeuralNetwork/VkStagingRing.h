@@ -0,0 +1,92 @@
+#ifndef __WVK_STAGING_RING_H__
+#define __WVK_STAGING_RING_H__
+
+#include "VkDevice.h"
+#include <deque>
+#include <string>
+
+namespace wvk
+{
+
+// Persistently mapped host-visible ring buffer feeding the transfer queue.
+//
+// Usage:
+//   StagingRing::Allocation a = ring.allocate(size);
+//   memcpy(a._data, ...);
+//   ring.copy(a, dstBuffer, dstOffset);
+//   Device::TimelinePoint done = ring.flush();
+//
+// Each flush is an "upload" scope of the device profiler, on the track given at creation. Rings of one device
+// feeding different queues use different tracks, the trace would otherwise overlap their uploads on one thread.
+//
+// Every flush signals the next value of the ring timeline semaphore, queues
+// waiting on that point see the uploaded data. Ring space is only recycled
+// once the flush that used it has completed on the device.
+class StagingRing
+{
+public:
+	StagingRing(wvk::Device *device, VkDeviceSize size, const std::string &track = "transfer");
+	~StagingRing();
+	
+	struct Allocation
+	{
+		void *_data;
+		VkDeviceSize _offset;
+		VkDeviceSize _size;
+	};
+	
+	Allocation allocate(VkDeviceSize size);
+	
+	void copy(const Allocation &a, Buffer *dst, VkDeviceSize dstOffset = 0);
+	void copy(const Allocation &a, Image *dst);
+	
+	Device::TimelinePoint flush();
+	Device::TimelinePoint flush(const Device::TimelinePoint &wait, VkPipelineStageFlags waitStage);
+	
+	VkSemaphore semaphore() const { return _semaphore; }
+	Device::TimelinePoint lastFlush() const;
+	
+	void waitIdle();
+	
+protected:
+	void retire(uint64_t completedValue);
+	bool tryAllocate(VkDeviceSize size, VkDeviceSize &offset) const;
+	Device::CommandBuffer *recordingCommandBuffer();
+	
+	wvk::Device *_device;
+	std::string _track;
+	
+	Buffer *_buffer = nullptr;
+	uint8_t *_mapped = nullptr;
+	VkDeviceSize _size = 0;
+	VkDeviceSize _alignment = 16;
+	
+	// Regions in allocation order, the ring in use spans from the front begin to the back end (wrapping)
+	struct Region
+	{
+		VkDeviceSize _begin, _end;
+		uint64_t _value;
+	};
+	
+	std::deque<Region> _regions;
+	
+	// Profiler scopes of the submitted flushes, collected once their value completes
+	struct FlushScope
+	{
+		uint64_t _value;
+		uint32_t _scope;
+	};
+	
+	std::deque<FlushScope> _scopes;
+	
+	VkSemaphore _semaphore = VK_NULL_HANDLE;
+	uint64_t _nextValue = 1;
+	
+	// Transient transfer command buffer from the device pool, recycled once its fence signals
+	Device::CommandBuffer *_recording = nullptr;
+	uint32_t _recordingScope = 0;
+};
+
+}; // namespace wvk
+
+#endif // __WVK_STAGING_RING_H__
@@ -1,10 +1,18 @@
 #include "NeuralNetwork.h"
 #include "Population.h"
+#include "EvolutionStrategy.h"
+#include "QuantizedNetwork.h"
+#include "Autotuner.h"
+#include "InferenceServer.h"
+#include "DataPipeline.h"
 #include "VkDevice.h"
 #include "VkDeviceMemoryManager.h"
 #include "VkBufferManager.h"
 #include "VkImageManager.h"
 #include "VkComputePipelineManager.h"
+#include "VkStagingRing.h"
+#include "VkShardScheduler.h"
+#include "VkProfiler.h"
 
 #include <cstdio>
 #include <random>
@@ -14,6 +22,11 @@
 #include <array>
 #include <chrono>
 #include <cassert>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <tuple>
 
 #define NOMINMAX
 #include <Windows.h>
@@ -28,7 +41,43 @@ uint32_t bigToLittleEndian(uint32_t v)
 	return vv;
 }
 
-bool readMNIST(const char *s, std::vector<nn::Population::Sample> &samples)
+// MNIST idx files, images are read from disk on demand and labels are kept in memory
+class MNISTSource : public nn::SampleSource
+{
+public:
+	~MNISTSource();
+	
+	// Without required labels, images with no labels file next to them are read with empty targets
+	bool open(const char *s, bool labelsRequired = true);
+	
+	size_t size() const override { return _count; }
+	void read(size_t index, nn::Population::Sample &sample) override;
+	
+	bool labeled() const { return _labeled; }
+	
+protected:
+	FILE *_imagesfd = nullptr;
+	uint32_t _imageswidth = 0;
+	uint32_t _imagesheight = 0;
+	size_t _count = 0;
+	
+	bool _labeled = false;
+	std::vector<uint8_t> _labels;
+	size_t _nLabels = 0;
+	
+	std::vector<uint8_t> _pixels;
+	
+	// Reads and closes the labels file, false when it does not match the images
+	bool readLabels(FILE *labelsfd, uint32_t imagescount);
+};
+
+MNISTSource::~MNISTSource()
+{
+	if (_imagesfd != nullptr)
+		fclose(_imagesfd);
+}
+
+bool MNISTSource::open(const char *s, bool labelsRequired)
 {
 	char imagesFileName[1024], labelsFileName[1024];
 	sprintf(imagesFileName, "%s-images.idx3-ubyte", s);
@@ -63,20 +112,45 @@ bool readMNIST(const char *s, std::vector<nn::Population::Sample> &samples)
 	uint32_t imageswidth = bigToLittleEndian(temp);
 	
 	FILE *labelsfd = fopen(labelsFileName, "rb");
-	if (labelsfd == nullptr)
+	if (labelsfd == nullptr && labelsRequired)
 	{
 		printf("Error: unable to open '%s'\n", labelsFileName);
 		fclose(imagesfd);
 		return false;
 	}
 	
+	_labeled = (labelsfd != nullptr);
+	_labels.clear();
+	_nLabels = 0;
+	
+	if (_labeled && ! readLabels(labelsfd, imagescount))
+	{
+		fclose(imagesfd);
+		return false;
+	}
+	
+	if (_imagesfd != nullptr)
+		fclose(_imagesfd);
+	
+	_imagesfd = imagesfd;
+	_imageswidth = imageswidth;
+	_imagesheight = imagesheight;
+	_count = imagescount;
+	_pixels.resize(imageswidth * imagesheight);
+	
+	return true;
+}
+
+bool MNISTSource::readLabels(FILE *labelsfd, uint32_t imagescount)
+{
+	uint32_t temp;
+	
 	fread(&temp, 1, sizeof(uint32_t), labelsfd);
 	uint32_t labelscc = bigToLittleEndian(temp);
 	
 	if (labelscc != 0x00000801)
 	{
 		printf("Error: invalid labels 4CC: 0x%x (expecting 0x%x)\n", labelscc, 0x00000801);
-		fclose(imagesfd);
 		fclose(labelsfd);
 		return false;
 	}
@@ -87,47 +161,126 @@ bool readMNIST(const char *s, std::vector<nn::Population::Sample> &samples)
 	if (imagescount != labelscount)
 	{
 		printf("Error: images and labels count mismatch (%d, %d)\n", imagescount, labelscount);
-		fclose(imagesfd);
 		fclose(labelsfd);
 		return false;
 	}
 	
-	printf("Reading %d images and labels from '%s'\n", imagescount, s);
-	fflush(stdout);
+	_labels.resize(labelscount);
+	fread(_labels.data(), labelscount, sizeof(uint8_t), labelsfd);
+	fclose(labelsfd);
+	
+	std::set<uint8_t> labelset(_labels.begin(), _labels.end());
+	_nLabels = labelset.size();
 	
-	uint8_t *pixelbuffer = new uint8_t[imagescount * imageswidth * imagesheight];
-	fread(pixelbuffer, imagescount * imageswidth * imagesheight, sizeof(uint8_t), imagesfd);
-	uint8_t *pixel = pixelbuffer;
+	return true;
+}
+
+void MNISTSource::read(size_t index, nn::Population::Sample &sample)
+{
+	// 16 bytes of header, then the images back to back
+	long offset = 16 + (long)(index * _pixels.size());
+	if (fseek(_imagesfd, offset, SEEK_SET) != 0 || fread(_pixels.data(), 1, _pixels.size(), _imagesfd) != _pixels.size())
+	{
+		throw std::runtime_error("failed to read MNIST image");
+	}
+	
+	const uint8_t *pixel = _pixels.data();
+	
+	sample._input.resize(_imagesheight * _imageswidth, 1, nn::MatrixInit::UNINITIALIZED);
+	nn::map(sample._input, [&] (float v) { return *pixel++ / 255.0f; });
 	
-	uint8_t *labelbuffer = new uint8_t[imagescount];
-	fread(labelbuffer, imagescount, sizeof(uint8_t), labelsfd);
-	uint8_t *label = labelbuffer;
+	sample._target.resize(_nLabels, 1);
+	if (_labeled)
+		sample._target(_labels[index], 0) = 1.0;
+}
+
+bool readMNIST(const char *s, std::vector<nn::Population::Sample> &samples)
+{
+	MNISTSource source;
+	if (! source.open(s))
+		return false;
 	
-	samples.reserve(samples.size() + imagescount);
+	printf("Reading %d images and labels from '%s'\n", (int)source.size(), s);
+	fflush(stdout);
 	
-	std::set<uint8_t> labelset;
-	for (uint32_t i = 0; i < imagescount; ++i)
-		labelset.insert(labelbuffer[i]);
+	samples.reserve(samples.size() + source.size());
 	
-	for (uint32_t i = 0; i < imagescount; ++i)
+	for (size_t i = 0; i < source.size(); ++i)
 	{
 		samples.push_back(nn::Population::Sample());
-		nn::Population::Sample &sample = samples.back();
-		
-		sample._input.resize(imagesheight * imageswidth, 1);
-		nn::map(sample._input, [&] (float v) { return *pixel++ / 255.0f; });
-		
-		sample._target.resize(labelset.size(), 1);
-		sample._target(*label++, 0) = 1.0;
+		source.read(i, samples.back());
 	}
 	
-	delete [] pixelbuffer;
-	delete [] labelbuffer;
+	return true;
+}
+
+int argmax(const nn::Matrix &m)
+{
+	int imax = 0;
+	for (int i = 1; i < m.numRows(); ++i)
+	{
+		if (m(i, 0) > m(imax, 0))
+			imax = i;
+	}
+	return imax;
+}
+
+// Accuracy of the fp32 and int8 networks on t10k, how often they agree and how long an evaluation takes
+void checkQuantization(const nn::NeuralNetwork &network)
+{
+	std::vector<nn::Population::Sample> samples;
+	if (! readMNIST("MNIST/t10k", samples))
+		throw std::runtime_error("unable to open the MNIST test set");
 	
-	fclose(imagesfd);
-	fclose(labelsfd);
+	nn::QuantizedNetwork quantized(network);
 	
-	return true;
+	size_t fp32Bytes = 0;
+	for (const nn::NeuralNetwork::Layer &layer : network.layers())
+	{
+		fp32Bytes += sizeof(float) * ((size_t)layer._weights.numRows() * layer._weights.numColumns() + (size_t)layer._factor.numRows() * layer._factor.numColumns());
+	}
+	
+	printf("Int8 kernel: %s, weights: %s (fp32: %s)\n", 
+		nn::QuantizedNetwork::kernelName(quantized.kernel()), 
+		nn::HumanReadableSize(quantized.sizeInBytes()).str(), 
+		nn::HumanReadableSize(fp32Bytes).str());
+	
+	nn::NeuralNetwork::Workspace workspace;
+	nn::QuantizedNetwork::Workspace quantizedWorkspace;
+	
+	int fp32Correct = 0, int8Correct = 0, agree = 0;
+	float maxError = 0.0f;
+	std::chrono::duration<double> fp32Seconds(0.0), int8Seconds(0.0);
+	
+	for (const nn::Population::Sample &sample : samples)
+	{
+		auto t0 = std::chrono::high_resolution_clock::now();
+		const nn::Matrix &output = network.forward(sample._input, workspace);
+		auto t1 = std::chrono::high_resolution_clock::now();
+		const nn::Matrix &quantizedOutput = quantized.forward(sample._input, quantizedWorkspace);
+		auto t2 = std::chrono::high_resolution_clock::now();
+		
+		fp32Seconds += t1 - t0;
+		int8Seconds += t2 - t1;
+		
+		int label = argmax(sample._target);
+		int guess = argmax(output);
+		int quantizedGuess = argmax(quantizedOutput);
+		
+		fp32Correct += (guess == label) ? 1 : 0;
+		int8Correct += (quantizedGuess == label) ? 1 : 0;
+		agree += (guess == quantizedGuess) ? 1 : 0;
+		
+		for (int i = 0; i < output.numRows(); ++i)
+		{
+			maxError = std::max(maxError, std::abs(output(i, 0) - quantizedOutput(i, 0)));
+		}
+	}
+	
+	double n = (double)samples.size();
+	printf("fp32 accuracy: %5.2f%%, %.1f us/sample\n", 100.0 * fp32Correct / n, 1e6 * fp32Seconds.count() / n);
+	printf("int8 accuracy: %5.2f%%, %.1f us/sample\n", 100.0 * int8Correct / n, 1e6 * int8Seconds.count() / n);
+	printf("Top-1 agreement: %5.2f%%, max output error: %.4f\n", 100.0 * agree / n, maxError);
 }
 
 std::string durationstring(const std::chrono::duration<double> &d)
@@ -166,6 +319,106 @@ int nSubjects = 1;
 int nInputs = 28*28;
 int nHidden = 28*28;
 int nOutputs = 10;
+int nBatches = 1;
+
+// Rank of the factorized input to hidden layer, 0 for a dense one, see nn::NeuralNetwork::LayerInfo
+int hiddenRank = 0;
+
+// Two convolution and pooling stages in place of the hidden layer, about 100x fewer parameters
+bool conv = false;
+
+// Compares the int8 quantized network with the fp32 one on the t10k set after training, see nn::QuantizedNetwork
+bool int8Check = false;
+
+// Generic kernels instead of the ones generated for the layer shapes, see nn::Jit
+bool noJit = false;
+
+// Kernel layouts timed on the first run and kept per CPU model and layer shape, see nn::Autotuner
+std::string tuneDb = "gemm.tune";
+bool noTune = false;
+
+// Saves the trained network, the best subject of the last generation or the ES center, see nn::NeuralNetwork::save()
+std::string saveNetwork;
+
+// Classifies inferSet with the checkpointed network instead of training, batches of inferBatch images over the workers
+std::string inferNetwork;
+std::string inferSet = "MNIST/t10k";
+int inferBatch = 64;
+std::string predictions = "predictions.txt";
+
+// Serves the checkpointed network on a Unix domain socket instead of training, for serveSeconds or until killed when 0
+std::string serveNetwork;
+nn::InferenceServer::Config serveConfig;
+int serveSeconds = 0;
+
+// Minibatches decoded ahead of the one being evaluated, plus that one
+int pipelineDepth = 2;
+
+// Backing of the matrix allocator chunks, see nn::MatrixMemoryAllocator::HugePages
+nn::MatrixMemoryAllocator::HugePages hugePages = nn::MatrixMemoryAllocator::HugePages::NONE;
+
+// Pins the population workers and stores subjects on the NUMA node of the workers evaluating them
+bool numa = false;
+
+// Population worker threads, see nn::SchedulerConfig
+nn::SchedulerConfig scheduler;
+
+// Successive halving of the subjects within a generation, see nn::Population::RacingConfig
+nn::Population::RacingConfig racing;
+
+// Samples per task of the population workers, 0 for one task per subject, see nn::Population::setBatchSize()
+int batchSize = nn::Population::DefaultBatchSize;
+
+// Seeds the minibatch shuffle, the mutations and the ES noise, the same seed gives the same run
+unsigned int seed = 0;
+
+// Subjects stored as seed chains, rebuilt when evaluated, see nn::Population::Encoding
+bool seedChain = false;
+int eliteCache = 4;
+
+// Truncation selection, 0 mutates every subject in place, and the per weight mutation probability range
+int parents = 0;
+double minMutationRate = 0.1;
+double maxMutationRate = 0.5;
+
+// Trains a single network with an evolution strategy instead of the population when esPairs > 0, see nn::EvolutionStrategy
+int esPairs = 0;
+float esSigma = 0.02f;
+float esLearningRate = 0.01f;
+
+// Comma separated list of indices or ranges, e.g. "0-3,8"
+std::vector<int> parseIndexList(const char *p)
+{
+	std::vector<int> indices;
+	while (p != nullptr && *p != '\0')
+	{
+		char *end;
+		int first = (int)strtol(p, &end, 10);
+		int last = (*end == '-') ? (int)strtol(end + 1, &end, 10) : first;
+		for (int i = first; i <= last; ++i)
+		{
+			indices.push_back(i);
+		}
+		
+		p = strchr(end, ',');
+		if (p != nullptr)
+			++p;
+	}
+	return indices;
+}
+
+// Physical device index of each wvk::Device, an index may be repeated to run several devices on one ICD
+std::vector<int> vkDevices = { 0 };
+int vkQueues = 1;
+
+// Population stored as half floats on devices with 16-bit storage
+bool vkFp16 = false;
+
+// Upper bound on the subjects uploaded at once, 0 for as many as a storage buffer binding holds
+int vkChunkSubjects = 0;
+
+// Chrome trace written at exit, GPU timestamps are also summed per generation when set
+const char *vkProfile = nullptr;
 
 void parse_arguments(int argc, char *argv[])
 {
@@ -190,570 +443,1606 @@ void parse_arguments(int argc, char *argv[])
 			}
 			++iarg;
 		}
-		else if (strcmp(argv[iarg], "--nHidden") == 0)
+		else if (strcmp(argv[iarg], "--nBatches") == 0)
 		{
 			if (iarg + 1 < argc)
 			{
-				nHidden = atoi(argv[iarg + 1]);
+				nBatches = atoi(argv[iarg + 1]);
 				++iarg;
 			}
 			++iarg;
 		}
-		else
+		else if (strcmp(argv[iarg], "--hiddenRank") == 0)
 		{
+			if (iarg + 1 < argc)
+			{
+				hiddenRank = atoi(argv[iarg + 1]);
+				++iarg;
+			}
 			++iarg;
 		}
-	}
-}
-
-void copyPopulationData(float *data, const nn::Population &population)
-{
-	float *p = data;
-	
-	for (const nn::Population::Subject *subject : population.subjects())
-	{
-		const nn::NeuralNetwork &brain = subject->_brain;
-		for (const nn::NeuralNetwork::Layer &layer : brain.layers())
+		else if (strcmp(argv[iarg], "--conv") == 0)
 		{
-			memcpy(p, layer._weights.ptr(), sizeof(float) * layer._weights.numRows() * layer._weights.numColumns());
-			p += layer._weights.numRows() * layer._weights.numColumns();
-			
-			memcpy(p, layer._biases.ptr(), sizeof(float) * layer._biases.numRows() * layer._biases.numColumns());
-			p += layer._biases.numRows() * layer._biases.numColumns();
+			conv = true;
+			++iarg;
 		}
-	}
-}
-
-void copySampleData(float *data, const std::vector<const nn::Population::Sample *> &samples)
-{
-	float *p = data;
-	
-	for (const nn::Population::Sample *sample : samples)
-	{
-		memcpy(p, sample->_input.ptr(), sizeof(float) * sample->_input.numRows() * sample->_input.numColumns());
-		p += sample->_input.numRows() * sample->_input.numColumns();
-	}
-}
-
-int main(int argc, char *argv[])
-{
-	try
-	{
-		parse_arguments(argc, argv);
-		
-		std::vector<nn::Population::Sample> trainingsamples, testsamples;
-		readMNIST("MNIST/train", trainingsamples);
-		readMNIST("MNIST/t10k", testsamples);
-		
-		// std::vector<const nn::Population::Sample *> samples(trainingsamples.size());
-		std::vector<const nn::Population::Sample *> samples(std::min((size_t)nSamples, trainingsamples.size()));
-		for (size_t i = 0; i < samples.size(); ++i)
-			samples[i] = &trainingsamples[i];
-		
-		nn::Population population(
-			nSubjects, 
-			nInputs, {
-				{ nHidden, nn::ActivationFunction::SIGMOID }, 
-				{ nOutputs, nn::ActivationFunction::SOFTMAX }
-			}, 
-			nn::LossFunction::SOFTMAX_CROSS_ENTROPY
-		);
-		
-		for (int i = 0; i < 10; ++i)
+		else if (strcmp(argv[iarg], "--int8Check") == 0)
 		{
-			printf("Generation %3d - ", i);
-			fflush(stdout);
-			
-			auto t0 = std::chrono::high_resolution_clock::now();
-			population.feed_forward(samples);
-			auto t1 = std::chrono::high_resolution_clock::now();
-			
-			std::chrono::duration<double> elapsed_seconds = t1 - t0;
-			std::string d = durationstring(elapsed_seconds);
-			
-			nn::Population::Statistics s = population.computePopulationStatistics();
-			
-			printf("duration: %s, score: %5.1f%%, ", d.c_str(), 100.0 * s._score);
-			population.nextgeneration();
-			printf("\n");
+			int8Check = true;
+			++iarg;
 		}
-		
-		return 0;
-		
-// #define VK_BACKEND
-#ifdef VK_BACKEND
-		uint32_t inputToHiddenWeightsSize = nInputs * nHidden;
-		uint32_t inputToHiddenBiasesSize = nHidden;
-		uint32_t hiddenToOutputWeightsSize = nHidden * nOutputs;
-		uint32_t hiddenToOutputBiasesSize = nOutputs;
-		uint32_t subjectSize = 
-			inputToHiddenWeightsSize + inputToHiddenBiasesSize + 
-			hiddenToOutputWeightsSize + hiddenToOutputBiasesSize;
-		uint32_t populationSize = nSubjects * subjectSize;
-		
-		uint32_t singleSampleSize = nInputs;
-		uint32_t sampleSize = nSamples * singleSampleSize;
-		
-		printf("Input to hidden weights size:  %s\n", nn::HumanReadableSize(inputToHiddenWeightsSize).str());
-		printf("Input to hidden biases size:   %s\n", nn::HumanReadableSize(inputToHiddenBiasesSize).str());
-		printf("Hidden to output weights size: %s\n", nn::HumanReadableSize(hiddenToOutputWeightsSize).str());
-		printf("Hidden to output biases size:  %s\n", nn::HumanReadableSize(hiddenToOutputBiasesSize).str());
-		printf("Subject size:                  %s\n", nn::HumanReadableSize(subjectSize).str());
-		printf("Population size:               %s\n", nn::HumanReadableSize(populationSize).str());
-		printf("Single sample size:            %s\n", nn::HumanReadableSize(singleSampleSize).str());
-		printf("Total sample size:             %s\n", nn::HumanReadableSize(sampleSize).str());
-		
-		wvk::Device device;
-		device.setValidationEnabled(true);
-		device.create();
-		
-		wvk::DeviceMemoryManager *mmanager = device.memoryManager();
-		wvk::BufferManager *bmanager = device.bufferManager();
-		wvk::ImageManager *imanager = device.imageManager();
-		
-		wvk::Buffer *stagingbuffer = bmanager->create(
-			sizeof(float) * std::max(populationSize, sampleSize), 
-			VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, 
-			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
-		);
-		
-		// #define DATA_BUFFER_BACKED
-		#define DATA_IMAGE_BACKED
-		
-		#ifdef DATA_BUFFER_BACKED
-			wvk::Buffer *populationBuffer = bmanager->create(
-				sizeof(float) * populationSize, 
-				VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, 
-				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
-			);
-			
-			wvk::Buffer *sampleBuffer = bmanager->create(
-				sizeof(float) * sampleSize, 
-				VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, 
-				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
-			);
-			
-			float *populationData = (float *)mmanager->map(stagingbuffer->_dm);
-			copyPopulationData(populationData, population);
-			mmanager->unmap(stagingbuffer->_dm);
-			device.immediate(&wvk::Device::copy, stagingbuffer, populationBuffer, (VkDeviceSize)(sizeof(float) * populationSize));
-			
-			float *sampleData = (float *)mmanager->map(stagingbuffer->_dm);
-			copySampleData(sampleData, samples);
-			mmanager->unmap(stagingbuffer->_dm);
-			device.immediate(&wvk::Device::copy, stagingbuffer, sampleBuffer, (VkDeviceSize)(sizeof(float) * sampleSize));
-		#endif
-		
-		#ifdef DATA_IMAGE_BACKED
-			wvk::Image *populationImage = imanager->create1D(
-				populationSize, 
-				1, 
-				VK_SAMPLE_COUNT_1_BIT, 
-				VK_FORMAT_R32_SFLOAT, 
-				VK_IMAGE_TILING_OPTIMAL, 
-				VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, 
-				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
-			);
-			
-			wvk::Image *sampleImage = imanager->create1D(
-				sampleSize, 
-				1, 
-				VK_SAMPLE_COUNT_1_BIT, 
-				VK_FORMAT_R32_SFLOAT, 
-				VK_IMAGE_TILING_OPTIMAL, 
-				VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, 
-				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
-			);
-			
-			VkFence bufferToImageFence = VK_NULL_HANDLE;
+		else if (strcmp(argv[iarg], "--noJit") == 0)
+		{
+			noJit = true;
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--tuneDb") == 0)
+		{
+			if (iarg + 1 < argc)
 			{
-				VkFenceCreateInfo bufferToImageFenceCI = {};
-				bufferToImageFenceCI.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-				bufferToImageFenceCI.flags  = 0;
-				
-				if (vkCreateFence(device, &bufferToImageFenceCI, nullptr, &bufferToImageFence) != VK_SUCCESS)
-				{
-					throw std::runtime_error("failed to create buffer-to-image fence");
-				}
+				tuneDb = argv[iarg + 1];
+				++iarg;
 			}
-			
-			float *populationData = (float *)mmanager->map(stagingbuffer->_dm);
-			copyPopulationData(populationData, population);
-			mmanager->unmap(stagingbuffer->_dm);
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--noTune") == 0)
+		{
+			noTune = true;
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--saveNetwork") == 0)
+		{
+			if (iarg + 1 < argc)
 			{
-				wvk::Device::CommandBuffer *cb = device.getOrCreateComputeCommandBuffer("buffer-to-image");
-				device.beginRecordCommands(cb, 0);
-					// device.setImageLayout(cb, populationImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-					device.copy(cb, stagingbuffer, populationImage);
-					// device.setImageLayout(cb, populationImage, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-				device.endRecordCommands(cb);
-				device.submitComputeCommands(cb, bufferToImageFence);
+				saveNetwork = argv[iarg + 1];
+				++iarg;
 			}
-			
-			if (vkWaitForFences(device, 1, &bufferToImageFence, VK_TRUE, ~0) != VK_SUCCESS)
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--infer") == 0)
+		{
+			if (iarg + 1 < argc)
 			{
-				throw std::runtime_error("failed to wait for buffer-to-image fence");
+				inferNetwork = argv[iarg + 1];
+				++iarg;
 			}
-			vkResetFences(device, 1, &bufferToImageFence);
-			
-			float *sampleData = (float *)mmanager->map(stagingbuffer->_dm);
-			copySampleData(sampleData, samples);
-			mmanager->unmap(stagingbuffer->_dm);
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--inferSet") == 0)
+		{
+			if (iarg + 1 < argc)
 			{
-				wvk::Device::CommandBuffer *cb = device.getOrCreateComputeCommandBuffer("buffer-to-image");
-				device.beginRecordCommands(cb, 0);
-					// device.setImageLayout(cb, sampleImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-					device.copy(cb, stagingbuffer, sampleImage);
-					// device.setImageLayout(cb, sampleImage, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-				device.endRecordCommands(cb);
-				device.submitComputeCommands(cb, bufferToImageFence);
+				inferSet = argv[iarg + 1];
+				++iarg;
 			}
-			
-			if (vkWaitForFences(device, 1, &bufferToImageFence, VK_TRUE, ~0) != VK_SUCCESS)
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--inferBatch") == 0)
+		{
+			if (iarg + 1 < argc)
 			{
-				throw std::runtime_error("failed to wait for buffer-to-image fence");
+				inferBatch = std::max(1, atoi(argv[iarg + 1]));
+				++iarg;
 			}
-			vkResetFences(device, 1, &bufferToImageFence);
-		#endif
-		
-		// ---------------------------------------------------------------------------------------------------------------
-		std::array<VkDescriptorSetLayoutBinding, 2> bindings = {};
-		
-		#ifdef DATA_BUFFER_BACKED
-			bind ings[0].binding = 0;
-			bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-			bindings[0].descriptorCount = 1;
-			bindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
-			bindings[0].pImmutableSamplers = nullptr;
-			bindings[1].binding = 1;
-			bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-			bindings[1].descriptorCount = 1;
-			bindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
-			bindings[1].pImmutableSamplers = nullptr;
-		#endif
-		
-		#ifdef DATA_IMAGE_BACKED
-			bindings[0].binding = 0;
-			bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-			bindings[0].descriptorCount = 1;
-			bindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
-			bindings[0].pImmutableSamplers = nullptr;
-			bindings[1].binding = 1;
-			bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-			bindings[1].descriptorCount = 1;
-			bindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
-			bindings[1].pImmutableSamplers = nullptr;
-		#endif
-		
-		VkDescriptorSetLayoutCreateInfo dslcInfo = {};
-		dslcInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-		dslcInfo.flags = 0;
-		dslcInfo.bindingCount = (uint32_t)bindings.size();
-		dslcInfo.pBindings = bindings.data();
-		
-		VkDescriptorSetLayout descriptorSetLayout;
-		if (vkCreateDescriptorSetLayout(device, &dslcInfo, nullptr, &descriptorSetLayout) != VK_SUCCESS)
-		{
-			throw std::runtime_error("failed to create descriptor set layout");
-		}
-		
-		device.registerDescriptorSetLayout(descriptorSetLayout);
-		
-		// ---------------------------------------------------------------------------------------------------------------
-		VkPipelineLayoutCreateInfo plcInfo = {};
-		plcInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-		plcInfo.flags = 0;
-		plcInfo.setLayoutCount = 1;
-		plcInfo.pSetLayouts = &descriptorSetLayout;
-		plcInfo.pushConstantRangeCount = 0;
-		plcInfo.pPushConstantRanges = nullptr;
-		
-		VkPipelineLayout pipelineLayout;
-		if (vkCreatePipelineLayout(device, &plcInfo, nullptr, &pipelineLayout) != VK_SUCCESS)
-		{
-			throw std::runtime_error("failed to create pipeline layout");
+			++iarg;
 		}
-		
-		device.registerPipelineLayout(pipelineLayout);
-		
-		// ---------------------------------------------------------------------------------------------------------------
-		std::array<VkDescriptorPoolSize, 2> descriptorPoolSizes = {};
-		
-		#ifdef DATA_BUFFER_BACKED
-			descriptorPoolSizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-			descriptorPoolSizes[0].descriptorCount = 1;
-			descriptorPoolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-			descriptorPoolSizes[1].descriptorCount = 1;
-		#endif
-		
-		#ifdef DATA_IMAGE_BACKED
-			descriptorPoolSizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-			descriptorPoolSizes[0].descriptorCount = 1;
-			descriptorPoolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-			descriptorPoolSizes[1].descriptorCount = 1;
-		#endif
-		
-		VkDescriptorPoolCreateInfo dpcInfo = {};
-		dpcInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-		dpcInfo.maxSets = 1;
-		dpcInfo.poolSizeCount = static_cast<uint32_t>(descriptorPoolSizes.size());
-		dpcInfo.pPoolSizes = descriptorPoolSizes.data();
-		
-		VkDescriptorPool descriptorPool;
-		if (vkCreateDescriptorPool(device, &dpcInfo, nullptr, &descriptorPool) != VK_SUCCESS)
+		else if (strcmp(argv[iarg], "--predictions") == 0)
 		{
-			throw std::runtime_error("failed to create descriptor pool");
-		}
+			if (iarg + 1 < argc)
+			{
+				predictions = argv[iarg + 1];
+				++iarg;
+			}
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--serve") == 0)
+		{
+			if (iarg + 1 < argc)
+			{
+				serveNetwork = argv[iarg + 1];
+				++iarg;
+			}
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--socket") == 0)
+		{
+			if (iarg + 1 < argc)
+			{
+				serveConfig._path = argv[iarg + 1];
+				++iarg;
+			}
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--serveBatch") == 0)
+		{
+			if (iarg + 1 < argc)
+			{
+				serveConfig._maxBatch = atoi(argv[iarg + 1]);
+				++iarg;
+			}
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--serveDelay") == 0)
+		{
+			if (iarg + 1 < argc)
+			{
+				serveConfig._maxDelay = atoi(argv[iarg + 1]);
+				++iarg;
+			}
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--serveQueue") == 0)
+		{
+			if (iarg + 1 < argc)
+			{
+				serveConfig._queueCapacity = atoi(argv[iarg + 1]);
+				++iarg;
+			}
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--serveSeconds") == 0)
+		{
+			if (iarg + 1 < argc)
+			{
+				serveSeconds = atoi(argv[iarg + 1]);
+				++iarg;
+			}
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--pipelineDepth") == 0)
+		{
+			if (iarg + 1 < argc)
+			{
+				pipelineDepth = atoi(argv[iarg + 1]);
+				++iarg;
+			}
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--hugePages") == 0)
+		{
+			// none, thp or explicit
+			if (iarg + 1 < argc)
+			{
+				if (strcmp(argv[iarg + 1], "thp") == 0)
+					hugePages = nn::MatrixMemoryAllocator::HugePages::THP;
+				else if (strcmp(argv[iarg + 1], "explicit") == 0)
+					hugePages = nn::MatrixMemoryAllocator::HugePages::EXPLICIT;
+				else
+					hugePages = nn::MatrixMemoryAllocator::HugePages::NONE;
+				++iarg;
+			}
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--numa") == 0)
+		{
+			numa = true;
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--threads") == 0)
+		{
+			if (iarg + 1 < argc)
+			{
+				scheduler._threads = atoi(argv[iarg + 1]);
+				++iarg;
+			}
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--cpus") == 0)
+		{
+			if (iarg + 1 < argc)
+			{
+				scheduler._cpus = parseIndexList(argv[iarg + 1]);
+				++iarg;
+			}
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--nodes") == 0)
+		{
+			if (iarg + 1 < argc)
+			{
+				scheduler._nodes = parseIndexList(argv[iarg + 1]);
+				++iarg;
+			}
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--racing") == 0)
+		{
+			// Samples of the first round
+			if (iarg + 1 < argc)
+			{
+				racing._initialSamples = atoi(argv[iarg + 1]);
+				++iarg;
+			}
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--racingDrop") == 0)
+		{
+			if (iarg + 1 < argc)
+			{
+				racing._dropFraction = atof(argv[iarg + 1]);
+				++iarg;
+			}
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--batchSize") == 0)
+		{
+			if (iarg + 1 < argc)
+			{
+				batchSize = std::max(0, atoi(argv[iarg + 1]));
+				++iarg;
+			}
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--seed") == 0)
+		{
+			if (iarg + 1 < argc)
+			{
+				seed = (unsigned int)strtoul(argv[iarg + 1], nullptr, 10);
+				++iarg;
+			}
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--seedChain") == 0)
+		{
+			seedChain = true;
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--eliteCache") == 0)
+		{
+			if (iarg + 1 < argc)
+			{
+				eliteCache = atoi(argv[iarg + 1]);
+				++iarg;
+			}
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--parents") == 0)
+		{
+			if (iarg + 1 < argc)
+			{
+				parents = atoi(argv[iarg + 1]);
+				++iarg;
+			}
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--mutationRates") == 0)
+		{
+			// min,max
+			if (iarg + 1 < argc)
+			{
+				minMutationRate = atof(argv[iarg + 1]);
+				const char *p = strchr(argv[iarg + 1], ',');
+				maxMutationRate = (p != nullptr) ? atof(p + 1) : minMutationRate;
+				++iarg;
+			}
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--es") == 0)
+		{
+			if (iarg + 1 < argc)
+			{
+				esPairs = atoi(argv[iarg + 1]);
+				++iarg;
+			}
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--esSigma") == 0)
+		{
+			if (iarg + 1 < argc)
+			{
+				esSigma = (float)atof(argv[iarg + 1]);
+				++iarg;
+			}
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--esLearningRate") == 0)
+		{
+			if (iarg + 1 < argc)
+			{
+				esLearningRate = (float)atof(argv[iarg + 1]);
+				++iarg;
+			}
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--physicalCores") == 0)
+		{
+			scheduler._physicalCores = true;
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--pin") == 0)
+		{
+			scheduler._pin = true;
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--vkDevices") == 0)
+		{
+			// Comma separated list, e.g. "0,0"
+			if (iarg + 1 < argc)
+			{
+				vkDevices.clear();
+				
+				const char *p = argv[iarg + 1];
+				while (p != nullptr)
+				{
+					vkDevices.push_back(atoi(p));
+					p = strchr(p, ',');
+					if (p != nullptr)
+						++p;
+				}
+				++iarg;
+			}
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--vkQueues") == 0)
+		{
+			if (iarg + 1 < argc)
+			{
+				vkQueues = atoi(argv[iarg + 1]);
+				++iarg;
+			}
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--vkFp16") == 0)
+		{
+			vkFp16 = true;
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--vkChunkSubjects") == 0)
+		{
+			if (iarg + 1 < argc)
+			{
+				vkChunkSubjects = atoi(argv[iarg + 1]);
+				++iarg;
+			}
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--vkProfile") == 0)
+		{
+			if (iarg + 1 < argc)
+			{
+				vkProfile = argv[iarg + 1];
+				++iarg;
+			}
+			++iarg;
+		}
+		else if (strcmp(argv[iarg], "--nHidden") == 0)
+		{
+			if (iarg + 1 < argc)
+			{
+				nHidden = atoi(argv[iarg + 1]);
+				++iarg;
+			}
+			++iarg;
+		}
+		else
+		{
+			++iarg;
+		}
+	}
+}
+
+int argmaxRow(const nn::Matrix &m, int r)
+{
+	int imax = 0;
+	for (int i = 1; i < m.numColumns(); ++i)
+	{
+		if (m(r, i) > m(r, imax))
+			imax = i;
+	}
+	return imax;
+}
+
+// Streams inferSet through the checkpointed network. Workers take the next batch of images in turn, each one reading
+// the images through its own file handle, and write the predicted labels to the predictions file in image order.
+// Batch latencies cover the decoding and the evaluation of a batch. The labels file is optional, the top-1 accuracy
+// is only reported with it.
+void runInference()
+{
+	nn::NeuralNetwork network = nn::NeuralNetwork::load(inferNetwork);
+	
+	MNISTSource source;
+	if (! source.open(inferSet.c_str(), false))
+		throw std::runtime_error("unable to open '" + inferSet + "'");
+	
+	nn::Population::Sample sample;
+	if (source.size() > 0)
+	{
+		source.read(0, sample);
+		if (sample._input.numRows() != network.numInputs())
+			throw std::runtime_error("the images of '" + inferSet + "' do not match the network inputs");
+	}
+	
+	const std::vector<int> cpus = nn::Topology::instance().selectCpus(scheduler);
+	if (cpus.empty())
+		throw std::runtime_error("no CPU matches the scheduler configuration");
+	
+	const size_t nImages = source.size();
+	const int nBatches = (int)((nImages + inferBatch - 1) / inferBatch);
+	const int nWorkers = std::max(1, std::min(nBatches, (scheduler._threads > 0) ? scheduler._threads : (int)cpus.size()));
+	
+	printf("Inference of %d %s images from '%s', batches of %d, %d worker(s)\n", (int)nImages, source.labeled() ? "labeled" : "unlabeled", inferSet.c_str(), inferBatch, nWorkers);
+	
+	std::vector<int> labels(nImages), guesses(nImages);
+	std::vector<double> latencies(nBatches);
+	
+	std::atomic<int> next(0);
+	std::mutex errorMutex;
+	std::exception_ptr error;
+	
+	auto worker = [&] ()
+	{
+		try
+		{
+			MNISTSource images;
+			if (! images.open(inferSet.c_str(), false))
+				throw std::runtime_error("unable to open '" + inferSet + "'");
+			
+			nn::NeuralNetwork::Workspace workspace;
+			nn::Population::Sample sample;
+			
+			// The last batch may be shorter, it takes the first rows
+			nn::Matrix inputs(inferBatch, network.numInputs(), nn::MatrixInit::UNINITIALIZED);
+			
+			for (int ibatch = next++; ibatch < nBatches; ibatch = next++)
+			{
+				auto t0 = std::chrono::high_resolution_clock::now();
+				
+				const size_t first = (size_t)ibatch * inferBatch;
+				const int n = (int)std::min((size_t)inferBatch, nImages - first);
+				
+				for (int s = 0; s < n; ++s)
+				{
+					images.read(first + s, sample);
+					std::copy(sample._input.ptr(), sample._input.ptr() + network.numInputs(), &inputs(s, 0));
+					if (source.labeled())
+						labels[first + s] = argmax(sample._target);
+				}
+				
+				const nn::Matrix &outputs = network.forwardBatch(inputs, n, workspace);
+				for (int s = 0; s < n; ++s)
+				{
+					guesses[first + s] = argmaxRow(outputs, s);
+				}
+				
+				auto t1 = std::chrono::high_resolution_clock::now();
+				latencies[ibatch] = std::chrono::duration<double>(t1 - t0).count();
+			}
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(errorMutex);
+			if (! error)
+				error = std::current_exception();
+			
+			// The other workers stop after their current batch
+			next = nBatches;
+		}
+	};
+	
+	auto t0 = std::chrono::high_resolution_clock::now();
+	
+	std::vector<std::thread> threads;
+	for (int i = 0; i < nWorkers; ++i)
+	{
+		threads.push_back(std::thread(worker));
+		
+		if (scheduler._pin)
+			nn::Topology::pinThread(threads.back(), cpus[i % cpus.size()]);
+		else
+			nn::Topology::restrictThread(threads.back(), cpus);
+	}
+	
+	for (std::thread &thread : threads)
+	{
+		thread.join();
+	}
+	
+	auto t1 = std::chrono::high_resolution_clock::now();
+	
+	if (error)
+		std::rethrow_exception(error);
+	
+	FILE *file = fopen(predictions.c_str(), "w");
+	if (file == nullptr)
+		throw std::runtime_error("unable to write '" + predictions + "'");
+	
+	int correct = 0;
+	for (size_t i = 0; i < nImages; ++i)
+	{
+		fprintf(file, "%d\n", guesses[i]);
+		correct += (guesses[i] == labels[i]) ? 1 : 0;
+	}
+	fclose(file);
+	
+	std::sort(latencies.begin(), latencies.end());
+	auto percentile = [&] (double p) { return latencies.empty() ? 0.0 : latencies[(size_t)(p * (latencies.size() - 1))]; };
+	
+	std::chrono::duration<double> elapsed_seconds = t1 - t0;
+	printf("duration: %s, %.0f images/s, batch latency p50: %.3f ms, p99: %.3f ms\n", 
+		durationstring(elapsed_seconds).c_str(), 
+		nImages / std::max(1e-9, elapsed_seconds.count()), 
+		1e3 * percentile(0.50), 
+		1e3 * percentile(0.99));
+	if (source.labeled())
+		printf("top-1 accuracy: %5.2f%%, ", 100.0 * correct / std::max((size_t)1, nImages));
+	printf("predictions written to '%s'\n", predictions.c_str());
+}
+
+// Runs the server and prints its counters every 5 seconds
+void runServer()
+{
+	nn::NeuralNetwork network = nn::NeuralNetwork::load(serveNetwork);
+	
+	if (serveConfig._path.empty())
+		serveConfig._path = "nnd.sock";
+	serveConfig._scheduler = scheduler;
+	
+	nn::InferenceServer server(network, serveConfig);
+	printf("Serving '%s' on '%s', batches of up to %d requests within %d us, queue of %d requests\n", 
+		serveNetwork.c_str(), 
+		serveConfig._path.c_str(), 
+		serveConfig._maxBatch, 
+		serveConfig._maxDelay, 
+		serveConfig._queueCapacity);
+	
+	const auto end = std::chrono::steady_clock::now() + std::chrono::seconds(serveSeconds);
+	for (;;)
+	{
+		auto next = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+		if (serveSeconds > 0)
+			next = std::min(next, end);
+		std::this_thread::sleep_until(next);
+		
+		const nn::InferenceServer::Statistics s = server.statistics();
+		printf("requests: %llu, rejected: %llu, batches: %llu (mean size %.1f), %.0f requests/s, latency p50: %.3f ms, p99: %.3f ms, queued: %d, connections: %d\n", 
+			(unsigned long long)s._requests, 
+			(unsigned long long)s._rejected, 
+			(unsigned long long)s._batches, 
+			s._meanBatchSize, 
+			s._requestsPerSecond, 
+			1e3 * s._p50Latency, 
+			1e3 * s._p99Latency, 
+			s._queued, 
+			s._connections);
+		
+		if (serveSeconds > 0 && std::chrono::steady_clock::now() >= end)
+			break;
+	}
+	
+	server.stop();
+}
+
+void copyPopulationData(float *data, const nn::Population &population, int begin, int end)
+{
+	float *p = data;
+	
+	// Seed chain subjects are rebuilt one at a time
+	nn::Population::BrainScratch scratch;
+	for (int isubject = begin; isubject < end; ++isubject)
+	{
+		const nn::NeuralNetwork &brain = population.brain(*population.subjects()[isubject], scratch);
+		for (const nn::NeuralNetwork::Layer &layer : brain.layers())
+		{
+			if (layer._type != nn::LayerType::DENSE || layer.factorized())
+				throw std::runtime_error("the Vulkan backend only supports dense layers");
+			
+			// Blocks are contiguous row ranges
+			for (int ib = 0; ib < layer._weights.numBlocks(); ++ib)
+			{
+				int n = layer._weights.blockNumRows(ib) * layer._weights.numColumns();
+				memcpy(p, layer._weights.row(layer._weights.blockFirstRow(ib)), sizeof(float) * n);
+				p += n;
+			}
+			
+			memcpy(p, layer._biases.ptr(), sizeof(float) * layer._biases.numRows() * layer._biases.numColumns());
+			p += layer._biases.numRows() * layer._biases.numColumns();
+		}
+	}
+}
+
+// IEEE 754 binary16, rounded to nearest even
+uint16_t floatToHalf(float f)
+{
+	uint32_t x;
+	memcpy(&x, &f, sizeof(x));
+	
+	uint32_t sign = (x >> 16) & 0x8000;
+	int32_t exponent = (int32_t)((x >> 23) & 0xff) - 127 + 15;
+	uint32_t mantissa = x & 0x7fffff;
+	
+	// Infinities and NaNs
+	if (((x >> 23) & 0xff) == 0xff)
+		return (uint16_t)(sign | 0x7c00 | (mantissa != 0 ? 0x200 : 0));
+	
+	if (exponent >= 31)
+		return (uint16_t)(sign | 0x7c00);
+	
+	uint32_t shift = 13;
+	if (exponent <= 0)
+	{
+		// Subnormal, or zero when even the rounding cannot reach the smallest subnormal
+		if (exponent < -10)
+			return (uint16_t)sign;
+		
+		mantissa |= 0x800000;
+		shift = 14 - exponent;
+		exponent = 0;
+	}
+	
+	uint32_t h = sign | ((uint32_t)exponent << 10) | (mantissa >> shift);
+	uint32_t remainder = mantissa & ((1u << shift) - 1);
+	uint32_t halfway = 1u << (shift - 1);
+	
+	// A carry into the exponent is the correct rounding
+	if (remainder > halfway || (remainder == halfway && (h & 1) != 0))
+		++h;
+	
+	return (uint16_t)h;
+}
+
+void copyPopulationData(uint16_t *data, const nn::Population &population, int begin, int end)
+{
+	uint16_t *p = data;
+	
+	// Seed chain subjects are rebuilt one at a time
+	nn::Population::BrainScratch scratch;
+	for (int isubject = begin; isubject < end; ++isubject)
+	{
+		const nn::NeuralNetwork &brain = population.brain(*population.subjects()[isubject], scratch);
+		for (const nn::NeuralNetwork::Layer &layer : brain.layers())
+		{
+			if (layer._type != nn::LayerType::DENSE || layer.factorized())
+				throw std::runtime_error("the Vulkan backend only supports dense layers");
+			
+			for (int ir = 0; ir < layer._weights.numRows(); ++ir)
+			{
+				const float *weights = layer._weights.row(ir);
+				for (int ic = 0; ic < layer._weights.numColumns(); ++ic)
+					*p++ = floatToHalf(weights[ic]);
+			}
+			
+			const float *biases = layer._biases.ptr();
+			for (int i = 0; i < layer._biases.numRows() * layer._biases.numColumns(); ++i)
+				*p++ = floatToHalf(biases[i]);
+		}
+	}
+}
+
+void selectBatch(std::vector<const nn::Population::Sample *> &batch, const std::vector<nn::Population::Sample> &samples, int ibatch, int batchSize)
+{
+	batch.resize(batchSize);
+	for (int i = 0; i < batchSize; ++i)
+		batch[i] = &samples[((size_t)ibatch * batchSize + i) % samples.size()];
+}
+
+void copySampleData(float *data, const std::vector<const nn::Population::Sample *> &samples)
+{
+	float *p = data;
+	
+	for (const nn::Population::Sample *sample : samples)
+	{
+		memcpy(p, sample->_input.ptr(), sizeof(float) * sample->_input.numRows() * sample->_input.numColumns());
+		p += sample->_input.numRows() * sample->_input.numColumns();
+	}
+}
+
+// #define VK_BACKEND
+#ifdef VK_BACKEND
+
+// Sample batches are double buffered: batch i+1 is uploaded by the transfer queue while batch i is evaluated
+const int nSlots = 2;
+
+// So are population chunks, chunk i+1 is uploaded while chunk i is evaluated
+const int nChunkSlots = 2;
+
+struct SpecializationData
+{
+	uint32_t _numInputs;
+	uint32_t _numHidden;
+	uint32_t _numOutputs;
+	uint32_t _numSamples;
+	uint32_t _weightsSize;
+	uint32_t _biasesSize;
+	uint32_t _payloadSize;
+	uint32_t _resultSize;
+};
+
+// Offsets are in elements of the bound buffers
+struct PushConstants
+{
+	uint32_t _subjectOffset;
+	uint32_t _subjectCount;
+	uint32_t _sampleOffset;
+	uint32_t _outputOffset;
+};
+
+// A range of the population evaluated by one compute queue of one device.
+// The range is streamed through the population buffer in chunks small enough for a storage buffer binding,
+// so any population size can be evaluated.
+struct VkShard
+{
+	wvk::Device *_device = nullptr;
+	uint32_t _queueIndex = 0;
+	
+	uint32_t _subjectSize = 0;
+	uint32_t _sampleSize = 0;
+	uint32_t _chunkSubjects = 0;
+	uint32_t _chunkOutputSize = 0;
+	
+	// Half floats when the device has 16-bit storage
+	uint32_t _populationElementSize = sizeof(float);
+	
+	wvk::StagingRing *_staging = nullptr;
+	
+	// Value n is signalled once the shard has completed n dispatches, over all generations
+	VkSemaphore _timeline = VK_NULL_HANDLE;
+	uint64_t _evaluated = 0;
+	
+	// nChunkSlots chunks, nSlots batches and nSlots outputs, the outputs are host visible
+	wvk::Buffer *_populationBuffer = nullptr;
+	wvk::Buffer *_sampleBuffer = nullptr;
+	wvk::Buffer *_outputBuffer = nullptr;
+	const float *_outputs = nullptr;
+	
+	VkDescriptorSetLayout _descriptorSetLayout = VK_NULL_HANDLE;
+	VkPipelineLayout _pipelineLayout = VK_NULL_HANDLE;
+	VkDescriptorPool _descriptorPool = VK_NULL_HANDLE;
+	VkDescriptorSet _descriptorSet = VK_NULL_HANDLE;
+	wvk::ComputePipelineManager::Pipeline *_pipeline = nullptr;
+	
+	// Profiler tracks of the dispatches, of the host readback and of the uploads
+	std::string _track;
+	std::string _hostTrack;
+	std::string _transferTrack;
+	
+	void create(wvk::Device *device, uint32_t queueIndex);
+	void destroy();
+	
+	// Evaluates subjects [begin, end) on nBatches batches and sets their score, returns the elapsed seconds.
+	// Runs on its own thread, command buffers come from that thread's pools.
+	double evaluate(nn::Population &population, int begin, int end, const std::vector<nn::Population::Sample> &samples);
+};
+
+void VkShard::create(wvk::Device *device, uint32_t queueIndex)
+{
+	_device = device;
+	_queueIndex = queueIndex;
+	
+	char track[64];
+	sprintf(track, "compute %u", queueIndex);
+	_track = track;
+	sprintf(track, "host %u", queueIndex);
+	_hostTrack = track;
+	sprintf(track, "transfer %u", queueIndex);
+	_transferTrack = track;
+	
+	_subjectSize = 
+		nInputs * nHidden + nHidden + 
+		nHidden * nOutputs + nOutputs;
+	_sampleSize = nSamples * nInputs;
+	
+	if (_device->storage16BitEnabled())
+		_populationElementSize = sizeof(uint16_t);
+	
+	// Each buffer is bound whole, with the slots selected by push constant offsets
+	const VkPhysicalDeviceLimits &limits = _device->properties().limits;
+	
+	VkDeviceSize subjectBytes = (VkDeviceSize)_populationElementSize * _subjectSize;
+	VkDeviceSize subjectOutputBytes = sizeof(float) * nSamples * nOutputs;
+	
+	VkDeviceSize maxChunkSubjects = std::min(
+		limits.maxStorageBufferRange / (nChunkSlots * subjectBytes), 
+		limits.maxStorageBufferRange / (nSlots * subjectOutputBytes));
+	maxChunkSubjects = std::min(maxChunkSubjects, (VkDeviceSize)limits.maxComputeWorkGroupCount[0] * 32);
+	
+	if (vkChunkSubjects > 0)
+		maxChunkSubjects = std::min(maxChunkSubjects, (VkDeviceSize)vkChunkSubjects);
+	
+	if (maxChunkSubjects == 0 || sizeof(float) * nSlots * _sampleSize > limits.maxStorageBufferRange)
+	{
+		throw std::runtime_error("subjects or sample batches do not fit in a storage buffer");
+	}
+	
+	_chunkSubjects = (uint32_t)std::min((VkDeviceSize)nSubjects, maxChunkSubjects);
+	_chunkOutputSize = _chunkSubjects * nSamples * nOutputs;
+	
+	wvk::BufferManager *bmanager = _device->bufferManager();
+	
+	// Room for one upload per slot
+	_staging = new wvk::StagingRing(_device, 
+		(VkDeviceSize)_populationElementSize * nChunkSlots * _chunkSubjects * _subjectSize + 
+		sizeof(float) * nSlots * _sampleSize, 
+		_transferTrack);
+	
+	_timeline = _device->createTimelineSemaphore(0);
+	
+	_populationBuffer = bmanager->create(
+		(VkDeviceSize)_populationElementSize * nChunkSlots * _chunkSubjects * _subjectSize, 
+		VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, 
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+	);
+	
+	_sampleBuffer = bmanager->create(
+		sizeof(float) * nSlots * _sampleSize, 
+		VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, 
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+	);
+	
+	_outputBuffer = bmanager->create(
+		sizeof(float) * nSlots * _chunkOutputSize, 
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, 
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
+	);
+	
+	_outputs = (const float *)_device->memoryManager()->map(_outputBuffer->_dm);
+	
+	// ---------------------------------------------------------------------------------------------------------------
+	std::array<VkDescriptorSetLayoutBinding, 3> bindings = {};
+	
+	for (uint32_t i = 0; i < (uint32_t)bindings.size(); ++i)
+	{
+		bindings[i].binding = i;
+		bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		bindings[i].descriptorCount = 1;
+		bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+		bindings[i].pImmutableSamplers = nullptr;
+	}
+	
+	VkDescriptorSetLayoutCreateInfo dslcInfo = {};
+	dslcInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	dslcInfo.flags = 0;
+	dslcInfo.bindingCount = (uint32_t)bindings.size();
+	dslcInfo.pBindings = bindings.data();
+	
+	if (vkCreateDescriptorSetLayout(*_device, &dslcInfo, nullptr, &_descriptorSetLayout) != VK_SUCCESS)
+	{
+		throw std::runtime_error("failed to create descriptor set layout");
+	}
+	
+	_device->registerDescriptorSetLayout(_descriptorSetLayout);
+	
+	// ---------------------------------------------------------------------------------------------------------------
+	VkPushConstantRange pushConstantRange = {};
+	pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	pushConstantRange.offset = 0;
+	pushConstantRange.size = sizeof(PushConstants);
+	
+	VkPipelineLayoutCreateInfo plcInfo = {};
+	plcInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	plcInfo.flags = 0;
+	plcInfo.setLayoutCount = 1;
+	plcInfo.pSetLayouts = &_descriptorSetLayout;
+	plcInfo.pushConstantRangeCount = 1;
+	plcInfo.pPushConstantRanges = &pushConstantRange;
+	
+	if (vkCreatePipelineLayout(*_device, &plcInfo, nullptr, &_pipelineLayout) != VK_SUCCESS)
+	{
+		throw std::runtime_error("failed to create pipeline layout");
+	}
+	
+	_device->registerPipelineLayout(_pipelineLayout);
+	
+	// ---------------------------------------------------------------------------------------------------------------
+	VkDescriptorPoolSize descriptorPoolSize = {};
+	descriptorPoolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	descriptorPoolSize.descriptorCount = (uint32_t)bindings.size();
+	
+	VkDescriptorPoolCreateInfo dpcInfo = {};
+	dpcInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	dpcInfo.maxSets = 1;
+	dpcInfo.poolSizeCount = 1;
+	dpcInfo.pPoolSizes = &descriptorPoolSize;
+	
+	if (vkCreateDescriptorPool(*_device, &dpcInfo, nullptr, &_descriptorPool) != VK_SUCCESS)
+	{
+		throw std::runtime_error("failed to create descriptor pool");
+	}
+	
+	// ---------------------------------------------------------------------------------------------------------------
+	SpecializationData sdata;
+	sdata._numInputs = nInputs;
+	sdata._numHidden = nHidden;
+	sdata._numOutputs = nOutputs;
+	sdata._numSamples = nSamples;
+	sdata._weightsSize = std::max(nInputs * nHidden, nHidden * nOutputs);
+	sdata._biasesSize = std::max(nHidden, nOutputs);
+	sdata._payloadSize = std::max(nInputs, nHidden);
+	sdata._resultSize = std::max(nHidden, nOutputs);
+	
+	std::array<VkSpecializationMapEntry, 8> specializationEntries = {};
+	for (uint32_t i = 0; i < (uint32_t)specializationEntries.size(); ++i)
+	{
+		specializationEntries[i].constantID = i + 1;
+		specializationEntries[i].offset = i * sizeof(uint32_t);
+		specializationEntries[i].size = sizeof(uint32_t);
+	}
+	
+	VkSpecializationInfo specializationInfo = {};
+	specializationInfo.mapEntryCount = static_cast<uint32_t>(specializationEntries.size());
+	specializationInfo.pMapEntries = specializationEntries.data();
+	specializationInfo.dataSize = sizeof(SpecializationData);
+	specializationInfo.pData = &sdata;
+	
+	// ---------------------------------------------------------------------------------------------------------------
+	const char *shaderFileName = (_populationElementSize == sizeof(uint16_t)) ? "shaders/feed_forward_fp16.spirv" : "shaders/feed_forward.spirv";
+	
+	VkComputePipelineCreateInfo cpcInfo = {};
+	cpcInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	cpcInfo.flags = 0;
+	cpcInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	cpcInfo.stage.flags = 0;
+	cpcInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	cpcInfo.stage.module = _device->getOrCreateShaderModule(shaderFileName)._module;
+	cpcInfo.stage.pName = "main";
+	cpcInfo.stage.pSpecializationInfo = &specializationInfo;
+	cpcInfo.layout = _pipelineLayout;
+	cpcInfo.basePipelineHandle = VK_NULL_HANDLE;
+	cpcInfo.basePipelineIndex = -1;
+	
+	_pipeline = _device->computePipelineManager()->create(cpcInfo);
+	
+	// ---------------------------------------------------------------------------------------------------------------
+	VkDescriptorSetAllocateInfo dsacInfo = {};
+	dsacInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	dsacInfo.descriptorPool = _descriptorPool;
+	dsacInfo.descriptorSetCount = 1;
+	dsacInfo.pSetLayouts = &_descriptorSetLayout;
+	
+	if (vkAllocateDescriptorSets(*_device, &dsacInfo, &_descriptorSet) != VK_SUCCESS)
+	{
+		throw std::runtime_error("failed to allocate descriptor sets");
+	}
+	
+	std::array<VkDescriptorBufferInfo, 3> bufferInfos = {};
+	bufferInfos[0].buffer = _populationBuffer->_handle;
+	bufferInfos[1].buffer = _sampleBuffer->_handle;
+	bufferInfos[2].buffer = _outputBuffer->_handle;
+	
+	std::array<VkWriteDescriptorSet, 3> descriptorWrites = {};
+	
+	for (uint32_t i = 0; i < (uint32_t)descriptorWrites.size(); ++i)
+	{
+		bufferInfos[i].offset = 0;
+		bufferInfos[i].range = VK_WHOLE_SIZE;
 		
-		// ---------------------------------------------------------------------------------------------------------------
-		// SpecializationData sdata;
-		// sdata._numInputs = nInputs;
-		// sdata._numHidden = nHidden;
-		// sdata._numOutputs = nOutputs;
-		
-		// VkSpecializationMapEntry specializationEntry = {};
-		// specializationEntry.constantID = 0;
-		// specializationEntry.offset = offsetof(SpecializationData, _wireframe);
-		// specializationEntry.size = sizeof(sdata._wireframe);
-		
-		// VkSpecializationInfo specializationInfo = {};
-		// specializationInfo.mapEntryCount = 1;
-		// specializationInfo.pMapEntries = &specializationEntry;
-		// specializationInfo.dataSize = sizeof(SpecializationData);
-		// specializationInfo.pData = &sdata;
+		descriptorWrites[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		descriptorWrites[i].dstSet = _descriptorSet;
+		descriptorWrites[i].dstBinding = i;
+		descriptorWrites[i].dstArrayElement = 0;
+		descriptorWrites[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		descriptorWrites[i].descriptorCount = 1;
+		descriptorWrites[i].pImageInfo = nullptr;
+		descriptorWrites[i].pBufferInfo = &bufferInfos[i];
+		descriptorWrites[i].pTexelBufferView = nullptr;
+	}
+	
+	vkUpdateDescriptorSets(*_device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, nullptr);
+}
+
+double VkShard::evaluate(nn::Population &population, int begin, int end, const std::vector<nn::Population::Sample> &samples)
+{
+	auto t0 = std::chrono::high_resolution_clock::now();
+	
+	uint32_t subjectCount = end - begin;
+	if (subjectCount == 0)
+		return 0.0;
+	
+	// Every chunk is evaluated on every batch, dispatch i is batch i % nBatches of chunk i / nBatches
+	int nChunks = (subjectCount + _chunkSubjects - 1) / _chunkSubjects;
+	int nDispatches = nChunks * nBatches;
+	
+	auto chunkCount = [&] (int ichunk) {
+		return std::min(_chunkSubjects, subjectCount - ichunk * _chunkSubjects);
+	};
+	
+	// Timeline values of this generation start after the dispatches of the previous ones
+	uint64_t base = _evaluated;
+	
+	// Uploads a chunk into its slot, the transfer queue waits for the last dispatch of the chunk that used the slot
+	auto uploadChunk = [&] (int ichunk) {
+		int first = begin + ichunk * _chunkSubjects;
+		uint32_t count = chunkCount(ichunk);
 		
-		// ---------------------------------------------------------------------------------------------------------------
-		VkComputePipelineCreateInfo cpcInfo = {};
-		cpcInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
-		cpcInfo.flags = 0;
-		cpcInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-		cpcInfo.stage.flags = 0;
-		cpcInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
-		cpcInfo.stage.module = device.getOrCreateShaderModule("shaders/feed_forward.spirv")._module;
-		cpcInfo.stage.pName = "main";
-		cpcInfo.stage.pSpecializationInfo = nullptr;
-		cpcInfo.layout = pipelineLayout;
-		cpcInfo.basePipelineHandle = VK_NULL_HANDLE;
-		cpcInfo.basePipelineIndex = -1;
-		
-		wvk::ComputePipelineManager *cpManager = device.computePipelineManager();
-		wvk::ComputePipelineManager::Pipeline *pipeline = cpManager->create(cpcInfo);
+		wvk::StagingRing::Allocation populationData = _staging->allocate((VkDeviceSize)_populationElementSize * count * _subjectSize);
 		
-		// ---------------------------------------------------------------------------------------------------------------
-		VkDescriptorSetAllocateInfo dsacInfo = {};
-		dsacInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-		dsacInfo.descriptorPool = descriptorPool;
-		dsacInfo.descriptorSetCount = 1;
-		dsacInfo.pSetLayouts = &descriptorSetLayout;
+		if (_populationElementSize == sizeof(uint16_t))
+			copyPopulationData((uint16_t *)populationData._data, population, first, first + count);
+		else
+			copyPopulationData((float *)populationData._data, population, first, first + count);
 		
-		VkDescriptorSet descriptorSet;
-		if (vkAllocateDescriptorSets(device, &dsacInfo, &descriptorSet) != VK_SUCCESS)
+		_staging->copy(populationData, _populationBuffer, (VkDeviceSize)_populationElementSize * (ichunk % nChunkSlots) * _chunkSubjects * _subjectSize);
+		
+		wvk::Device::TimelinePoint slotAvailable;
+		if (ichunk >= nChunkSlots)
 		{
-			throw std::runtime_error("failed to allocate descriptor sets");
+			slotAvailable._semaphore = _timeline;
+			slotAvailable._value = base + (uint64_t)(ichunk - nChunkSlots + 1) * nBatches;
 		}
 		
-		// ---------------------------------------------------------------------------------------------------------------
-		#ifdef DATA_BUFFER_BACKED
-			VkDescriptorBufferInfo populationBufferInfo = {};
-			populationBufferInfo.buffer = populationBuffer->_handle;
-			populationBufferInfo.offset = 0;
-			populationBufferInfo.range = VK_WHOLE_SIZE;
-			
-			VkDescriptorBufferInfo sampleBufferInfo = {};
-			sampleBufferInfo.buffer = sampleBuffer->_handle;
-			sampleBufferInfo.offset = 0;
-			sampleBufferInfo.range = VK_WHOLE_SIZE;
-			
-			std::array<VkWriteDescriptorSet, 2> descriptorWrites = {};
-			
-			descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-			descriptorWrites[0].dstSet = descriptorSet;
-			descriptorWrites[0].dstBinding = 0;
-			descriptorWrites[0].dstArrayElement = 0;
-			descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-			descriptorWrites[0].descriptorCount = 1;
-			descriptorWrites[0].pImageInfo = nullptr;
-			descriptorWrites[0].pBufferInfo = &populationBufferInfo;
-			descriptorWrites[0].pTexelBufferView = nullptr;
-			
-			descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-			descriptorWrites[1].dstSet = descriptorSet;
-			descriptorWrites[1].dstBinding = 1;
-			descriptorWrites[1].dstArrayElement = 0;
-			descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-			descriptorWrites[1].descriptorCount = 1;
-			descriptorWrites[1].pImageInfo = nullptr;
-			descriptorWrites[1].pBufferInfo = &sampleBufferInfo;
-			descriptorWrites[1].pTexelBufferView = nullptr;
-		#endif
-		
-		#ifdef DATA_IMAGE_BACKED
-			VkSampler nearestSampler = VK_NULL_HANDLE;
-			{
-				VkSamplerCreateInfo nearestSamplerCI = {};
-				nearestSamplerCI.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
-				nearestSamplerCI.minFilter = VK_FILTER_NEAREST;
-				nearestSamplerCI.magFilter = VK_FILTER_NEAREST;
-				nearestSamplerCI.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-				nearestSamplerCI.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-				nearestSamplerCI.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-				nearestSamplerCI.anisotropyEnable = VK_FALSE;
-				nearestSamplerCI.maxAnisotropy = 0;
-				nearestSamplerCI.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
-				nearestSamplerCI.unnormalizedCoordinates = VK_FALSE;
-				nearestSamplerCI.compareEnable = VK_FALSE;
-				nearestSamplerCI.compareOp = VK_COMPARE_OP_ALWAYS;
-				nearestSamplerCI.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
-				nearestSamplerCI.minLod = 0.0f;
-				nearestSamplerCI.maxLod = 0.0f;
-				nearestSamplerCI.mipLodBias = 0.0f;
+		return _staging->flush(slotAvailable, VK_PIPELINE_STAGE_TRANSFER_BIT);
+	};
+	
+	// Uploads the batch of a dispatch into its slot, the transfer queue waits for the dispatch that last used the slot
+	auto uploadBatch = [&] (int idispatch) {
+		std::vector<const nn::Population::Sample *> batch;
+		selectBatch(batch, samples, idispatch % nBatches, nSamples);
+		
+		wvk::StagingRing::Allocation sampleData = _staging->allocate(sizeof(float) * _sampleSize);
+		copySampleData((float *)sampleData._data, batch);
+		
+		_staging->copy(sampleData, _sampleBuffer, sizeof(float) * (idispatch % nSlots) * _sampleSize);
+		
+		wvk::Device::TimelinePoint slotAvailable;
+		if (idispatch >= nSlots)
+		{
+			slotAvailable._semaphore = _timeline;
+			slotAvailable._value = base + idispatch - nSlots + 1;
+		}
+		
+		return _staging->flush(slotAvailable, VK_PIPELINE_STAGE_TRANSFER_BIT);
+	};
+	
+	// Recorded once per chunk slot, batch slot and subject count (only the last chunk may be smaller), then resubmitted
+	// The profiler scope of a command buffer is collected after each of its submissions, before the next one
+	struct DispatchCommands
+	{
+		wvk::Device::CommandBuffer *_cb;
+		wvk::Profiler::Scope _scope;
+	};
+	
+	using CommandBufferKey = std::tuple<int, int, uint32_t>;
+	std::map<CommandBufferKey, DispatchCommands> commandBuffers;
+	wvk::Profiler *profiler = _device->profiler();
+	
+	auto dispatchKey = [&] (int idispatch) {
+		int ichunk = idispatch / nBatches;
+		return std::make_tuple(ichunk % nChunkSlots, idispatch % nSlots, chunkCount(ichunk));
+	};
+	
+	auto dispatchCommands = [&] (int idispatch) {
+		CommandBufferKey key = dispatchKey(idispatch);
+		
+		auto it = commandBuffers.find(key);
+		if (it != commandBuffers.end())
+			return it->second._cb;
+		
+		int ichunkSlot = std::get<0>(key);
+		int islot = std::get<1>(key);
+		uint32_t count = std::get<2>(key);
+		
+		PushConstants pc;
+		pc._subjectOffset = ichunkSlot * _chunkSubjects * _subjectSize;
+		pc._subjectCount = count;
+		pc._sampleOffset = islot * _sampleSize;
+		pc._outputOffset = islot * _chunkOutputSize;
+		
+		wvk::Device::CommandBuffer *cb = _device->allocateCommandBuffer(wvk::Device::QueueType::COMPUTE);
+		_device->beginRecordCommands(cb, VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT);
+			wvk::Profiler::Scope scope = profiler->begin(cb, "dispatch", _track);
+			
+			vkCmdBindPipeline(cb->_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, _pipeline->_pipeline);
+			
+			vkCmdBindDescriptorSets(
+				cb->_buffer, 				// commandBuffer
+				VK_PIPELINE_BIND_POINT_COMPUTE, 	// pipelineBindPoint
+				_pipelineLayout, 			// layout
+				0, 							// firstSet
+				1, 							// descriptorSetCount
+				&_descriptorSet, 			// pDescriptorSets
+				0, 							// dynamicOffsetCount
+				nullptr 					// pDynamicOffsets
+			);
+			
+			vkCmdPushConstants(cb->_buffer, _pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &pc);
+			
+			vkCmdDispatch(cb->_buffer, (count + 31) / 32, 1, 1);
+			
+			// Outputs are read back by the host
+			VkMemoryBarrier outputBarrier = {};
+			outputBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+			outputBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+			outputBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+			
+			vkCmdPipelineBarrier(
+				cb->_buffer, 
+				VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 
+				VK_PIPELINE_STAGE_HOST_BIT, 
+				0, 
+				1, &outputBarrier, 
+				0, nullptr, 
+				0, nullptr
+			);
+			
+			profiler->end(cb, scope);
+		_device->endRecordCommands(cb);
+		
+		DispatchCommands commands;
+		commands._cb = cb;
+		commands._scope = scope;
+		commandBuffers[key] = commands;
+		return cb;
+	};
+	
+	// Counts the samples each subject classifies correctly
+	std::vector<int> correct(subjectCount, 0);
+	
+	auto gatherDispatch = [&] (int idispatch) {
+		wvk::Device::TimelinePoint evaluated;
+		evaluated._semaphore = _timeline;
+		evaluated._value = base + idispatch + 1;
+		_device->waitTimeline(evaluated);
+		
+		profiler->collect(commandBuffers[dispatchKey(idispatch)]._scope);
+		
+		uint64_t readbackBegin = wvk::Profiler::now();
+		
+		std::vector<const nn::Population::Sample *> batch;
+		selectBatch(batch, samples, idispatch % nBatches, nSamples);
+		
+		int ichunk = idispatch / nBatches;
+		uint32_t first = ichunk * _chunkSubjects;
+		uint32_t count = chunkCount(ichunk);
+		
+		const float *outputs = _outputs + (size_t)(idispatch % nSlots) * _chunkOutputSize;
+		for (uint32_t isubject = 0; isubject < count; ++isubject)
+		{
+			for (int isample = 0; isample < nSamples; ++isample)
+			{
+				const float *o = outputs + ((size_t)isubject * nSamples + isample) * nOutputs;
+				const float *t = batch[isample]->_target.ptr();
 				
-				if (vkCreateSampler(device, &nearestSamplerCI, nullptr, &nearestSampler) != VK_SUCCESS)
-				{
-					throw std::runtime_error("failed to create texture sampler!");
-				}
+				if (std::max_element(o, o + nOutputs) - o == std::max_element(t, t + nOutputs) - t)
+					correct[first + isubject] += 1;
+			}
+		}
+		
+		profiler->addHostEvent("readback", _hostTrack, readbackBegin, wvk::Profiler::now());
+	};
+	
+	std::vector<wvk::Device::TimelinePoint> chunkUploaded(nChunks);
+	for (int ichunk = 0; ichunk < std::min(nChunkSlots, nChunks); ++ichunk)
+	{
+		chunkUploaded[ichunk] = uploadChunk(ichunk);
+	}
+	
+	std::vector<wvk::Device::TimelinePoint> batchUploaded(nDispatches);
+	for (int idispatch = 0; idispatch < std::min(nSlots, nDispatches); ++idispatch)
+	{
+		batchUploaded[idispatch] = uploadBatch(idispatch);
+	}
+	
+	for (int idispatch = 0; idispatch < nDispatches; ++idispatch)
+	{
+		int ichunk = idispatch / nBatches;
+		
+		// The outputs of the dispatch that last used this slot are read before being overwritten
+		if (idispatch >= nSlots)
+		{
+			gatherDispatch(idispatch - nSlots);
+		}
+		
+		// Both uploads signal the staging ring timeline, waiting for the latest covers the other
+		wvk::Device::TimelinePoint uploaded = batchUploaded[idispatch];
+		if (chunkUploaded[ichunk]._value > uploaded._value)
+			uploaded = chunkUploaded[ichunk];
+		
+		wvk::Device::TimelinePoint evaluated;
+		evaluated._semaphore = _timeline;
+		evaluated._value = base + idispatch + 1;
+		
+		wvk::Device::CommandBuffer *cb = dispatchCommands(idispatch);
+		_device->submitComputeCommands(_queueIndex, cb, uploaded, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, evaluated);
+		
+		// The next batch for this slot is uploaded while this one is being evaluated
+		if (idispatch + nSlots < nDispatches)
+		{
+			batchUploaded[idispatch + nSlots] = uploadBatch(idispatch + nSlots);
+		}
+		
+		// Likewise for the next chunk using this chunk slot, once every dispatch of this chunk is submitted
+		if (idispatch % nBatches == nBatches - 1 && ichunk + nChunkSlots < nChunks)
+		{
+			chunkUploaded[ichunk + nChunkSlots] = uploadChunk(ichunk + nChunkSlots);
+		}
+	}
+	
+	for (int idispatch = std::max(0, nDispatches - nSlots); idispatch < nDispatches; ++idispatch)
+	{
+		gatherDispatch(idispatch);
+	}
+	
+	_evaluated = base + nDispatches;
+	
+	// Score is the fraction of misclassified samples, lower is better as for the mean loss of the CPU path
+	for (uint32_t isubject = 0; isubject < subjectCount; ++isubject)
+	{
+		population.subjects()[begin + isubject]->_score = 1.0 - (double)correct[isubject] / ((double)nBatches * nSamples);
+	}
+	
+	// Everything submitted by this thread is complete, its command buffers go away with its pools
+	_staging->waitIdle();
+	_device->destroyThreadCommandPools();
+	
+	for (auto &item : commandBuffers)
+	{
+		profiler->release(item.second._scope);
+	}
+	
+	auto t1 = std::chrono::high_resolution_clock::now();
+	std::chrono::duration<double> elapsed_seconds = t1 - t0;
+	return elapsed_seconds.count();
+}
+
+void VkShard::destroy()
+{
+	wvk::BufferManager *bmanager = _device->bufferManager();
+	
+	vkDestroyDescriptorPool(*_device, _descriptorPool, nullptr);
+	
+	_device->computePipelineManager()->destroy(_pipeline);
+	
+	delete _staging;
+	_device->destroySemaphore(_timeline);
+	
+	_device->memoryManager()->unmap(_outputBuffer->_dm);
+	
+	bmanager->destroy(_populationBuffer);
+	bmanager->destroy(_sampleBuffer);
+	bmanager->destroy(_outputBuffer);
+}
+
+#endif // VK_BACKEND
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		parse_arguments(argc, argv);
+		
+		nn::MatrixMemoryAllocator::instance()->configure(16 * 1024 * 1024, hugePages, numa);
+		
+		// Before any network is built
+		if (noJit)
+			nn::Jit::instance().setEnabled(false);
+		printf("JIT kernels %s\n", nn::Jit::instance().isEnabled() ? "enabled" : "disabled");
+		
+		if (! inferNetwork.empty())
+		{
+			runInference();
+			return 0;
+		}
+		
+		if (! serveNetwork.empty())
+		{
+			runServer();
+			return 0;
+		}
+		
+		// Every generation is evaluated on the next nSamples minibatch, decoded while the previous one is evaluated
+		MNISTSource trainingsource;
+		if (! trainingsource.open("MNIST/train"))
+			throw std::runtime_error("unable to open the MNIST training set");
+		
+		nn::DataPipeline pipeline(&trainingsource, nSamples, pipelineDepth, seed);
+		
+		std::vector<nn::NeuralNetwork::LayerInfo> layers = {
+			{ nHidden, nn::ActivationFunction::SIGMOID, hiddenRank }, 
+			{ nOutputs, nn::ActivationFunction::SOFTMAX }
+		};
+		
+		// 28x28 -> 8x24x24 -> 8x12x12 -> 16x8x8 -> 16x4x4 -> 10
+		if (conv)
+		{
+			layers = {
+				nn::NeuralNetwork::LayerInfo::conv2d(8, 5, nn::ActivationFunction::SIGMOID, 28, 28), 
+				nn::NeuralNetwork::LayerInfo::maxPool(2), 
+				nn::NeuralNetwork::LayerInfo::conv2d(16, 5, nn::ActivationFunction::SIGMOID), 
+				nn::NeuralNetwork::LayerInfo::maxPool(2), 
+				{ nOutputs, nn::ActivationFunction::SOFTMAX }
+			};
+		}
+		
+		// Before the networks are built, they take the kernels of their shapes when they are
+		if (! noTune && nn::Jit::instance().isEnabled())
+		{
+			nn::Autotuner tuner(tuneDb);
+			int ntuned = tuner.tune(nn::NeuralNetwork(nInputs, layers, nn::LossFunction::SOFTMAX_CROSS_ENTROPY));
+			printf("Kernels tuned for %s: %d new shape(s), database '%s'\n", tuner.cpuModel().c_str(), ntuned, tuneDb.c_str());
+		}
+		
+		if (esPairs > 0)
+		{
+			nn::EvolutionStrategy::Config config;
+			config._pairs = esPairs;
+			config._sigma = esSigma;
+			config._learningRate = esLearningRate;
+			config._seed = seed;
+			config._scheduler = scheduler;
+			
+			nn::EvolutionStrategy es(nInputs, layers, nn::LossFunction::SOFTMAX_CROSS_ENTROPY, config);
+			
+			for (int i = 0; i < 10; ++i)
+			{
+				printf("Generation %3d - ", i);
+				fflush(stdout);
+				
+				const nn::DataPipeline::Batch &batch = pipeline.acquire();
+				
+				auto t0 = std::chrono::high_resolution_clock::now();
+				es.step(batch._samples);
+				auto t1 = std::chrono::high_resolution_clock::now();
+				
+				pipeline.release();
+				
+				std::chrono::duration<double> elapsed_seconds = t1 - t0;
+				std::string d = durationstring(elapsed_seconds);
+				
+				const nn::EvolutionStrategy::Statistics &s = es.statistics();
+				printf("duration: %s, mean loss: %.4f, best loss: %.4f, update: %.4f\n", d.c_str(), s._meanLoss, s._bestLoss, s._updateNorm);
 			}
 			
-			VkImageView populationImageView = VK_NULL_HANDLE;
+			if (int8Check)
+				checkQuantization(es.center());
+			
+			if (! saveNetwork.empty())
+			{
+				es.center().save(saveNetwork);
+				printf("Network saved to '%s'\n", saveNetwork.c_str());
+			}
+			
+			return 0;
+		}
+		
+		nn::Population population(
+			nSubjects, 
+			nInputs, 
+			layers, 
+			nn::LossFunction::SOFTMAX_CROSS_ENTROPY, 
+			seedChain ? nn::Population::Encoding::SEED_CHAIN : nn::Population::Encoding::FULL
+		);
+		population.setSchedulerConfig(scheduler);
+		population.setRacingConfig(racing);
+		population.setEliteCacheSize(eliteCache);
+		population.setParents(parents);
+		population.setMutationRates(minMutationRate, maxMutationRate);
+		population.setBatchSize(batchSize);
+		population.setSeed(seed);
+		
+		for (int i = 0; i < 10; ++i)
+		{
+			printf("Generation %3d - ", i);
+			fflush(stdout);
+			
+			// Time waiting for the minibatch, non-zero only when decoding is slower than evaluating
+			auto tw = std::chrono::high_resolution_clock::now();
+			const nn::DataPipeline::Batch &batch = pipeline.acquire();
+			
+			auto t0 = std::chrono::high_resolution_clock::now();
+			population.feed_forward(batch._samples);
+			auto t1 = std::chrono::high_resolution_clock::now();
+			
+			pipeline.release();
+			
+			std::chrono::duration<double> elapsed_seconds = t1 - t0;
+			std::string d = durationstring(elapsed_seconds);
+			
+			std::chrono::duration<double> wait_seconds = t0 - tw;
+			
+			nn::Population::Statistics s = population.computePopulationStatistics();
+			
+			printf("duration: %s, input wait: %.1f ms, score: %5.1f%%, ", d.c_str(), 1e3 * wait_seconds.count(), 100.0 * s._score);
+			
+			// Share of the weight blocks held only once, children share the unmutated ones with their parents
+			if (parents > 0 && s._weightBlocks > 0)
+				printf("unique blocks: %.0f%%, ", 100.0 * s._uniqueWeightBlocks / s._weightBlocks);
+			
+			// Share of the (subject, sample) evaluations done, survivors and cutoff of the first round
+			if (racing._initialSamples > 0)
 			{
-				VkImageViewCreateInfo populationImageViewCI = {};
-				populationImageViewCI.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-				populationImageViewCI.image = *populationImage;
-				populationImageViewCI.viewType = VK_IMAGE_VIEW_TYPE_1D;
-				populationImageViewCI.format = populationImage->_ci.format;
-				populationImageViewCI.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-				populationImageViewCI.subresourceRange.baseMipLevel = 0;
-				populationImageViewCI.subresourceRange.levelCount = 1;
-				populationImageViewCI.subresourceRange.baseArrayLayer = 0;
-				populationImageViewCI.subresourceRange.layerCount = 1;
+				const std::vector<nn::Population::RacingRound> &rounds = population.racingRounds();
 				
-				if (vkCreateImageView(device, &populationImageViewCI, nullptr, &populationImageView) != VK_SUCCESS)
+				double evaluated = 0.0;
+				for (const nn::Population::RacingRound &round : rounds)
 				{
-					throw std::runtime_error("failed to create texture image view!");
+					evaluated += (double)round._subjects * round._samples;
 				}
+				evaluated /= (double)population.subjects().size() * (rounds.back()._firstSample + rounds.back()._samples);
+				
+				printf("racing: %d rounds, %.0f%% evaluated, cutoff: %.4f, ", (int)rounds.size(), 100.0 * evaluated, rounds.front()._cutoff);
 			}
 			
-			VkImageView sampleImageView = VK_NULL_HANDLE;
+			if (i == 9 && (int8Check || ! saveNetwork.empty()))
 			{
-				VkImageViewCreateInfo sampleImageViewCI = {};
-				sampleImageViewCI.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-				sampleImageViewCI.image = *sampleImage;
-				sampleImageViewCI.viewType = VK_IMAGE_VIEW_TYPE_1D;
-				sampleImageViewCI.format = sampleImage->_ci.format;
-				sampleImageViewCI.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-				sampleImageViewCI.subresourceRange.baseMipLevel = 0;
-				sampleImageViewCI.subresourceRange.levelCount = 1;
-				sampleImageViewCI.subresourceRange.baseArrayLayer = 0;
-				sampleImageViewCI.subresourceRange.layerCount = 1;
+				printf("\n");
+				
+				// Best subject of the last generation, before selection replaces it
+				const nn::Population::Subject *best = population.subjects().front();
+				for (const nn::Population::Subject *subject : population.subjects())
+				{
+					if (nn::Population::ranksBefore(*subject, *best))
+						best = subject;
+				}
 				
-				if (vkCreateImageView(device, &sampleImageViewCI, nullptr, &sampleImageView) != VK_SUCCESS)
+				nn::Population::BrainScratch scratch;
+				const nn::NeuralNetwork &brain = population.brain(*best, scratch);
+				
+				if (int8Check)
+					checkQuantization(brain);
+				
+				if (! saveNetwork.empty())
 				{
-					throw std::runtime_error("failed to create texture image view!");
+					brain.save(saveNetwork);
+					printf("Network saved to '%s'\n", saveNetwork.c_str());
 				}
 			}
 			
-			VkDescriptorImageInfo populationImageInfo = {};
-			populationImageInfo.sampler = nearestSampler;
-			populationImageInfo.imageView = populationImageView;
-			populationImageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-			
-			VkDescriptorImageInfo sampleImageInfo = {};
-			sampleImageInfo.sampler = nearestSampler;
-			sampleImageInfo.imageView = sampleImageView;
-			sampleImageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-			
-			std::array<VkWriteDescriptorSet, 2> descriptorWrites = {};
-			
-			descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-			descriptorWrites[0].dstSet = descriptorSet;
-			descriptorWrites[0].dstBinding = 0;
-			descriptorWrites[0].dstArrayElement = 0;
-			descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-			descriptorWrites[0].descriptorCount = 1;
-			descriptorWrites[0].pImageInfo = &populationImageInfo;
-			descriptorWrites[0].pBufferInfo = nullptr;
-			descriptorWrites[0].pTexelBufferView = nullptr;
-			
-			descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-			descriptorWrites[1].dstSet = descriptorSet;
-			descriptorWrites[1].dstBinding = 1;
-			descriptorWrites[1].dstArrayElement = 0;
-			descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-			descriptorWrites[1].descriptorCount = 1;
-			descriptorWrites[1].pImageInfo = &sampleImageInfo;
-			descriptorWrites[1].pBufferInfo = nullptr;
-			descriptorWrites[1].pTexelBufferView = nullptr;
-		#endif
-		
-		vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, nullptr);
+			population.nextgeneration();
+			printf("\n");
+		}
 		
-		// ---------------------------------------------------------------------------------------------------------------
-		wvk::Device::CommandBuffer *ff = device.getOrCreateComputeCommandBuffer("feed forward");
-		device.beginRecordCommands(ff, 0);
-			vkCmdBindPipeline(ff->_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline->_pipeline);
+		return 0;
+		
+#ifdef VK_BACKEND
+		std::vector<nn::Population::Sample> trainingsamples;
+		readMNIST("MNIST/train", trainingsamples);
+		
+		uint32_t inputToHiddenWeightsSize = nInputs * nHidden;
+		uint32_t inputToHiddenBiasesSize = nHidden;
+		uint32_t hiddenToOutputWeightsSize = nHidden * nOutputs;
+		uint32_t hiddenToOutputBiasesSize = nOutputs;
+		uint32_t subjectSize = 
+			inputToHiddenWeightsSize + inputToHiddenBiasesSize + 
+			hiddenToOutputWeightsSize + hiddenToOutputBiasesSize;
+		uint32_t populationSize = nSubjects * subjectSize;
+		
+		uint32_t singleSampleSize = nInputs;
+		uint32_t sampleSize = nSamples * singleSampleSize;
+		
+		printf("Input to hidden weights size:  %s\n", nn::HumanReadableSize(inputToHiddenWeightsSize).str());
+		printf("Input to hidden biases size:   %s\n", nn::HumanReadableSize(inputToHiddenBiasesSize).str());
+		printf("Hidden to output weights size: %s\n", nn::HumanReadableSize(hiddenToOutputWeightsSize).str());
+		printf("Hidden to output biases size:  %s\n", nn::HumanReadableSize(hiddenToOutputBiasesSize).str());
+		printf("Subject size:                  %s\n", nn::HumanReadableSize(subjectSize).str());
+		printf("Population size:               %s\n", nn::HumanReadableSize(populationSize).str());
+		printf("Single sample size:            %s\n", nn::HumanReadableSize(singleSampleSize).str());
+		printf("Total sample size:             %s\n", nn::HumanReadableSize(sampleSize).str());
+		
+		std::vector<wvk::Device *> devices;
+		for (int index : vkDevices)
+		{
+			wvk::Device *device = new wvk::Device;
+			device->setValidationEnabled(true);
+			device->setPhysicalDeviceIndex(index);
+			device->setComputeQueueCount(vkQueues);
+			device->setStorage16BitEnabled(vkFp16);
+			device->create();
+			device->profiler()->setEnabled(vkProfile != nullptr);
 			
-			vkCmdBindDescriptorSets(
-				ff->_buffer, 							// commandBuffer
-				VK_PIPELINE_BIND_POINT_COMPUTE, 	// pipelineBindPoint
-				pipelineLayout, 						// layout
-				0, 										// firstSet
-				1, 										// descriptorSetCount
-				&descriptorSet, 						// pDescriptorSets
-				0, 										// dynamicOffsetCount
-				nullptr 									// pDynamicOffsets
-			);
+			printf("Device %d:                      %s, %d compute queue(s), dedicated transfer queue: %s, 16-bit storage: %s\n", 
+				(int)devices.size(), 
+				device->properties().deviceName, 
+				(int)device->computeQueueCount(), 
+				device->hasDedicatedTransferQueue() ? "yes" : "no", 
+				device->storage16BitEnabled() ? "yes" : "no");
 			
-			vkCmdDispatch(ff->_buffer, 32, 1, 1);
-		device.endRecordCommands(ff);
-		
-		device.submitComputeCommands(ff);
-		device.waitComputeQueueIdle();
-		device.destroyComputeCommandBuffer("feed forward");
+			devices.push_back(device);
+		}
 		
-		// ---------------------------------------------------------------------------------------------------------------
+		// The population is sharded across every compute queue of every device
+		std::vector<VkShard> shards;
+		for (wvk::Device *device : devices)
+		{
+			for (uint32_t iqueue = 0; iqueue < device->computeQueueCount(); ++iqueue)
+			{
+				shards.push_back(VkShard());
+				shards.back().create(device, iqueue);
+			}
+		}
 		
-		/* #ifdef DATA_BUFFER_BACKED
-			device.immediate(&wvk::Device::copy, outbuffer, stagingbuffer);
-		#endif
+		wvk::ShardScheduler scheduler((int)shards.size(), nSubjects);
 		
+		for (int i = 0; i < 10; ++i)
 		{
-			float *data = (float *)mmanager->map(stagingbuffer->_dm);
+			printf("Generation %3d - ", i);
+			fflush(stdout);
+			
+			std::vector<double> elapsed(shards.size(), 0.0);
+			std::vector<std::exception_ptr> errors(shards.size());
+			std::vector<std::thread> threads;
+			
+			std::vector<size_t> firstEvent;
+			for (wvk::Device *device : devices)
+			{
+				firstEvent.push_back(device->profiler()->eventCount());
+			}
+			
+			auto t0 = std::chrono::high_resolution_clock::now();
+			for (size_t ishard = 0; ishard < shards.size(); ++ishard)
+			{
+				threads.push_back(std::thread([&, ishard] () {
+					try
+					{
+						const wvk::ShardScheduler::Range &r = scheduler.range((int)ishard);
+						elapsed[ishard] = shards[ishard].evaluate(population, r._begin, r._end, trainingsamples);
+					}
+					catch (...)
+					{
+						errors[ishard] = std::current_exception();
+					}
+				}));
+			}
+			
+			for (std::thread &thread : threads)
+			{
+				thread.join();
+			}
+			auto t1 = std::chrono::high_resolution_clock::now();
+			
+			for (const std::exception_ptr &error : errors)
+			{
+				if (error)
+					std::rethrow_exception(error);
+			}
+			
+			std::chrono::duration<double> elapsed_seconds = t1 - t0;
+			std::string d = durationstring(elapsed_seconds);
 			
-			int i = 0;
-			for (; i < 4 * 1024 * 1024; ++i)
+			nn::Population::Statistics s = population.computePopulationStatistics();
+			
+			printf("duration: %s, error: %5.1f%%, shards:", d.c_str(), 100.0 * s._score);
+			for (size_t ishard = 0; ishard < shards.size(); ++ishard)
+			{
+				const wvk::ShardScheduler::Range &r = scheduler.range((int)ishard);
+				printf(" %d", r._end - r._begin);
+				scheduler.report((int)ishard, r._end - r._begin, elapsed[ishard]);
+			}
+			printf(", ");
+			
+			// GPU time summed over the queues of every device, readback is the host reading the outputs
+			if (vkProfile != nullptr)
 			{
-				if (data[i] != (float)i)
+				uint64_t upload = 0, dispatch = 0, readback = 0;
+				for (size_t idevice = 0; idevice < devices.size(); ++idevice)
 				{
-					break;
+					const wvk::Profiler *profiler = devices[idevice]->profiler();
+					upload += profiler->total("upload", firstEvent[idevice]);
+					dispatch += profiler->total("dispatch", firstEvent[idevice]);
+					readback += profiler->total("readback", firstEvent[idevice]);
 				}
+				
+				printf("upload: %.2f ms, dispatch: %.2f ms, readback: %.2f ms, ", upload * 1e-6, dispatch * 1e-6, readback * 1e-6);
 			}
-			printf("OK up to %d\n", i);
 			
-			mmanager->unmap(stagingbuffer->_dm);
-		} */
-				
-		// ---------------------------------------------------------------------------------------------------------------
-		vkDestroyDescriptorPool(device, descriptorPool, nullptr);
-		
-		cpManager->destroy(pipeline);
-		
-		#ifdef DATA_BUFFER_BACKED
-			bmanager->destroy(populationBuffer);
-			bmanager->destroy(sampleBuffer);
-		#endif
+			// The next generation is split after the throughput each shard was measured at
+			scheduler.rebalance();
+			
+			population.nextgeneration();
+			printf("\n");
+		}
 		
-		#ifdef DATA_IMAGE_BACKED
-			vkDestroyFence(device, bufferToImageFence, nullptr);
-			vkDestroySampler(device, nearestSampler, nullptr);
-			vkDestroyImageView(device, populationImageView, nullptr);
-			vkDestroyImageView(device, sampleImageView, nullptr);
-			imanager->destroy(populationImage);
-			imanager->destroy(sampleImage);
-		#endif
+		// ---------------------------------------------------------------------------------------------------------------
+		for (VkShard &shard : shards)
+		{
+			shard.destroy();
+		}
 		
-		bmanager->destroy(stagingbuffer);
+		if (vkProfile != nullptr)
+		{
+			std::vector<const wvk::Profiler *> profilers;
+			for (wvk::Device *device : devices)
+			{
+				profilers.push_back(device->profiler());
+			}
+			
+			if (! wvk::Profiler::writeChromeTrace(vkProfile, profilers))
+				printf("Failed to write %s\n", vkProfile);
+		}
 		
-		device.destroy();
+		for (wvk::Device *device : devices)
+		{
+			device->destroy();
+			delete device;
+		}
 #endif // VK_BACKEND
 	}
 	catch (const std::exception &ex)